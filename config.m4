@@ -4,6 +4,12 @@ PHP_ARG_ENABLE(webp, [whether to enable WebP support],
 PHP_ARG_WITH(webp-vpx-dir, [libvpx installation prefix],
 [  --with-webp-vpx-dir   libvpx installation prefix], yes, no)
 
+PHP_ARG_WITH(webp-jpeg-dir, [libjpeg installation prefix],
+[  --with-webp-jpeg-dir  libjpeg installation prefix (for webp_from_jpeg)], yes, no)
+
+PHP_ARG_WITH(webp-png-dir, [libpng installation prefix],
+[  --with-webp-png-dir   libpng installation prefix (for webp_from_png)], yes, no)
+
 if test "$PHP_WEBP" != "no"; then
   export OLD_CPPFLAGS="$CPPFLAGS"
   export CPPFLAGS="$CPPFLAGS $INCLUDES -DHAVE_WEBP"
@@ -46,9 +52,112 @@ if test "$PHP_WEBP" != "no"; then
 
   export CPPFLAGS="$OLD_CPPFLAGS"
 
+  dnl
+  dnl Check for POSIX threads (used by the row-band colour conversion)
+  dnl
+  WEBP_CFLAGS=""
+  AC_CHECK_HEADER([pthread.h], [
+    AC_CHECK_LIB(pthread, pthread_create, [
+      PHP_ADD_LIBRARY(pthread, 1, WEBP_SHARED_LIBADD)
+      WEBP_CFLAGS="$WEBP_CFLAGS -DWEBP_USE_PTHREAD"
+    ])
+  ])
+
+  dnl
+  dnl clock_gettime() lives in librt on older glibc (used by webp.stats)
+  dnl
+  AC_CHECK_LIB(rt, clock_gettime, [
+    PHP_ADD_LIBRARY(rt, 1, WEBP_SHARED_LIBADD)
+  ])
+
+  dnl
+  dnl Check for shared anonymous mappings and atomic builtins (used by
+  dnl webp_get_status)
+  dnl
+  AC_MSG_CHECKING([for the shared status segment])
+  AC_TRY_LINK([#include <sys/mman.h>], [
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+long *p = (long *)mmap(0, sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+return (int)__sync_fetch_and_add(p, 1L);
+],
+[AC_MSG_RESULT(yes)
+AC_DEFINE(HAVE_WEBP_STATUS, 1, [ ])],
+[AC_MSG_RESULT([no, webp_get_status() disabled])])
+
+  dnl
+  dnl Check the libjpeg support (optional)
+  dnl
+  WEBP_SOURCES="webp.c libwebp/src/webpimg.c"
+  WEBP_JPEG_DIR=""
+  if test "$PHP_WEBP_JPEG_DIR" != "no"; then
+    if test "$PHP_WEBP_JPEG_DIR" != "yes"; then
+      AC_MSG_CHECKING([for jpeglib.h])
+      if test -r "$PHP_WEBP_JPEG_DIR/include/jpeglib.h"; then
+        WEBP_JPEG_DIR="$PHP_WEBP_JPEG_DIR"
+        AC_MSG_RESULT([yes])
+      else
+        AC_MSG_ERROR([not found])
+      fi
+    else
+      AC_MSG_CHECKING([for jpeglib.h in default path])
+      for i in /usr /usr/local; do
+        if test -r "$i/include/jpeglib.h"; then
+          WEBP_JPEG_DIR=$i
+          AC_MSG_RESULT([found in $i])
+          break
+        fi
+      done
+      if test "x" = "x$WEBP_JPEG_DIR"; then
+        AC_MSG_RESULT([not found, webp_from_jpeg() disabled])
+      fi
+    fi
+  fi
+  if test "x" != "x$WEBP_JPEG_DIR"; then
+    PHP_ADD_INCLUDE($WEBP_JPEG_DIR/include)
+    PHP_ADD_LIBRARY_WITH_PATH(jpeg, $WEBP_JPEG_DIR/lib, WEBP_SHARED_LIBADD)
+    AC_DEFINE(HAVE_WEBP_JPEG, 1, [ ])
+    WEBP_SOURCES="$WEBP_SOURCES libwebp/src/webpio.c"
+  fi
+
+  dnl
+  dnl Check the libpng support (optional)
+  dnl
+  WEBP_PNG_DIR=""
+  if test "$PHP_WEBP_PNG_DIR" != "no"; then
+    if test "$PHP_WEBP_PNG_DIR" != "yes"; then
+      AC_MSG_CHECKING([for png.h])
+      if test -r "$PHP_WEBP_PNG_DIR/include/png.h"; then
+        WEBP_PNG_DIR="$PHP_WEBP_PNG_DIR"
+        AC_MSG_RESULT([yes])
+      else
+        AC_MSG_ERROR([not found])
+      fi
+    else
+      AC_MSG_CHECKING([for png.h in default path])
+      for i in /usr /usr/local; do
+        if test -r "$i/include/png.h"; then
+          WEBP_PNG_DIR=$i
+          AC_MSG_RESULT([found in $i])
+          break
+        fi
+      done
+      if test "x" = "x$WEBP_PNG_DIR"; then
+        AC_MSG_RESULT([not found, webp_from_png() disabled])
+      fi
+    fi
+  fi
+  if test "x" != "x$WEBP_PNG_DIR"; then
+    PHP_ADD_INCLUDE($WEBP_PNG_DIR/include)
+    PHP_ADD_LIBRARY_WITH_PATH(png, $WEBP_PNG_DIR/lib, WEBP_SHARED_LIBADD)
+    AC_DEFINE(HAVE_WEBP_PNG, 1, [ ])
+    WEBP_SOURCES="$WEBP_SOURCES libwebp/src/webpio_png.c"
+  fi
+
   PHP_ADD_INCLUDE(./libwebp/src)
   PHP_SUBST(WEBP_SHARED_LIBADD)
   AC_DEFINE(HAVE_WEBP, 1, [ ])
 
-  PHP_NEW_EXTENSION(webp, webp.c libwebp/src/webpimg.c, $ext_shared)
+  PHP_NEW_EXTENSION(webp, $WEBP_SOURCES, $ext_shared, , $WEBP_CFLAGS)
 fi
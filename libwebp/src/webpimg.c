@@ -39,11 +39,83 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#ifdef WEBP_USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if defined(__SSE2__) && !defined(WEBP_NO_SIMD)
+#define WEBP_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "vpx/vpx_decoder.h"
 #include "vpx/vp8dx.h"
 #include "vpx/vpx_encoder.h"
 #include "vpx/vp8cx.h"
 
+/*---------------------------------------------------------------------*
+ *                              row bands                              *
+ *---------------------------------------------------------------------*/
+
+/* Work function for one band: processes row pairs [first, last). */
+typedef void (*RowBandFunc)(void* arg, int first, int last);
+
+typedef struct {
+  RowBandFunc func;
+  void* arg;
+  int first;
+  int last;
+} RowBand;
+
+#ifdef WEBP_USE_PTHREAD
+static void* RowBandThread(void* ptr) {
+  RowBand* const band = (RowBand*)ptr;
+  band->func(band->arg, band->first, band->last);
+  return NULL;
+}
+#endif
+
+/* Splits num_pairs row pairs into num_threads contiguous bands and runs
+ * func over each of them. The calling thread processes the last band
+ * itself. Bands whose thread cannot be started are processed inline, so
+ * the whole range is always covered.
+ */
+static void RunRowBands(RowBandFunc func, void* arg,
+                        int num_pairs, int num_threads) {
+#ifdef WEBP_USE_PTHREAD
+  RowBand bands[WEBP_MAX_THREADS];
+  pthread_t threads[WEBP_MAX_THREADS];
+  int started[WEBP_MAX_THREADS];
+  int i;
+
+  if (num_threads > WEBP_MAX_THREADS) num_threads = WEBP_MAX_THREADS;
+  if (num_threads > num_pairs) num_threads = num_pairs;
+  if (num_threads > 1) {
+    for (i = 0; i < num_threads; ++i) {
+      bands[i].func = func;
+      bands[i].arg = arg;
+      bands[i].first = (int)((long long)num_pairs * i / num_threads);
+      bands[i].last = (int)((long long)num_pairs * (i + 1) / num_threads);
+    }
+    for (i = 0; i < num_threads - 1; ++i) {
+      started[i] = !pthread_create(&threads[i], NULL,
+                                   RowBandThread, &bands[i]);
+      if (!started[i]) {
+        func(arg, bands[i].first, bands[i].last);
+      }
+    }
+    func(arg, bands[i].first, bands[i].last);
+    for (i = 0; i < num_threads - 1; ++i) {
+      if (started[i]) pthread_join(threads[i], NULL);
+    }
+    return;
+  }
+#else
+  (void)num_threads;
+#endif
+  func(arg, 0, num_pairs);
+}
+
 /*---------------------------------------------------------------------*
  *                              color conversions                      *
  *---------------------------------------------------------------------*/
@@ -122,26 +194,183 @@ static inline int GetChromaV(int r, int g, int b) {
 enum { RGB_FRAC = 16, RGB_HALF = (1 << RGB_FRAC) / 2,
        RGB_RANGE_MIN = -227, RGB_RANGE_MAX = 256 + 226 };
 
-static int init_done = 0;
-static int16_t kVToR[256], kUToB[256];
-static int32_t kVToG[256], kUToG[256];
-static uint8_t kClip[RGB_RANGE_MAX - RGB_RANGE_MIN];
+/* The conversion tables are constant, so they are spelled out here rather
+ * than filled in on first use: no lazy initialization means no data race
+ * when several threads decode at once. They were generated from
+ *   kVToR[i] = (89858 * (i - 128) + RGB_HALF) >> RGB_FRAC
+ *   kUToG[i] = -22014 * (i - 128) + RGB_HALF
+ *   kVToG[i] = -45773 * (i - 128)
+ *   kUToB[i] = (113618 * (i - 128) + RGB_HALF) >> RGB_FRAC
+ *   kClip[i - RGB_RANGE_MIN] = clamp(((i - 16) * 76283 + RGB_HALF) >> RGB_FRAC)
+ * for i in [0, 256) and [RGB_RANGE_MIN, RGB_RANGE_MAX) respectively.
+ */
+static const int16_t kVToR[256] = {
+  -176, -174, -173, -171, -170, -169, -167, -166, -165, -163, -162, -160,
+  -159, -158, -156, -155, -154, -152, -151, -149, -148, -147, -145, -144,
+  -143, -141, -140, -138, -137, -136, -134, -133, -132, -130, -129, -128,
+  -126, -125, -123, -122, -121, -119, -118, -117, -115, -114, -112, -111,
+  -110, -108, -107, -106, -104, -103, -101, -100,  -99,  -97,  -96,  -95,
+   -93,  -92,  -90,  -89,  -88,  -86,  -85,  -84,  -82,  -81,  -80,  -78,
+   -77,  -75,  -74,  -73,  -71,  -70,  -69,  -67,  -66,  -64,  -63,  -62,
+   -60,  -59,  -58,  -56,  -55,  -53,  -52,  -51,  -49,  -48,  -47,  -45,
+   -44,  -43,  -41,  -40,  -38,  -37,  -36,  -34,  -33,  -32,  -30,  -29,
+   -27,  -26,  -25,  -23,  -22,  -21,  -19,  -18,  -16,  -15,  -14,  -12,
+   -11,  -10,   -8,   -7,   -5,   -4,   -3,   -1,    0,    1,    3,    4,
+     5,    7,    8,   10,   11,   12,   14,   15,   16,   18,   19,   21,
+    22,   23,   25,   26,   27,   29,   30,   32,   33,   34,   36,   37,
+    38,   40,   41,   43,   44,   45,   47,   48,   49,   51,   52,   53,
+    55,   56,   58,   59,   60,   62,   63,   64,   66,   67,   69,   70,
+    71,   73,   74,   75,   77,   78,   80,   81,   82,   84,   85,   86,
+    88,   89,   90,   92,   93,   95,   96,   97,   99,  100,  101,  103,
+   104,  106,  107,  108,  110,  111,  112,  114,  115,  117,  118,  119,
+   121,  122,  123,  125,  126,  128,  129,  130,  132,  133,  134,  136,
+   137,  138,  140,  141,  143,  144,  145,  147,  148,  149,  151,  152,
+   154,  155,  156,  158,  159,  160,  162,  163,  165,  166,  167,  169,
+   170,  171,  173,  174
+};
 
-static void InitTables() {
-  int i;
-  for (i = 0; i < 256; ++i) {
-    kVToR[i] = (89858 * (i - 128) + RGB_HALF) >> RGB_FRAC;
-    kUToG[i] = -22014 * (i - 128) + RGB_HALF;
-    kVToG[i] = -45773 * (i - 128);
-    kUToB[i] = (113618 * (i - 128) + RGB_HALF) >> RGB_FRAC;
-  }
-  for (i = RGB_RANGE_MIN; i < RGB_RANGE_MAX; ++i) {
-    const int j = ((i - 16) * 76283 + RGB_HALF) >> RGB_FRAC;
-    kClip[i - RGB_RANGE_MIN] = (j < 0) ? 0 : (j > 255) ? 255 : j;
-  }
+static const int32_t kUToG[256] = {
+   2850560,  2828546,  2806532,  2784518,  2762504,  2740490,  2718476,  2696462,
+   2674448,  2652434,  2630420,  2608406,  2586392,  2564378,  2542364,  2520350,
+   2498336,  2476322,  2454308,  2432294,  2410280,  2388266,  2366252,  2344238,
+   2322224,  2300210,  2278196,  2256182,  2234168,  2212154,  2190140,  2168126,
+   2146112,  2124098,  2102084,  2080070,  2058056,  2036042,  2014028,  1992014,
+   1970000,  1947986,  1925972,  1903958,  1881944,  1859930,  1837916,  1815902,
+   1793888,  1771874,  1749860,  1727846,  1705832,  1683818,  1661804,  1639790,
+   1617776,  1595762,  1573748,  1551734,  1529720,  1507706,  1485692,  1463678,
+   1441664,  1419650,  1397636,  1375622,  1353608,  1331594,  1309580,  1287566,
+   1265552,  1243538,  1221524,  1199510,  1177496,  1155482,  1133468,  1111454,
+   1089440,  1067426,  1045412,  1023398,  1001384,   979370,   957356,   935342,
+    913328,   891314,   869300,   847286,   825272,   803258,   781244,   759230,
+    737216,   715202,   693188,   671174,   649160,   627146,   605132,   583118,
+    561104,   539090,   517076,   495062,   473048,   451034,   429020,   407006,
+    384992,   362978,   340964,   318950,   296936,   274922,   252908,   230894,
+    208880,   186866,   164852,   142838,   120824,    98810,    76796,    54782,
+     32768,    10754,   -11260,   -33274,   -55288,   -77302,   -99316,  -121330,
+   -143344,  -165358,  -187372,  -209386,  -231400,  -253414,  -275428,  -297442,
+   -319456,  -341470,  -363484,  -385498,  -407512,  -429526,  -451540,  -473554,
+   -495568,  -517582,  -539596,  -561610,  -583624,  -605638,  -627652,  -649666,
+   -671680,  -693694,  -715708,  -737722,  -759736,  -781750,  -803764,  -825778,
+   -847792,  -869806,  -891820,  -913834,  -935848,  -957862,  -979876, -1001890,
+  -1023904, -1045918, -1067932, -1089946, -1111960, -1133974, -1155988, -1178002,
+  -1200016, -1222030, -1244044, -1266058, -1288072, -1310086, -1332100, -1354114,
+  -1376128, -1398142, -1420156, -1442170, -1464184, -1486198, -1508212, -1530226,
+  -1552240, -1574254, -1596268, -1618282, -1640296, -1662310, -1684324, -1706338,
+  -1728352, -1750366, -1772380, -1794394, -1816408, -1838422, -1860436, -1882450,
+  -1904464, -1926478, -1948492, -1970506, -1992520, -2014534, -2036548, -2058562,
+  -2080576, -2102590, -2124604, -2146618, -2168632, -2190646, -2212660, -2234674,
+  -2256688, -2278702, -2300716, -2322730, -2344744, -2366758, -2388772, -2410786,
+  -2432800, -2454814, -2476828, -2498842, -2520856, -2542870, -2564884, -2586898,
+  -2608912, -2630926, -2652940, -2674954, -2696968, -2718982, -2740996, -2763010
+};
 
-  init_done = 1;
-}
+static const int32_t kVToG[256] = {
+   5858944,  5813171,  5767398,  5721625,  5675852,  5630079,  5584306,  5538533,
+   5492760,  5446987,  5401214,  5355441,  5309668,  5263895,  5218122,  5172349,
+   5126576,  5080803,  5035030,  4989257,  4943484,  4897711,  4851938,  4806165,
+   4760392,  4714619,  4668846,  4623073,  4577300,  4531527,  4485754,  4439981,
+   4394208,  4348435,  4302662,  4256889,  4211116,  4165343,  4119570,  4073797,
+   4028024,  3982251,  3936478,  3890705,  3844932,  3799159,  3753386,  3707613,
+   3661840,  3616067,  3570294,  3524521,  3478748,  3432975,  3387202,  3341429,
+   3295656,  3249883,  3204110,  3158337,  3112564,  3066791,  3021018,  2975245,
+   2929472,  2883699,  2837926,  2792153,  2746380,  2700607,  2654834,  2609061,
+   2563288,  2517515,  2471742,  2425969,  2380196,  2334423,  2288650,  2242877,
+   2197104,  2151331,  2105558,  2059785,  2014012,  1968239,  1922466,  1876693,
+   1830920,  1785147,  1739374,  1693601,  1647828,  1602055,  1556282,  1510509,
+   1464736,  1418963,  1373190,  1327417,  1281644,  1235871,  1190098,  1144325,
+   1098552,  1052779,  1007006,   961233,   915460,   869687,   823914,   778141,
+    732368,   686595,   640822,   595049,   549276,   503503,   457730,   411957,
+    366184,   320411,   274638,   228865,   183092,   137319,    91546,    45773,
+         0,   -45773,   -91546,  -137319,  -183092,  -228865,  -274638,  -320411,
+   -366184,  -411957,  -457730,  -503503,  -549276,  -595049,  -640822,  -686595,
+   -732368,  -778141,  -823914,  -869687,  -915460,  -961233, -1007006, -1052779,
+  -1098552, -1144325, -1190098, -1235871, -1281644, -1327417, -1373190, -1418963,
+  -1464736, -1510509, -1556282, -1602055, -1647828, -1693601, -1739374, -1785147,
+  -1830920, -1876693, -1922466, -1968239, -2014012, -2059785, -2105558, -2151331,
+  -2197104, -2242877, -2288650, -2334423, -2380196, -2425969, -2471742, -2517515,
+  -2563288, -2609061, -2654834, -2700607, -2746380, -2792153, -2837926, -2883699,
+  -2929472, -2975245, -3021018, -3066791, -3112564, -3158337, -3204110, -3249883,
+  -3295656, -3341429, -3387202, -3432975, -3478748, -3524521, -3570294, -3616067,
+  -3661840, -3707613, -3753386, -3799159, -3844932, -3890705, -3936478, -3982251,
+  -4028024, -4073797, -4119570, -4165343, -4211116, -4256889, -4302662, -4348435,
+  -4394208, -4439981, -4485754, -4531527, -4577300, -4623073, -4668846, -4714619,
+  -4760392, -4806165, -4851938, -4897711, -4943484, -4989257, -5035030, -5080803,
+  -5126576, -5172349, -5218122, -5263895, -5309668, -5355441, -5401214, -5446987,
+  -5492760, -5538533, -5584306, -5630079, -5675852, -5721625, -5767398, -5813171
+};
+
+static const int16_t kUToB[256] = {
+  -222, -220, -218, -217, -215, -213, -212, -210, -208, -206, -205, -203,
+  -201, -199, -198, -196, -194, -192, -191, -189, -187, -186, -184, -182,
+  -180, -179, -177, -175, -173, -172, -170, -168, -166, -165, -163, -161,
+  -159, -158, -156, -154, -153, -151, -149, -147, -146, -144, -142, -140,
+  -139, -137, -135, -133, -132, -130, -128, -127, -125, -123, -121, -120,
+  -118, -116, -114, -113, -111, -109, -107, -106, -104, -102, -101,  -99,
+   -97,  -95,  -94,  -92,  -90,  -88,  -87,  -85,  -83,  -81,  -80,  -78,
+   -76,  -75,  -73,  -71,  -69,  -68,  -66,  -64,  -62,  -61,  -59,  -57,
+   -55,  -54,  -52,  -50,  -49,  -47,  -45,  -43,  -42,  -40,  -38,  -36,
+   -35,  -33,  -31,  -29,  -28,  -26,  -24,  -23,  -21,  -19,  -17,  -16,
+   -14,  -12,  -10,   -9,   -7,   -5,   -3,   -2,    0,    2,    3,    5,
+     7,    9,   10,   12,   14,   16,   17,   19,   21,   23,   24,   26,
+    28,   29,   31,   33,   35,   36,   38,   40,   42,   43,   45,   47,
+    49,   50,   52,   54,   55,   57,   59,   61,   62,   64,   66,   68,
+    69,   71,   73,   75,   76,   78,   80,   81,   83,   85,   87,   88,
+    90,   92,   94,   95,   97,   99,  101,  102,  104,  106,  107,  109,
+   111,  113,  114,  116,  118,  120,  121,  123,  125,  127,  128,  130,
+   132,  133,  135,  137,  139,  140,  142,  144,  146,  147,  149,  151,
+   153,  154,  156,  158,  159,  161,  163,  165,  166,  168,  170,  172,
+   173,  175,  177,  179,  180,  182,  184,  186,  187,  189,  191,  192,
+   194,  196,  198,  199,  201,  203,  205,  206,  208,  210,  212,  213,
+   215,  217,  218,  220
+};
+
+static const uint8_t kClip[RGB_RANGE_MAX - RGB_RANGE_MIN] = {
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   1,   2,   3,   5,   6,   7,   8,   9,  10,  12,  13,  14,
+   15,  16,  17,  19,  20,  21,  22,  23,  24,  26,  27,  28,  29,  30,  31,  33,
+   34,  35,  36,  37,  38,  40,  41,  42,  43,  44,  45,  47,  48,  49,  50,  51,
+   52,  54,  55,  56,  57,  58,  59,  61,  62,  63,  64,  65,  66,  68,  69,  70,
+   71,  72,  73,  74,  76,  77,  78,  79,  80,  81,  83,  84,  85,  86,  87,  88,
+   90,  91,  92,  93,  94,  95,  97,  98,  99, 100, 101, 102, 104, 105, 106, 107,
+  108, 109, 111, 112, 113, 114, 115, 116, 118, 119, 120, 121, 122, 123, 125, 126,
+  127, 128, 129, 130, 132, 133, 134, 135, 136, 137, 139, 140, 141, 142, 143, 144,
+  145, 147, 148, 149, 150, 151, 152, 154, 155, 156, 157, 158, 159, 161, 162, 163,
+  164, 165, 166, 168, 169, 170, 171, 172, 173, 175, 176, 177, 178, 179, 180, 182,
+  183, 184, 185, 186, 187, 189, 190, 191, 192, 193, 194, 196, 197, 198, 199, 200,
+  201, 203, 204, 205, 206, 207, 208, 210, 211, 212, 213, 214, 215, 217, 218, 219,
+  220, 221, 222, 223, 225, 226, 227, 228, 229, 230, 232, 233, 234, 235, 236, 237,
+  239, 240, 241, 242, 243, 244, 246, 247, 248, 249, 250, 251, 253, 254, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255
+};
 
 static void ToRGB(int y, int u, int v, uint32* const dst) {
   const int r_off = kVToR[v];
@@ -198,6 +427,156 @@ double GetPSNRYuv(const uint8* Y1,
   return -4.3429448 * log(sse / (255. * 255. * count));
 }
 
+/* Sums of two horizontally adjacent 4x4 blocks, as x264 computes them for
+ * its SSIM: sums[i] = { sum(a), sum(b), sum(a*a + b*b), sum(a*b) } of
+ * block i.
+ */
+#ifdef WEBP_USE_SSE2
+static void SSIMBlockSums(const uint8* a, int a_stride,
+                          const uint8* b, int b_stride, int sums[2][4]) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i sa = zero, sb = zero, ss = zero, s12 = zero;
+  int out[4][4];
+  int y, i;
+  for (y = 0; y < 4; ++y) {
+    const __m128i a16 = _mm_unpacklo_epi8(
+        _mm_loadl_epi64((const __m128i*)(a + y * a_stride)), zero);
+    const __m128i b16 = _mm_unpacklo_epi8(
+        _mm_loadl_epi64((const __m128i*)(b + y * b_stride)), zero);
+    sa = _mm_add_epi16(sa, a16);
+    sb = _mm_add_epi16(sb, b16);
+    ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(a16, a16),
+                                         _mm_madd_epi16(b16, b16)));
+    s12 = _mm_add_epi32(s12, _mm_madd_epi16(a16, b16));
+  }
+  /* pairs of lanes: 0, 1 belong to the first block, 2, 3 to the second */
+  _mm_storeu_si128((__m128i*)out[0], _mm_madd_epi16(sa, ones));
+  _mm_storeu_si128((__m128i*)out[1], _mm_madd_epi16(sb, ones));
+  _mm_storeu_si128((__m128i*)out[2], ss);
+  _mm_storeu_si128((__m128i*)out[3], s12);
+  for (i = 0; i < 4; ++i) {
+    sums[0][i] = out[i][0] + out[i][1];
+    sums[1][i] = out[i][2] + out[i][3];
+  }
+}
+#else
+static void SSIMBlockSums(const uint8* a, int a_stride,
+                          const uint8* b, int b_stride, int sums[2][4]) {
+  int x, y, z;
+  for (z = 0; z < 2; ++z) {
+    int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+    for (y = 0; y < 4; ++y) {
+      for (x = 0; x < 4; ++x) {
+        const int pa = a[y * a_stride + z * 4 + x];
+        const int pb = b[y * b_stride + z * 4 + x];
+        s1 += pa;
+        s2 += pb;
+        ss += pa * pa + pb * pb;
+        s12 += pa * pb;
+      }
+    }
+    sums[z][0] = s1;
+    sums[z][1] = s2;
+    sums[z][2] = ss;
+    sums[z][3] = s12;
+  }
+}
+#endif
+
+/* SSIM of one 8x8 window from its sums */
+static double SSIMWindow(int s1, int s2, int ss, int s12) {
+  static const int kC1 = (int)(.01 * .01 * 255 * 255 * 64 + .5);
+  static const int kC2 = (int)(.03 * .03 * 255 * 255 * 64 * 63 + .5);
+  const int vars = ss * 64 - s1 * s1 - s2 * s2;
+  const int covar = s12 * 64 - s1 * s2;
+  return (double)(2 * s1 * s2 + kC1) * (double)(2 * covar + kC2)
+      / ((double)(s1 * s1 + s2 * s2 + kC1) * (double)(vars + kC2));
+}
+
+/* Mean SSIM of a plane over overlapping 8x8 windows at a 4 pixel step.
+ * Planes too small for a window are compared as a whole.
+ */
+static double GetSSIMPlane(const uint8* a, const uint8* b,
+                           int width, int height) {
+  const int bw = width >> 2;
+  const int bh = height >> 2;
+  int (*buf)[4];
+  int (*sums)[4];
+  int (*prev)[4];
+  int (*tmp)[4];
+  double ssim = 0.;
+  int x, y, i;
+
+  if (bw < 2 || bh < 2) {
+    double s1 = 0., s2 = 0., ss = 0., s12 = 0., n = (double)width * height;
+    for (i = 0; i < width * height; ++i) {
+      s1 += a[i];
+      s2 += b[i];
+      ss += (double)a[i] * a[i] + (double)b[i] * b[i];
+      s12 += (double)a[i] * b[i];
+    }
+    {
+      const double c1 = .01 * .01 * 255 * 255, c2 = .03 * .03 * 255 * 255;
+      const double m1 = s1 / n, m2 = s2 / n;
+      const double vars = ss / n - m1 * m1 - m2 * m2;
+      const double covar = s12 / n - m1 * m2;
+      return (2 * m1 * m2 + c1) * (2 * covar + c2)
+          / ((m1 * m1 + m2 * m2 + c1) * (vars + c2));
+    }
+  }
+
+  buf = (int (*)[4])malloc(2 * (bw + 1) * sizeof(*buf));
+  if (buf == NULL) return 0.;
+  sums = buf;
+  prev = buf + bw + 1;
+  for (y = 0; y < bh; ++y) {
+    const uint8* const ra = a + 4 * y * width;
+    const uint8* const rb = b + 4 * y * width;
+    for (x = 0; x + 1 < bw; x += 2) {
+      SSIMBlockSums(ra + 4 * x, width, rb + 4 * x, width, &sums[x]);
+    }
+    if (x < bw) {   /* odd count: the last block pairs with its left one */
+      int pair[2][4];
+      SSIMBlockSums(ra + 4 * (x - 1), width, rb + 4 * (x - 1), width, pair);
+      memcpy(sums[x], pair[1], sizeof(pair[1]));
+    }
+    if (y > 0) {
+      for (x = 0; x + 1 < bw; ++x) {
+        ssim += SSIMWindow(
+            prev[x][0] + prev[x + 1][0] + sums[x][0] + sums[x + 1][0],
+            prev[x][1] + prev[x + 1][1] + sums[x][1] + sums[x + 1][1],
+            prev[x][2] + prev[x + 1][2] + sums[x][2] + sums[x + 1][2],
+            prev[x][3] + prev[x + 1][3] + sums[x][3] + sums[x + 1][3]);
+      }
+    }
+    tmp = prev;
+    prev = sums;
+    sums = tmp;
+  }
+  free(buf);
+  return ssim / ((double)(bw - 1) * (bh - 1));
+}
+
+double GetSSIMYuv(const uint8* Y1,
+                  const uint8* U1,
+                  const uint8* V1,
+                  const uint8* Y2,
+                  const uint8* U2,
+                  const uint8* V2,
+                  int y_width,
+                  int y_height,
+                  int with_chroma) {
+  const int uv_width = ((y_width + 1) >> 1);
+  const int uv_height = ((y_height + 1) >> 1);
+  const double ssim_y = GetSSIMPlane(Y1, Y2, y_width, y_height);
+  if (!with_chroma) return ssim_y;
+  /* weighted by the number of samples, as GetPSNRYuv does */
+  return (4. * ssim_y
+          + GetSSIMPlane(U1, U2, uv_width, uv_height)
+          + GetSSIMPlane(V1, V2, uv_width, uv_height)) / 6.;
+}
+
 /* Returns the difference (in dB) between two images. One represented
  * using Y,U,V vectors and the other is webp image data.
  * Input:
@@ -317,6 +696,61 @@ static void YUV420toRGBLine(uint8* y_src,
  *     6. pixdata: the output data buffer. Caller should allocate
  *                 height * pixwpl bytes of memory before calling this routine.
  */
+typedef struct {
+  uint8* Y;
+  uint8* U;
+  uint8* V;
+  int words_per_line;
+  int width;
+  int height;
+  uint32* pixdata;
+  int flat;          /* U and V are constant: use luma_to_rgb only */
+  uint32 luma_to_rgb[256];
+} YUV420toRGBAArgs;
+
+/* Returns true if every sample of the U plane equals U[0] and every sample
+ * of the V plane equals V[0], i.e. the image carries no chroma detail
+ * (grayscale, or a single tint).
+ */
+static int IsFlatChroma(const uint8* U, const uint8* V, int uv_size) {
+  const uint8 u = U[0], v = V[0];
+  int i;
+  for (i = 0; i < uv_size; ++i) {
+    if (U[i] != u || V[i] != v) return 0;
+  }
+  return 1;
+}
+
+static void YUV420toRGBABand(void* arg, int first, int last) {
+  const YUV420toRGBAArgs* const a = (const YUV420toRGBAArgs*)arg;
+  int y_stride = a->width;
+  int uv_stride = ((a->width + 1) >> 1);
+  int x, y, y_end = 2 * last;
+
+  if (y_end > a->height) y_end = a->height;
+  if (a->flat) {
+    /* no chroma upsampling: every pixel is a function of its luma alone */
+    for (y = 2 * first; y < y_end; ++y) {
+      const uint8* const y_src = a->Y + y * y_stride;
+      uint32* const rgb_dst = a->pixdata + y * a->words_per_line;
+      for (x = 0; x < a->width; ++x) {
+        rgb_dst[x] = a->luma_to_rgb[y_src[x]];
+      }
+    }
+    return;
+  }
+  /* note that the U, V upsampling in height is happening here as the U, V
+   * buffers sent to successive odd-even pair of lines is same.
+   */
+  for (y = 2 * first; y < y_end; ++y) {
+    YUV420toRGBLine(a->Y + y * y_stride,
+                    a->U + (y >> 1) * uv_stride,
+                    a->V + (y >> 1) * uv_stride,
+                    a->width,
+                    a->pixdata + y * a->words_per_line);
+  }
+}
+
 void YUV420toRGBA(uint8* Y,
                   uint8* U,
                   uint8* V,
@@ -324,25 +758,78 @@ void YUV420toRGBA(uint8* Y,
                   int width,
                   int height,
                   uint32* pixdata) {
-  int y_width = width;
-  int y_stride = y_width;
-  int uv_width = ((y_width + 1) >> 1);
-  int uv_stride = uv_width;
+  YUV420toRGBAThreaded(Y, U, V, words_per_line, width, height, pixdata, 1);
+}
+
+void YUV420toRGBAThreaded(uint8* Y,
+                          uint8* U,
+                          uint8* V,
+                          int words_per_line,
+                          int width,
+                          int height,
+                          uint32* pixdata,
+                          int num_threads) {
+  YUV420toRGBAArgs args;
+
+  args.Y = Y;
+  args.U = U;
+  args.V = V;
+  args.words_per_line = words_per_line;
+  args.width = width;
+  args.height = height;
+  args.pixdata = pixdata;
+  args.flat = (width > 0 && height > 0
+               && IsFlatChroma(U, V, ((width + 1) >> 1) * ((height + 1) >> 1)));
+  if (args.flat) {
+    int i;
+    for (i = 0; i < 256; ++i) {
+      ToRGB(i, U[0], V[0], &args.luma_to_rgb[i]);
+    }
+  }
+  RunRowBands(YUV420toRGBABand, &args, (height + 1) >> 1, num_threads);
+}
+
+/* Copies the planes of a decoded frame into Y, U, V buffers with the given
+ * row strides.
+ */
+static void CopyPlanes(const vpx_image_t* img,
+                       uint8* Y, uint8* U, uint8* V,
+                       int y_stride, int uv_stride) {
+  const int y_width = img->d_w;
+  const int y_height = img->d_h;
+  const int uv_width = (y_width + 1) >> 1;
+  const int uv_height = (y_height + 1) >> 1;
   int y;
+  for (y = 0; y < y_height; ++y) {
+    memcpy(Y + y * y_stride,
+           img->planes[0] + y * img->stride[0],
+           y_width);
+  }
+  for (y = 0; y < uv_height; ++y) {
+    memcpy(U + y * uv_stride,
+           img->planes[1] + y * img->stride[1],
+           uv_width);
+    memcpy(V + y * uv_stride,
+           img->planes[2] + y * img->stride[2],
+           uv_width);
+  }
+}
 
-  if (!init_done)
-    InitTables();
+/* Decodes the raw VP8 data with an already initialized decoder and returns
+ * the frame, or NULL on failure. The frame is owned by the decoder.
+ */
+static vpx_image_t* VPXDecodeFrame(vpx_codec_ctx_t* dec,
+                                   const uint8* data,
+                                   int data_size) {
+  vp8_postproc_cfg_t ppcfg;
+  ppcfg.post_proc_flag = VP8_NOFILTERING;
+  vpx_codec_control(dec, VP8_SET_POSTPROC, &ppcfg);
 
-  /* note that the U, V upsampling in height is happening here as the U, V
-   * buffers sent to successive odd-even pair of lines is same.
-   */
-  for (y = 0; y < height; ++y) {
-    YUV420toRGBLine(Y + y * y_stride,
-                    U + (y >> 1) * uv_stride,
-                    V + (y >> 1) * uv_stride,
-                    width,
-                    pixdata + y * words_per_line);
+  if (vpx_codec_decode(dec, data, data_size, NULL, 0) == VPX_CODEC_OK) {
+    vpx_codec_iter_t iter = NULL;
+    return vpx_codec_get_frame(dec, &iter);
   }
+  return NULL;
 }
 
 static WebPResult VPXDecode(const uint8* data,
@@ -362,45 +849,25 @@ static WebPResult VPXDecode(const uint8* data,
     return webp_failure;
   }
 
-  vp8_postproc_cfg_t ppcfg;
-  ppcfg.post_proc_flag = VP8_NOFILTERING;
-  vpx_codec_control(&dec, VP8_SET_POSTPROC, &ppcfg);
-
   WebPResult result = webp_failure;
-  if (vpx_codec_decode(&dec, data, data_size, NULL, 0) == VPX_CODEC_OK) {
-    vpx_codec_iter_t iter = NULL;
-    vpx_image_t* const img = vpx_codec_get_frame(&dec, &iter);
-    if (img) {
-      int y_width = img->d_w;
-      int y_height = img->d_h;
-      int y_stride = y_width;
-      int uv_width = (y_width + 1) >> 1;
-      int uv_stride = uv_width;
-      int uv_height = ((y_height + 1) >> 1);
-      int y;
-
-      *p_width = y_width;
-      *p_height = y_height;
-      if ((*p_Y = (uint8 *)(calloc(y_stride * y_height
-                                   + 2 * uv_stride * uv_height,
-                                   sizeof(uint8)))) != NULL) {
-        *p_U = *p_Y + y_height * y_stride;
-        *p_V = *p_U + uv_height * uv_stride;
-        for (y = 0; y < y_height; ++y) {
-          memcpy(*p_Y + y * y_stride,
-                 img->planes[0] + y * img->stride[0],
-                 y_width);
-        }
-        for (y = 0; y < uv_height; ++y) {
-          memcpy(*p_U + y * uv_stride,
-                 img->planes[1] + y * img->stride[1],
-                 uv_width);
-          memcpy(*p_V + y * uv_stride,
-                 img->planes[2] + y * img->stride[2],
-                 uv_width);
-        }
-        result = webp_success;
-      }
+  vpx_image_t* const img = VPXDecodeFrame(&dec, data, data_size);
+  if (img) {
+    int y_width = img->d_w;
+    int y_height = img->d_h;
+    int y_stride = y_width;
+    int uv_width = (y_width + 1) >> 1;
+    int uv_stride = uv_width;
+    int uv_height = ((y_height + 1) >> 1);
+
+    *p_width = y_width;
+    *p_height = y_height;
+    if ((*p_Y = (uint8 *)(calloc(y_stride * y_height
+                                 + 2 * uv_stride * uv_height,
+                                 sizeof(uint8)))) != NULL) {
+      *p_U = *p_Y + y_height * y_stride;
+      *p_V = *p_U + uv_height * uv_stride;
+      CopyPlanes(img, *p_Y, *p_U, *p_V, y_stride, uv_stride);
+      result = webp_success;
     }
   }
   vpx_codec_destroy(&dec);
@@ -424,6 +891,42 @@ WebPResult WebPDecode(const uint8* data,
   return VPXDecode(data, data_size, p_Y, p_U, p_V, p_width, p_height);
 }
 
+WebPResult WebPDecodeInto(const uint8* data,
+                          int data_size,
+                          uint8* Y,
+                          uint8* U,
+                          uint8* V,
+                          int y_stride,
+                          int uv_stride,
+                          int width,
+                          int height) {
+  const uint32 chunk_size = SkipRiffHeader(&data, &data_size);
+  if (!chunk_size) {
+    return webp_failure; /* unsupported RIFF header */
+  }
+  if (!data || data_size <= 10 || !Y || !U || !V
+      || width <= 0 || height <= 0
+      || y_stride < width || uv_stride < ((width + 1) >> 1)) {
+    return webp_failure;
+  }
+  vpx_codec_ctx_t dec;
+  if (vpx_codec_dec_init(&dec,
+                         &vpx_codec_vp8_dx_algo, NULL, 0) != VPX_CODEC_OK) {
+    return webp_failure;
+  }
+
+  WebPResult result = webp_failure;
+  vpx_image_t* const img = VPXDecodeFrame(&dec, data, data_size);
+  /* the buffers were sized from the header: refuse any other frame size */
+  if (img && (int)img->d_w == width && (int)img->d_h == height) {
+    CopyPlanes(img, Y, U, V, y_stride, uv_stride);
+    result = webp_success;
+  }
+  vpx_codec_destroy(&dec);
+
+  return result;
+}
+
 /*---------------------------------------------------------------------*
  *                             Writing WebP                            *
  *---------------------------------------------------------------------*/
@@ -486,40 +989,668 @@ static void RGBALinepairToYUV420(uint32* rgb_line1,
  * Output:
  *    5, 6, 7. Output YUV data buffers
  */
-void RGBAToYUV420(uint32* pixdata,
-                  int words_per_line,
-                  int width,
-                  int height,
-                  uint8* Y,
-                  uint8* U,
-                  uint8* V) {
-  int y_width = width;
-  int y_height = height;
+typedef struct {
+  uint32* pixdata;
+  int words_per_line;
+  int width;
+  int height;
+  uint8* Y;
+  uint8* U;
+  uint8* V;
+} RGBAToYUV420Args;
+
+static void RGBAToYUV420Band(void* arg, int first, int last) {
+  const RGBAToYUV420Args* const a = (const RGBAToYUV420Args*)arg;
+  uint32* const pixdata = a->pixdata;
+  const int words_per_line = a->words_per_line;
+  int y_width = a->width;
+  int y_height = a->height;
   int y_stride = y_width;
   int uv_width = ((y_width + 1) >> 1);
   int uv_stride = uv_width;
-  int y;
+  int y, y_end = last;
 
-  for (y = 0; y < (y_height >> 1); ++y) {
+  if (y_end > (y_height >> 1)) y_end = (y_height >> 1);
+  for (y = first; y < y_end; ++y) {
     RGBALinepairToYUV420(pixdata + 2 * y * words_per_line,
                          pixdata + (2 * y + 1) * words_per_line,
                          y_width,
-                         Y + 2 * y * y_stride,
-                         Y + (2 * y + 1) * y_stride,
-                         U + y * uv_stride,
-                         V + y * uv_stride);
+                         a->Y + 2 * y * y_stride,
+                         a->Y + (2 * y + 1) * y_stride,
+                         a->U + y * uv_stride,
+                         a->V + y * uv_stride);
   }
-  if (y_height & 1) {
+  if ((y_height & 1) && last > (y_height >> 1)) {
     RGBALinepairToYUV420(pixdata + (y_height - 1) * words_per_line,
                          pixdata + (y_height - 1) * words_per_line,
                          y_width,
-                         Y + (y_height - 1) * y_stride,
-                         Y + (y_height - 1) * y_stride,
-                         U + (y_height >> 1) * uv_stride,
-                         V + (y_height >> 1) * uv_stride);
+                         a->Y + (y_height - 1) * y_stride,
+                         a->Y + (y_height - 1) * y_stride,
+                         a->U + (y_height >> 1) * uv_stride,
+                         a->V + (y_height >> 1) * uv_stride);
+  }
+}
+
+void RGBAToYUV420(uint32* pixdata,
+                  int words_per_line,
+                  int width,
+                  int height,
+                  uint8* Y,
+                  uint8* U,
+                  uint8* V) {
+  RGBAToYUV420Threaded(pixdata, words_per_line, width, height, Y, U, V, 1);
+}
+
+void RGBAToYUV420Threaded(uint32* pixdata,
+                          int words_per_line,
+                          int width,
+                          int height,
+                          uint8* Y,
+                          uint8* U,
+                          uint8* V,
+                          int num_threads) {
+  RGBAToYUV420Args args;
+
+  args.pixdata = pixdata;
+  args.words_per_line = words_per_line;
+  args.width = width;
+  args.height = height;
+  args.Y = Y;
+  args.U = U;
+  args.V = V;
+  RunRowBands(RGBAToYUV420Band, &args, (height + 1) >> 1, num_threads);
+}
+
+typedef struct {
+  const uint32* pixdata;
+  int words_per_line;
+  int width;
+  int height;
+  uint8* Y;
+  uint8* U;
+  uint8* V;
+  uint8 luma[256];
+} GrayToYUV420Args;
+
+static void GrayRGBAToYUV420Band(void* arg, int first, int last) {
+  const GrayToYUV420Args* const a = (const GrayToYUV420Args*)arg;
+  const int uv_width = ((a->width + 1) >> 1);
+  int x, y, y_end = 2 * last;
+
+  if (y_end > a->height) y_end = a->height;
+  for (y = 2 * first; y < y_end; ++y) {
+    const uint32* const src = a->pixdata + y * a->words_per_line;
+    uint8* const dst = a->Y + y * a->width;
+    for (x = 0; x < a->width; ++x) {
+      dst[x] = a->luma[GetGreen(src + x)];
+    }
+  }
+  /* r == g == b cancels out in GetChromaU/V, leaving the 128 offset */
+  memset(a->U + first * uv_width, 128, (size_t)(last - first) * uv_width);
+  memset(a->V + first * uv_width, 128, (size_t)(last - first) * uv_width);
+}
+
+void GrayRGBAToYUV420(const uint32* pixdata,
+                      int words_per_line,
+                      int width,
+                      int height,
+                      uint8* Y,
+                      uint8* U,
+                      uint8* V,
+                      int num_threads) {
+  GrayToYUV420Args args;
+  int i;
+
+  for (i = 0; i < 256; ++i) {
+    args.luma[i] = GetLumaY(i, i, i);
+  }
+  args.pixdata = pixdata;
+  args.words_per_line = words_per_line;
+  args.width = width;
+  args.height = height;
+  args.Y = Y;
+  args.U = U;
+  args.V = V;
+  RunRowBands(GrayRGBAToYUV420Band, &args, (height + 1) >> 1, num_threads);
+}
+
+/* Lookup tables for PaletteToYUV420: the luma of each palette entry and its
+ * contribution to the (linear) chroma sums, so a 2x2 block only needs four
+ * table reads per plane.
+ */
+typedef struct {
+  const uint8* const* rows;
+  int width;
+  int height;
+  uint8* Y;
+  uint8* U;
+  uint8* V;
+  int gray;          /* every entry has r == g == b: chroma is always 128 */
+  uint8 luma[256];
+  int chroma_u[256];
+  int chroma_v[256];
+} PaletteToYUV420Args;
+
+static void PaletteLinepairToYUV420(const PaletteToYUV420Args* const a,
+                                    const uint8* idx_line1,
+                                    const uint8* idx_line2,
+                                    uint8* Y_dst1,
+                                    uint8* Y_dst2,
+                                    uint8* u_dst,
+                                    uint8* v_dst) {
+  const uint8* const luma = a->luma;
+  const int* const chroma_u = a->chroma_u;
+  const int* const chroma_v = a->chroma_v;
+  int x;
+  for (x = (a->width >> 1); x > 0; --x) {
+    const int c0 = idx_line1[0], c1 = idx_line1[1];
+    const int c2 = idx_line2[0], c3 = idx_line2[1];
+    Y_dst1[0] = luma[c0];
+    Y_dst1[1] = luma[c1];
+    Y_dst2[0] = luma[c2];
+    Y_dst2[1] = luma[c3];
+    *u_dst++ = clip_uv(chroma_u[c0] + chroma_u[c1]
+                       + chroma_u[c2] + chroma_u[c3]);
+    *v_dst++ = clip_uv(chroma_v[c0] + chroma_v[c1]
+                       + chroma_v[c2] + chroma_v[c3]);
+    idx_line1 += 2;
+    idx_line2 += 2;
+    Y_dst1 += 2;
+    Y_dst2 += 2;
+  }
+  if (a->width & 1) {    /* rightmost pixel. */
+    const int c0 = idx_line1[0], c2 = idx_line2[0];
+    Y_dst1[0] = luma[c0];
+    Y_dst2[0] = luma[c2];
+    *u_dst = clip_uv(2 * (chroma_u[c0] + chroma_u[c2]));
+    *v_dst = clip_uv(2 * (chroma_v[c0] + chroma_v[c2]));
+  }
+}
+
+static void PaletteToYUV420Band(void* arg, int first, int last) {
+  const PaletteToYUV420Args* const a = (const PaletteToYUV420Args*)arg;
+  const int y_stride = a->width;
+  const int uv_stride = ((a->width + 1) >> 1);
+  const int last_row = a->height - 1;
+  int x, y;
+
+  if (a->gray) {
+    for (y = 2 * first; y < 2 * last && y <= last_row; ++y) {
+      const uint8* const src = a->rows[y];
+      uint8* const dst = a->Y + y * y_stride;
+      for (x = 0; x < a->width; ++x) {
+        dst[x] = a->luma[src[x]];
+      }
+    }
+    memset(a->U + first * uv_stride, 128, (size_t)(last - first) * uv_stride);
+    memset(a->V + first * uv_stride, 128, (size_t)(last - first) * uv_stride);
+    return;
+  }
+  for (y = first; y < last; ++y) {
+    const int row1 = 2 * y;
+    const int row2 = (row1 + 1 > last_row) ? last_row : row1 + 1;
+    PaletteLinepairToYUV420(a,
+                            a->rows[row1],
+                            a->rows[row2],
+                            a->Y + row1 * y_stride,
+                            a->Y + row2 * y_stride,
+                            a->U + y * uv_stride,
+                            a->V + y * uv_stride);
+  }
+}
+
+void PaletteToYUV420(const uint8* const* rows,
+                     const uint32* palette,
+                     int width,
+                     int height,
+                     uint8* Y,
+                     uint8* U,
+                     uint8* V,
+                     int num_threads) {
+  PaletteToYUV420Args args;
+  int i;
+
+  args.gray = 1;
+  for (i = 0; i < 256; ++i) {
+    const int r = GetRed(palette + i);
+    const int g = GetGreen(palette + i);
+    const int b = GetBlue(palette + i);
+    if (r != g || g != b) args.gray = 0;
+    args.luma[i] = GetLumaY(r, g, b);
+    args.chroma_u[i] = -9719 * r - 19081 * g + 28800 * b;
+    args.chroma_v[i] = +28800 * r - 24116 * g - 4684 * b;
+  }
+  args.rows = rows;
+  args.width = width;
+  args.height = height;
+  args.Y = Y;
+  args.U = U;
+  args.V = V;
+  RunRowBands(PaletteToYUV420Band, &args, (height + 1) >> 1, num_threads);
+}
+
+/*---------------------------------------------------------------------*
+ *                          palette reduction                          *
+ *---------------------------------------------------------------------*/
+
+/* Color histogram of YUV420Quantize. A cell holds the pixels whose luma
+ * and chroma (the chroma of their 2x2 block) share their high bits, with
+ * the sums of the low bits, from which the mean of the cell is derived.
+ * Frames without chroma detail keep the full 8 bits of luma, and their one
+ * chroma instead of sums, which could overflow on large frames.
+ */
+enum { QUANT_Y_BITS = 6, QUANT_C_BITS = 5, QUANT_MAX_SIDE = 256,
+       QUANT_LUMA_WEIGHT = 2 };
+
+typedef struct {
+  int bits[3];          /* luma, U, V bits of a cell index */
+  int num_cells;
+  uint32* count;
+  uint32* low[3];       /* sums of the discarded low bits */
+  int flat_uv[2];       /* U, V of a frame without chroma detail */
+  uint8* map;           /* palette entry of each cell */
+} QuantHistogram;
+
+/* A box of histogram cells, bounds included, for the median cut */
+typedef struct {
+  int lo[3];
+  int hi[3];
+  uint32 count;
+} QuantBox;
+
+static inline int QuantCell(const QuantHistogram* const h,
+                            int y, int u, int v) {
+  return ((y >> (8 - h->bits[0])) << (h->bits[1] + h->bits[2]))
+         | ((u >> (8 - h->bits[1])) << h->bits[2])
+         | (v >> (8 - h->bits[2]));
+}
+
+static inline void QuantCellCoords(const QuantHistogram* const h,
+                                   int cell, int* c) {
+  c[2] = cell & ((1 << h->bits[2]) - 1);
+  c[1] = (cell >> h->bits[2]) & ((1 << h->bits[1]) - 1);
+  c[0] = cell >> (h->bits[1] + h->bits[2]);
+}
+
+/* Mean luma, U and V of a non empty cell */
+static void QuantCellMean(const QuantHistogram* const h, int cell, int* mean) {
+  const uint32 count = h->count[cell];
+  int c[3], k;
+  QuantCellCoords(h, cell, c);
+  for (k = 0; k < 3; ++k) {
+    mean[k] = (h->bits[k] == 0) ? h->flat_uv[k - 1]
+              : (c[k] << (8 - h->bits[k]))
+                + (int)((h->low[k][cell] + count / 2) / count);
+  }
+}
+
+static void QuantBuildHistogram(QuantHistogram* const h,
+                                const uint8* Y, const uint8* U, const uint8* V,
+                                int width, int height) {
+  const int uv_width = (width + 1) >> 1;
+  const int y_mask = (1 << (8 - h->bits[0])) - 1;
+  const int u_mask = (1 << (8 - h->bits[1])) - 1;
+  const int v_mask = (1 << (8 - h->bits[2])) - 1;
+  const int chroma = (h->bits[1] > 0);
+  int x, y;
+  for (y = 0; y < height; ++y) {
+    const uint8* const y_src = Y + y * width;
+    const uint8* const u_src = U + (y >> 1) * uv_width;
+    const uint8* const v_src = V + (y >> 1) * uv_width;
+    for (x = 0; x < width; ++x) {
+      const int u = u_src[x >> 1], v = v_src[x >> 1];
+      const int cell = QuantCell(h, y_src[x], u, v);
+      ++h->count[cell];
+      h->low[0][cell] += y_src[x] & y_mask;
+      if (chroma) {
+        h->low[1][cell] += u & u_mask;
+        h->low[2][cell] += v & v_mask;
+      }
+    }
   }
 }
 
+/* Shrinks box to the non empty cells it contains, and counts them */
+static void QuantShrinkBox(const QuantHistogram* const h, QuantBox* const box) {
+  int lo[3], hi[3], c[3];
+  uint32 count = 0;
+  int k;
+  for (k = 0; k < 3; ++k) {
+    lo[k] = QUANT_MAX_SIDE;
+    hi[k] = -1;
+  }
+  for (c[0] = box->lo[0]; c[0] <= box->hi[0]; ++c[0]) {
+    for (c[1] = box->lo[1]; c[1] <= box->hi[1]; ++c[1]) {
+      const int row = (c[0] << (h->bits[1] + h->bits[2]))
+                      | (c[1] << h->bits[2]);
+      for (c[2] = box->lo[2]; c[2] <= box->hi[2]; ++c[2]) {
+        const uint32 n = h->count[row | c[2]];
+        if (n == 0) continue;
+        count += n;
+        for (k = 0; k < 3; ++k) {
+          if (c[k] < lo[k]) lo[k] = c[k];
+          if (c[k] > hi[k]) hi[k] = c[k];
+        }
+      }
+    }
+  }
+  for (k = 0; k < 3; ++k) {
+    box->lo[k] = lo[k];
+    box->hi[k] = hi[k];
+  }
+  box->count = count;
+}
+
+/* Longest side of a box, in 8 bit units, luma weighted up */
+static int QuantBoxExtent(const QuantHistogram* const h,
+                          const QuantBox* const box, int* axis) {
+  int best = 0, k;
+  *axis = 0;
+  for (k = 0; k < 3; ++k) {
+    int extent = (box->hi[k] - box->lo[k]) << (8 - h->bits[k]);
+    if (k == 0) extent *= QUANT_LUMA_WEIGHT;
+    if (extent > best) {
+      best = extent;
+      *axis = k;
+    }
+  }
+  return best;
+}
+
+/* Splits box at the median of its longest side; the upper half goes to
+ * other.
+ */
+static void QuantSplitBox(const QuantHistogram* const h,
+                          QuantBox* const box, QuantBox* const other) {
+  uint32 slices[QUANT_MAX_SIDE];
+  uint32 sum = 0;
+  int axis, cut, cell, c[3];
+  QuantBoxExtent(h, box, &axis);
+  memset(slices, 0, sizeof(slices));
+  for (cell = 0; cell < h->num_cells; ++cell) {
+    if (h->count[cell] == 0) continue;
+    QuantCellCoords(h, cell, c);
+    if (c[0] < box->lo[0] || c[0] > box->hi[0]
+        || c[1] < box->lo[1] || c[1] > box->hi[1]
+        || c[2] < box->lo[2] || c[2] > box->hi[2]) {
+      continue;
+    }
+    slices[c[axis]] += h->count[cell];
+  }
+  /* the lower half keeps at least its first slice, the upper its last */
+  for (cut = box->lo[axis]; cut < box->hi[axis] - 1; ++cut) {
+    sum += slices[cut];
+    if (sum >= box->count / 2) break;
+  }
+  *other = *box;
+  box->hi[axis] = cut;
+  other->lo[axis] = cut + 1;
+  QuantShrinkBox(h, box);
+  QuantShrinkBox(h, other);
+}
+
+/* Median cut: returns the number of palette entries, whose YUV values go
+ * to entries.
+ */
+static int QuantMedianCut(QuantHistogram* const h, int max_colors,
+                          int entries[][3]) {
+  QuantBox boxes[256];
+  int num_boxes = 1;
+  int i, k, cell;
+
+  for (k = 0; k < 3; ++k) {
+    boxes[0].lo[k] = 0;
+    boxes[0].hi[k] = (1 << h->bits[k]) - 1;
+  }
+  QuantShrinkBox(h, &boxes[0]);
+
+  /* split the box with the most pixels times extent, until none is left */
+  while (num_boxes < max_colors) {
+    double best_score = 0.;
+    int best = -1;
+    for (i = 0; i < num_boxes; ++i) {
+      int axis;
+      const int extent = QuantBoxExtent(h, &boxes[i], &axis);
+      const double score = (double)boxes[i].count * extent;
+      if (extent > 0 && score > best_score) {
+        best_score = score;
+        best = i;
+      }
+    }
+    if (best < 0) break;
+    QuantSplitBox(h, &boxes[best], &boxes[num_boxes]);
+    ++num_boxes;
+  }
+
+  /* the entries are the means of the boxes */
+  for (i = 0; i < num_boxes; ++i) {
+    double sum[3] = { 0., 0., 0. };
+    for (cell = 0; cell < h->num_cells; ++cell) {
+      int c[3], mean[3];
+      if (h->count[cell] == 0) continue;
+      QuantCellCoords(h, cell, c);
+      if (c[0] < boxes[i].lo[0] || c[0] > boxes[i].hi[0]
+          || c[1] < boxes[i].lo[1] || c[1] > boxes[i].hi[1]
+          || c[2] < boxes[i].lo[2] || c[2] > boxes[i].hi[2]) {
+        continue;
+      }
+      QuantCellMean(h, cell, mean);
+      for (k = 0; k < 3; ++k) sum[k] += (double)mean[k] * h->count[cell];
+    }
+    for (k = 0; k < 3; ++k) {
+      entries[i][k] = (int)(sum[k] / boxes[i].count + .5);
+    }
+  }
+
+  /* every cell goes to its nearest entry, luma weighted up */
+  for (cell = 0; cell < h->num_cells; ++cell) {
+    int mean[3], best = 0, best_dist = -1;
+    if (h->count[cell] == 0) continue;
+    QuantCellMean(h, cell, mean);
+    for (i = 0; i < num_boxes; ++i) {
+      const int dy = QUANT_LUMA_WEIGHT * (mean[0] - entries[i][0]);
+      const int du = mean[1] - entries[i][1];
+      const int dv = mean[2] - entries[i][2];
+      const int dist = dy * dy + du * du + dv * dv;
+      if (best_dist < 0 || dist < best_dist) {
+        best_dist = dist;
+        best = i;
+      }
+    }
+    h->map[cell] = (uint8)best;
+  }
+  return num_boxes;
+}
+
+/* 4x4 Bayer matrix of the ordered dither */
+static const uint8 kBayer4x4[16] = {
+   0,  8,  2, 10,
+  12,  4, 14,  6,
+   3, 11,  1,  9,
+  15,  7, 13,  5
+};
+
+/* Level of v among levels evenly spread over [lo, hi], dithered by
+ * threshold, in [0, 16).
+ */
+static inline int QuantLevel(int v, int lo, int hi, int levels,
+                             int threshold) {
+  int q;
+  if (levels < 2 || hi <= lo) return 0;
+  if (v < lo) v = lo;
+  if (v > hi) v = hi;
+  q = ((v - lo) * (levels - 1) * 16 + (2 * threshold + 1) * (hi - lo) / 2)
+      / ((hi - lo) * 16);
+  return (q < levels) ? q : levels - 1;
+}
+
+static inline int QuantLevelValue(int q, int lo, int hi, int levels) {
+  return (levels < 2) ? lo : lo + ((hi - lo) * q + (levels - 1) / 2)
+                                  / (levels - 1);
+}
+
+typedef struct {
+  const uint8* Y;
+  const uint8* U;
+  const uint8* V;
+  int width;
+  int height;
+  uint8* const* rows;
+  const QuantHistogram* histogram;   /* median cut, or NULL */
+  int levels[3];      /* ordered: red, green, blue levels, or luma levels */
+  int ramp;           /* ordered: a ramp of luma levels at chroma u, v */
+  int u;
+  int v;
+} YUV420QuantizeArgs;
+
+static void YUV420QuantizeBand(void* arg, int first, int last) {
+  const YUV420QuantizeArgs* const a = (const YUV420QuantizeArgs*)arg;
+  const int uv_width = (a->width + 1) >> 1;
+  int x, y, y_end = 2 * last;
+
+  if (y_end > a->height) y_end = a->height;
+  for (y = 2 * first; y < y_end; ++y) {
+    const uint8* const y_src = a->Y + y * a->width;
+    const uint8* const u_src = a->U + (y >> 1) * uv_width;
+    const uint8* const v_src = a->V + (y >> 1) * uv_width;
+    uint8* const dst = a->rows[y];
+    if (a->histogram != NULL) {
+      const QuantHistogram* const h = a->histogram;
+      for (x = 0; x < a->width; ++x) {
+        dst[x] = h->map[QuantCell(h, y_src[x], u_src[x >> 1], v_src[x >> 1])];
+      }
+    } else if (a->ramp) {
+      const uint8* const t = kBayer4x4 + 4 * (y & 3);
+      for (x = 0; x < a->width; ++x) {
+        dst[x] = (uint8)QuantLevel(y_src[x], 16, 235, a->levels[0], t[x & 3]);
+      }
+    } else {
+      /* the palette is an RGB cube, so that the dithered colors average
+       * to the source one: a grid of YUV levels would have most of its
+       * entries out of gamut, clipped
+       */
+      const uint8* const t = kBayer4x4 + 4 * (y & 3);
+      for (x = 0; x < a->width; ++x) {
+        uint32 rgb;
+        int qr, qg, qb;
+        ToRGB(y_src[x], u_src[x >> 1], v_src[x >> 1], &rgb);
+        qr = QuantLevel(GetRed(&rgb), 0, 255, a->levels[0], t[x & 3]);
+        qg = QuantLevel(GetGreen(&rgb), 0, 255, a->levels[1], t[x & 3]);
+        qb = QuantLevel(GetBlue(&rgb), 0, 255, a->levels[2], t[x & 3]);
+        dst[x] = (uint8)((qr * a->levels[1] + qg) * a->levels[2] + qb);
+      }
+    }
+  }
+}
+
+WebPResult YUV420Quantize(const uint8* Y,
+                          const uint8* U,
+                          const uint8* V,
+                          int width,
+                          int height,
+                          int max_colors,
+                          int method,
+                          uint8* const* rows,
+                          uint32* palette,
+                          int* num_colors,
+                          int num_threads) {
+  const int uv_size = ((width + 1) >> 1) * ((height + 1) >> 1);
+  YUV420QuantizeArgs args;
+  QuantHistogram h;
+  int entries[256][3];
+  int n, i, k;
+  const int flat = (width > 0 && height > 0
+                    && IsFlatChroma(U, V, uv_size));
+
+  if (width <= 0 || height <= 0 || max_colors < 2 || max_colors > 256) {
+    return webp_failure;
+  }
+  args.Y = Y;
+  args.U = U;
+  args.V = V;
+  args.width = width;
+  args.height = height;
+  args.rows = rows;
+  args.histogram = NULL;
+  args.ramp = 0;
+
+  if (method == WEBP_QUANTIZE_MEDIAN_CUT) {
+    h.bits[0] = flat ? 8 : QUANT_Y_BITS;
+    h.bits[1] = h.bits[2] = flat ? 0 : QUANT_C_BITS;
+    h.num_cells = 1 << (h.bits[0] + h.bits[1] + h.bits[2]);
+    h.flat_uv[0] = U[0];
+    h.flat_uv[1] = V[0];
+    h.count = (uint32*)calloc((size_t)h.num_cells * 4, sizeof(uint32));
+    h.map = (uint8*)malloc((size_t)h.num_cells);
+    if (h.count == NULL || h.map == NULL) {
+      free(h.count);
+      free(h.map);
+      return webp_failure;
+    }
+    for (k = 0; k < 3; ++k) h.low[k] = h.count + (k + 1) * h.num_cells;
+    QuantBuildHistogram(&h, Y, U, V, width, height);
+    n = QuantMedianCut(&h, max_colors, entries);
+    args.histogram = &h;
+  } else if (method == WEBP_QUANTIZE_ORDERED) {
+    /* a ramp of luma levels for frames without chroma detail and for
+     * palettes too small for a cube, else as large a cube as fits, green
+     * first
+     */
+    args.ramp = (flat || max_colors < 8);
+    args.u = flat ? U[0] : 128;
+    args.v = flat ? V[0] : 128;
+    if (args.ramp) {
+      args.levels[0] = max_colors;
+      for (n = 0; n < max_colors; ++n) {
+        entries[n][0] = QuantLevelValue(n, 16, 235, max_colors);
+        entries[n][1] = args.u;
+        entries[n][2] = args.v;
+      }
+    } else {
+      static const int kOrder[3] = { 1, 0, 2 };
+      int grown = 1;
+      args.levels[0] = args.levels[1] = args.levels[2] = 2;
+      while (grown) {
+        grown = 0;
+        for (i = 0; i < 3; ++i) {
+          const int c = kOrder[i];
+          if ((args.levels[c] + 1) * args.levels[(c + 1) % 3]
+              * args.levels[(c + 2) % 3] <= max_colors) {
+            ++args.levels[c];
+            grown = 1;
+          }
+        }
+      }
+      n = args.levels[0] * args.levels[1] * args.levels[2];
+    }
+  } else {
+    return webp_failure;
+  }
+
+  if (method == WEBP_QUANTIZE_MEDIAN_CUT || args.ramp) {
+    for (i = 0; i < n; ++i) {
+      ToRGB(entries[i][0], entries[i][1], entries[i][2], &palette[i]);
+    }
+  } else {
+    for (i = 0; i < n; ++i) {
+      const int r = i / (args.levels[1] * args.levels[2]);
+      const int g = (i / args.levels[2]) % args.levels[1];
+      const int b = i % args.levels[2];
+      palette[i] =
+          ((uint32)QuantLevelValue(r, 0, 255, args.levels[0]) << RED_SHIFT)
+          | ((uint32)QuantLevelValue(g, 0, 255, args.levels[1]) << GREEN_SHIFT)
+          | ((uint32)QuantLevelValue(b, 0, 255, args.levels[2]) << BLUE_SHIFT);
+    }
+  }
+  *num_colors = n;
+  RunRowBands(YUV420QuantizeBand, &args, (height + 1) >> 1, num_threads);
+  if (args.histogram != NULL) {
+    free(h.count);
+    free(h.map);
+  }
+  return webp_success;
+}
+
 static int codec_ctl(vpx_codec_ctx_t *enc,
                      enum vp8e_enc_control_id id,
                      int value) {
@@ -538,11 +1669,119 @@ static void SetupParams(vpx_codec_enc_cfg_t* cfg,
   cfg->kf_mode = VPX_KF_FIXED;
 }
 
+static void* DefaultAlloc(void* opaque, size_t size) {
+  (void)opaque;
+  return malloc(size);
+}
+
+static void DefaultRelease(void* opaque, void* ptr) {
+  (void)opaque;
+  free(ptr);
+}
+
+/* Effort levels for WebPEncodeConfigSetDeadline, best quality first. A
+ * deadline longer than the frame duration selects the good quality mode of
+ * libvpx, VPX_DL_REALTIME its real time mode.
+ */
+static const struct {
+  unsigned long deadline;
+  int cpu_used;
+  double pixels_per_ms;   /* expected throughput */
+} kEffortLevels[] = {
+  { VPX_DL_BEST_QUALITY, 3, 1000. },
+  { VPX_DL_GOOD_QUALITY, 3, 4000. },
+  { VPX_DL_GOOD_QUALITY, 5, 10000. },
+  { VPX_DL_REALTIME, 8, 30000. },
+  { VPX_DL_REALTIME, 16, 80000. }
+};
+#define NUM_EFFORT_LEVELS \
+    (int)(sizeof(kEffortLevels) / sizeof(kEffortLevels[0]))
+
+void WebPEncodeConfigInit(WebPEncodeConfig* config, int QP) {
+  memset(config, 0, sizeof(*config));
+  config->QP = QP;
+  config->alloc = DefaultAlloc;
+  config->release = DefaultRelease;
+  config->deadline = kEffortLevels[0].deadline;
+  config->cpu_used = kEffortLevels[0].cpu_used;
+}
+
+int WebPEncodeConfigSetDeadline(WebPEncodeConfig* config,
+                                int y_width,
+                                int y_height,
+                                long deadline_ms) {
+  const double pixels = (double)y_width * y_height;
+  int level = 0;
+  if (deadline_ms > 0) {
+    while (level < NUM_EFFORT_LEVELS - 1
+           && pixels > kEffortLevels[level].pixels_per_ms * deadline_ms) {
+      ++level;
+    }
+  }
+  config->deadline = kEffortLevels[level].deadline;
+  config->cpu_used = kEffortLevels[level].cpu_used;
+  return level;
+}
+
+static const int kRiffHeaderSize = 20;
+
+/* Writes the RIFF header of a WebP file holding payload_size bytes (an even
+ * count) of VP8 data to dst.
+ */
+static void PutRiffHeader(uint8* dst, int payload_size) {
+  const int chunk_size = (payload_size + 1) & ~1;  /* make size even */
+  const int riff_size = chunk_size + 12;
+  const uint8 kRiffHeader[20] = { 'R', 'I', 'F', 'F',
+                                  (riff_size >>  0) & 255,
+                                  (riff_size >>  8) & 255,
+                                  (riff_size >> 16) & 255,
+                                  (riff_size >> 24) & 255,
+                                  'W', 'E', 'B', 'P',
+                                  'V', 'P', '8', ' ',
+                                  (chunk_size >>  0) & 255,
+                                  (chunk_size >>  8) & 255,
+                                  (chunk_size >> 16) & 255,
+                                  (chunk_size >> 24) & 255 };
+  memcpy(dst, kRiffHeader, kRiffHeaderSize);
+}
+
+/* Hands a whole WebP file around the frame of size bytes to config->writer,
+ * the frame in WEBP_WRITER_CHUNK_SIZE pieces.
+ */
+static WebPResult WriteFrame(const WebPEncodeConfig* config,
+                             const uint8* frame,
+                             size_t size,
+                             int* p_out_size_bytes) {
+  static const uint8 kPad[1] = { 0 };
+  const size_t pad = size & 1;
+  uint8 header[20];
+  size_t offset;
+
+  PutRiffHeader(header, (int)(size + pad));
+  if (!config->writer(config->writer_opaque, header, kRiffHeaderSize)) {
+    return webp_failure;
+  }
+  for (offset = 0; offset < size; offset += WEBP_WRITER_CHUNK_SIZE) {
+    const size_t chunk = (size - offset < WEBP_WRITER_CHUNK_SIZE)
+                         ? size - offset : WEBP_WRITER_CHUNK_SIZE;
+    if (!config->writer(config->writer_opaque, frame + offset, chunk)) {
+      return webp_failure;
+    }
+  }
+  if (pad && !config->writer(config->writer_opaque, kPad, 1)) {
+    return webp_failure;
+  }
+  *p_out_size_bytes = (int)(kRiffHeaderSize + size + pad);
+  return webp_success;
+}
+
 /* VPXEncode: Takes a Y, U, V data buffers (with color components U and V
  *            subsampled to 1/2 resolution) and generates the VPX string.
  *            Output VPX string is placed in the *p_out buffer. container_size
  *            indicates number of bytes to be left blank at the beginning of
  *            *p_out buffer to accommodate for a container header.
+ *            With config->writer, the whole file goes to the writer
+ *            instead, container included.
  *
  * Return: success/failure
  */
@@ -555,10 +1794,11 @@ static WebPResult VPXEncode(const uint8* Y,
                             int uv_width,
                             int uv_height,
                             int uv_stride,
-                            int QP,
+                            const WebPEncodeConfig* config,
                             int container_size,
                             unsigned char** p_out,
                             int* p_out_size_bytes) {
+  const int QP = config->QP;
   *p_out = NULL;
   *p_out_size_bytes = 0;
 
@@ -566,7 +1806,7 @@ static WebPResult VPXEncode(const uint8* Y,
   if (!p_out || !Y || !U || !V
       || y_width <= 0 || y_height <= 0 || uv_width <= 0 || uv_height <= 0
       || y_stride < y_width || uv_stride < uv_width
-      || QP < 0 || QP > 63) {
+      || QP < 0 || QP > 63 || (!config->alloc && !config->writer)) {
     return webp_failure;
   }
 
@@ -589,7 +1829,7 @@ static WebPResult VPXEncode(const uint8* Y,
   WebPResult result = webp_failure;
 
   if (res == VPX_CODEC_OK) {
-    codec_ctl(&enc, VP8E_SET_CPUUSED, 3);
+    codec_ctl(&enc, VP8E_SET_CPUUSED, config->cpu_used);
     codec_ctl(&enc, VP8E_SET_NOISE_SENSITIVITY, 0);
     codec_ctl(&enc, VP8E_SET_SHARPNESS, 0);
     codec_ctl(&enc, VP8E_SET_ENABLEAUTOALTREF, 0);
@@ -599,6 +1839,23 @@ static WebPResult VPXEncode(const uint8* Y,
     codec_ctl(&enc, VP8E_SET_STATIC_THRESHOLD, 0);
     codec_ctl(&enc, VP8E_SET_TOKEN_PARTITIONS, 2);
 
+    if (config->segment_map != NULL) {
+      vpx_roi_map_t roi;
+      int s;
+      memset(&roi, 0, sizeof(roi));
+      roi.roi_map = (unsigned char*)config->segment_map;
+      roi.rows = (y_height + 15) >> 4;
+      roi.cols = (y_width + 15) >> 4;
+      for (s = 0; s < 4; ++s) {
+        int q = QP + config->segment_delta_qp[s];
+        if (q < 0) q = 0;
+        if (q > 63) q = 63;
+        roi.delta_q[s] = q - QP;
+      }
+      /* Not fatal: the whole frame is then coded with QP. */
+      vpx_codec_control_(&enc, VP8E_SET_ROI_MAP, &roi);
+    }
+
     vpx_image_t img;
     vpx_img_wrap(&img, IMG_FMT_I420,
                  y_width, y_height, 16, (uint8*)(Y));
@@ -609,21 +1866,27 @@ static WebPResult VPXEncode(const uint8* Y,
     img.stride[PLANE_U] = uv_stride;
     img.stride[PLANE_V] = uv_stride;
 
-    res = vpx_codec_encode(&enc, &img, 0, 1, 0, VPX_DL_BEST_QUALITY);
+    res = vpx_codec_encode(&enc, &img, 0, 1, 0, config->deadline);
 
     if (res == VPX_CODEC_OK) {
       vpx_codec_iter_t iter = NULL;
       const vpx_codec_cx_pkt_t* pkt = vpx_codec_get_cx_data(&enc, &iter);
-      if (pkt != NULL) {
+      if (pkt != NULL && config->writer != NULL) {
+        result = WriteFrame(config, (const uint8*)pkt->data.frame.buf,
+                            pkt->data.frame.sz, p_out_size_bytes);
+      } else if (pkt != NULL) {
         const size_t pad = pkt->data.frame.sz & 1;
         const size_t payload_size = pkt->data.frame.sz + pad;
-         *p_out = (unsigned char*)malloc(container_size + payload_size);
-         memcpy(*p_out + container_size,
-                (const void*)(pkt->data.frame.buf),
-                pkt->data.frame.sz);
-         *p_out_size_bytes = container_size + payload_size;
-         if (pad) (*p_out)[*p_out_size_bytes - 1] = 0;  // pad byte
-         result = webp_success;
+         *p_out = (unsigned char*)config->alloc(config->opaque,
+                                                container_size + payload_size);
+         if (*p_out != NULL) {
+           memcpy(*p_out + container_size,
+                  (const void*)(pkt->data.frame.buf),
+                  pkt->data.frame.sz);
+           *p_out_size_bytes = container_size + payload_size;
+           if (pad) (*p_out)[*p_out_size_bytes - 1] = 0;  // pad byte
+           result = webp_success;
+         }
       }
     }
   }
@@ -646,33 +1909,44 @@ WebPResult WebPEncode(const uint8* Y,
                       unsigned char** p_out,
                       int* p_out_size_bytes,
                       double *psnr) {
+  WebPEncodeConfig config;
+  WebPEncodeConfigInit(&config, QP);
+  return WebPEncodeEx(Y, U, V,
+                      y_width, y_height, y_stride,
+                      uv_width, uv_height, uv_stride,
+                      &config, p_out, p_out_size_bytes, psnr);
+}
 
-  const int kRiffHeaderSize = 20;
+WebPResult WebPEncodeEx(const uint8* Y,
+                        const uint8* U,
+                        const uint8* V,
+                        int y_width,
+                        int y_height,
+                        int y_stride,
+                        int uv_width,
+                        int uv_height,
+                        int uv_stride,
+                        const WebPEncodeConfig* config,
+                        unsigned char** p_out,
+                        int* p_out_size_bytes,
+                        double *psnr) {
+  if (config->writer && psnr) {
+    return webp_failure;   /* the output is gone by the time */
+  }
 
   if (VPXEncode(Y, U, V,
                 y_width, y_height, y_stride,
                 uv_width, uv_height, uv_stride,
-                QP, kRiffHeaderSize,
+                config, kRiffHeaderSize,
                 p_out, p_out_size_bytes) != webp_success) {
     return webp_failure;
   }
+  if (config->writer) {
+    return webp_success;
+  }
 
   /* Write RIFF header */
-  const int img_size_bytes  = *p_out_size_bytes - kRiffHeaderSize;
-  const int chunk_size = (img_size_bytes + 1) & ~1;  /* make size even */
-  const int riff_size = chunk_size + 12;
-  const uint8_t kRiffHeader[20] = { 'R', 'I', 'F', 'F',
-                                    (riff_size >>  0) & 255,
-                                    (riff_size >>  8) & 255,
-                                    (riff_size >> 16) & 255,
-                                    (riff_size >> 24) & 255,
-                                    'W', 'E', 'B', 'P',
-                                    'V', 'P', '8', ' ',
-                                    (chunk_size >>  0) & 255,
-                                    (chunk_size >>  8) & 255,
-                                    (chunk_size >> 16) & 255,
-                                    (chunk_size >> 24) & 255 };
-  memcpy(*p_out, kRiffHeader, kRiffHeaderSize);
+  PutRiffHeader(*p_out, *p_out_size_bytes - kRiffHeaderSize);
 
   if (psnr) {
     *psnr = WebPGetPSNR(Y, U, V, *p_out, *p_out_size_bytes);
@@ -681,6 +1955,296 @@ WebPResult WebPEncode(const uint8* Y,
   return webp_success;
 }
 
+static const int kSegmentDeltaQP[4] = { -8, 0, 4, 8 };
+
+/* Mean absolute deviation thresholds of the flat and busy segments */
+static const int kFlatActivity = 3;
+static const int kBusyActivity = 10;
+
+void WebPSegmentMap(const uint8* Y,
+                    int y_width,
+                    int y_height,
+                    int y_stride,
+                    const int* roi,
+                    uint8* map,
+                    WebPEncodeConfig* config) {
+  const int mb_cols = (y_width + 15) >> 4;
+  const int mb_rows = (y_height + 15) >> 4;
+  int mb_x, mb_y, x, y, s;
+
+  for (mb_y = 0; mb_y < mb_rows; ++mb_y) {
+    const int y0 = mb_y << 4;
+    const int y1 = (y0 + 16 < y_height) ? y0 + 16 : y_height;
+    for (mb_x = 0; mb_x < mb_cols; ++mb_x) {
+      const int x0 = mb_x << 4;
+      const int x1 = (x0 + 16 < y_width) ? x0 + 16 : y_width;
+      const int count = (x1 - x0) * (y1 - y0);
+      int sum = 0, dev = 0, mean, activity;
+      uint8 segment;
+
+      for (y = y0; y < y1; ++y) {
+        const uint8* const row = Y + y * y_stride;
+        for (x = x0; x < x1; ++x) sum += row[x];
+      }
+      mean = (sum + count / 2) / count;
+      for (y = y0; y < y1; ++y) {
+        const uint8* const row = Y + y * y_stride;
+        for (x = x0; x < x1; ++x) dev += abs(row[x] - mean);
+      }
+      activity = dev / count;
+
+      if (activity < kFlatActivity) {
+        segment = WEBP_SEGMENT_FLAT;
+      } else if (activity < kBusyActivity) {
+        segment = WEBP_SEGMENT_DETAIL;
+      } else {
+        segment = WEBP_SEGMENT_BUSY;
+      }
+      if (roi != NULL
+          && x1 > roi[0] && x0 < roi[0] + roi[2]
+          && y1 > roi[1] && y0 < roi[1] + roi[3]) {
+        segment = WEBP_SEGMENT_ROI;
+      }
+      map[mb_y * mb_cols + mb_x] = segment;
+    }
+  }
+
+  config->segment_map = map;
+  for (s = 0; s < 4; ++s) {
+    config->segment_delta_qp[s] = kSegmentDeltaQP[s];
+  }
+}
+
+typedef struct {
+  WebPEncodeJob* jobs;
+  const WebPEncodeConfig* config;
+} EncodeJobsArgs;
+
+/* Encodes jobs [first, last); RunRowBands treats each job as a row pair. */
+static void EncodeJobsBand(void* arg, int first, int last) {
+  const EncodeJobsArgs* const args = (const EncodeJobsArgs*)arg;
+  int i;
+  for (i = first; i < last; ++i) {
+    WebPEncodeJob* const job = &args->jobs[i];
+    job->result = WebPEncodeEx(job->Y, job->U, job->V,
+                               job->y_width, job->y_height, job->y_stride,
+                               job->uv_width, job->uv_height, job->uv_stride,
+                               args->config, &job->out, &job->out_size_bytes,
+                               NULL);
+  }
+}
+
+WebPResult WebPEncodeJobs(WebPEncodeJob* jobs,
+                          int num_jobs,
+                          const WebPEncodeConfig* config,
+                          int num_threads) {
+  EncodeJobsArgs args;
+  WebPResult result = webp_success;
+  int i;
+  args.jobs = jobs;
+  args.config = config;
+  for (i = 0; i < num_jobs; ++i) {
+    jobs[i].out = NULL;
+    jobs[i].out_size_bytes = 0;
+    jobs[i].result = webp_failure;
+  }
+  if (config->writer) {
+    return webp_failure;   /* the outputs would be interleaved */
+  }
+  RunRowBands(EncodeJobsBand, &args, num_jobs, num_threads);
+  for (i = 0; i < num_jobs; ++i) {
+    if (jobs[i].result != webp_success) result = webp_failure;
+  }
+  return result;
+}
+
+/* Averages the src_width x src_height plane over the boxes each of the
+ * width x height output pixels covers.
+ */
+static WebPResult ScalePlane(const uint8* src, int src_width, int src_height,
+                             uint8* dst, int width, int height) {
+  unsigned long long* const sums =
+      (unsigned long long*)malloc(width * sizeof(*sums));
+  int* const x0 = (int*)malloc((width + 1) * sizeof(*x0));
+  int x, y, i, j;
+  if (sums == NULL || x0 == NULL) {
+    free(sums);
+    free(x0);
+    return webp_failure;
+  }
+  for (x = 0; x <= width; ++x) {
+    x0[x] = (int)((long long)x * src_width / width);
+  }
+  for (y = 0; y < height; ++y) {
+    const int y0 = (int)((long long)y * src_height / height);
+    const int y1 = (int)((long long)(y + 1) * src_height / height);
+    memset(sums, 0, width * sizeof(*sums));
+    for (j = y0; j < y1; ++j) {
+      const uint8* const row = src + (size_t)j * src_width;
+      for (x = 0; x < width; ++x) {
+        unsigned long long sum = 0;
+        for (i = x0[x]; i < x0[x + 1]; ++i) sum += row[i];
+        sums[x] += sum;
+      }
+    }
+    for (x = 0; x < width; ++x) {
+      const unsigned long long area =
+          (unsigned long long)(x0[x + 1] - x0[x]) * (y1 - y0);
+      dst[(size_t)y * width + x] = (uint8)((sums[x] + area / 2) / area);
+    }
+  }
+  free(sums);
+  free(x0);
+  return webp_success;
+}
+
+WebPResult YUV420Scale(const uint8* src_Y,
+                       const uint8* src_U,
+                       const uint8* src_V,
+                       int src_width,
+                       int src_height,
+                       uint8* Y,
+                       uint8* U,
+                       uint8* V,
+                       int width,
+                       int height) {
+  const int src_uv_width = (src_width + 1) >> 1;
+  const int src_uv_height = (src_height + 1) >> 1;
+  const int uv_width = (width + 1) >> 1;
+  const int uv_height = (height + 1) >> 1;
+  if (width <= 0 || height <= 0
+      || width > src_width || height > src_height) {
+    return webp_failure;   /* only downscaling is supported */
+  }
+  if (ScalePlane(src_Y, src_width, src_height, Y, width, height)
+      != webp_success
+      || ScalePlane(src_U, src_uv_width, src_uv_height, U, uv_width, uv_height)
+      != webp_success
+      || ScalePlane(src_V, src_uv_width, src_uv_height, V, uv_width, uv_height)
+      != webp_success) {
+    return webp_failure;
+  }
+  return webp_success;
+}
+
+#define PROXY_TILE_SIZE 64
+#define PROXY_MAX_TILES 4
+
+static const int kProbeQP[] = { 10, 24, 38, 52 };
+#define NUM_PROBES (int)(sizeof(kProbeQP) / sizeof(kProbeQP[0]))
+
+/* Offsets of count tiles of size spread evenly over length, kept even so
+ * that the chroma of the tiles stays aligned.
+ */
+static void ProxyTileOffsets(int length, int size, int count, int* offsets) {
+  int i;
+  for (i = 0; i < count; ++i) {
+    offsets[i] = (count > 1) ? ((length - size) * i / (count - 1)) & ~1 : 0;
+  }
+}
+
+int WebPPredictQP(const uint8* Y,
+                  const uint8* U,
+                  const uint8* V,
+                  int y_width,
+                  int y_height,
+                  int y_stride,
+                  int uv_stride,
+                  double target_ssim,
+                  const WebPEncodeConfig* config) {
+  const int tile_w = (y_width < PROXY_TILE_SIZE) ? y_width : PROXY_TILE_SIZE;
+  const int tile_h = (y_height < PROXY_TILE_SIZE) ? y_height : PROXY_TILE_SIZE;
+  int tiles_x = y_width / PROXY_TILE_SIZE;
+  int tiles_y = y_height / PROXY_TILE_SIZE;
+  int offset_x[PROXY_MAX_TILES], offset_y[PROXY_MAX_TILES];
+  int w, h, uv_w, uv_h, tx, ty, row, i, qp = -1;
+  size_t y_size, uv_size;
+  uint8 *proxy, *recon, *pY, *pU, *pV;
+  double ssim[NUM_PROBES];
+  WebPEncodeConfig trial;
+
+  if (tiles_x < 1) tiles_x = 1;
+  if (tiles_y < 1) tiles_y = 1;
+  if (tiles_x > PROXY_MAX_TILES) tiles_x = PROXY_MAX_TILES;
+  if (tiles_y > PROXY_MAX_TILES) tiles_y = PROXY_MAX_TILES;
+  ProxyTileOffsets(y_width, tile_w, tiles_x, offset_x);
+  ProxyTileOffsets(y_height, tile_h, tiles_y, offset_y);
+
+  w = tiles_x * tile_w;
+  h = tiles_y * tile_h;
+  uv_w = (w + 1) >> 1;
+  uv_h = (h + 1) >> 1;
+  y_size = (size_t)w * h;
+  uv_size = (size_t)uv_w * uv_h;
+  proxy = (uint8*)malloc(2 * (y_size + 2 * uv_size));
+  if (proxy == NULL) return -1;
+  pY = proxy;
+  pU = pY + y_size;
+  pV = pU + uv_size;
+  recon = pV + uv_size;
+
+  /* assemble the mosaic; an odd sized image only occurs with one tile */
+  for (ty = 0; ty < tiles_y; ++ty) {
+    for (tx = 0; tx < tiles_x; ++tx) {
+      for (row = 0; row < tile_h; ++row) {
+        memcpy(pY + (size_t)(ty * tile_h + row) * w + tx * tile_w,
+               Y + (size_t)(offset_y[ty] + row) * y_stride + offset_x[tx],
+               tile_w);
+      }
+      for (row = 0; row < (tile_h + 1) >> 1; ++row) {
+        const size_t src = (size_t)((offset_y[ty] >> 1) + row) * uv_stride
+                           + (offset_x[tx] >> 1);
+        const size_t dst = (size_t)(ty * (tile_h >> 1) + row) * uv_w
+                           + tx * (tile_w >> 1);
+        memcpy(pU + dst, U + src, (tile_w + 1) >> 1);
+        memcpy(pV + dst, V + src, (tile_w + 1) >> 1);
+      }
+    }
+  }
+
+  trial = *config;
+  trial.segment_map = NULL;
+  trial.writer = NULL;
+  for (i = 0; i < NUM_PROBES; ++i) {
+    unsigned char* out = NULL;
+    int out_size = 0;
+    trial.QP = kProbeQP[i];
+    if (WebPEncodeEx(pY, pU, pV, w, h, w, uv_w, uv_h, uv_w,
+                     &trial, &out, &out_size, NULL) != webp_success) {
+      break;
+    }
+    if (WebPDecodeInto(out, out_size, recon, recon + y_size,
+                       recon + y_size + uv_size, w, uv_w, w, h)
+        != webp_success) {
+      trial.release(trial.opaque, out);
+      break;
+    }
+    trial.release(trial.opaque, out);
+    ssim[i] = GetSSIMYuv(pY, pU, pV, recon, recon + y_size,
+                         recon + y_size + uv_size, w, h, 0);
+  }
+  free(proxy);
+  if (i < NUM_PROBES) return -1;
+
+  /* SSIM falls with the QP: interpolate between the probes around the
+   * target, from a lossless 1.0 at QP 0, extrapolating past the last one.
+   */
+  i = 0;
+  while (i < NUM_PROBES && ssim[i] >= target_ssim) ++i;
+  {
+    const int i0 = (i == 0) ? -1 : (i == NUM_PROBES) ? i - 2 : i - 1;
+    const int i1 = (i0 < 0) ? 0 : i0 + 1;
+    const double q0 = (i0 < 0) ? 0. : kProbeQP[i0];
+    const double s0 = (i0 < 0) ? 1. : ssim[i0];
+    const double q1 = kProbeQP[i1];
+    const double s1 = ssim[i1];
+    const double q = (s0 > s1) ? q0 + (q1 - q0) * (s0 - target_ssim) / (s0 - s1)
+                               : q1;
+    qp = (q < 0.) ? 0 : (q > 63.) ? 63 : (int)q;
+  }
+  return qp;
+}
+
 void AdjustColorspace(uint8* Y, uint8* U, uint8* V, int width, int height) {
   int y_width = width;
   int y_height = height;
@@ -782,3 +2346,139 @@ WebPResult WebPGetInfo(const uint8* data,
 
   return webp_success;
 }
+
+/* Boolean entropy decoder of RFC 6386, section 7.3, just enough to read the
+ * frame header in the first partition.
+ */
+typedef struct {
+  const uint8* input;
+  const uint8* input_end;
+  uint32 range;
+  uint32 value;
+  int bit_count;
+} BoolDecoder;
+
+static void InitBoolDecoder(BoolDecoder* const br,
+                            const uint8* start, int size) {
+  br->input = start;
+  br->input_end = start + size;
+  br->value = 0;
+  if (br->input < br->input_end) br->value |= *br->input++ << 8;
+  if (br->input < br->input_end) br->value |= *br->input++;
+  br->range = 255;
+  br->bit_count = 0;
+}
+
+static int ReadBool(BoolDecoder* const br, int prob) {
+  const uint32 split = 1 + (((br->range - 1) * prob) >> 8);
+  const uint32 big_split = split << 8;
+  int bit;
+  if (br->value >= big_split) {
+    bit = 1;
+    br->range -= split;
+    br->value -= big_split;
+  } else {
+    bit = 0;
+    br->range = split;
+  }
+  while (br->range < 128) {
+    br->value <<= 1;
+    br->range <<= 1;
+    if (++br->bit_count == 8) {
+      br->bit_count = 0;
+      if (br->input < br->input_end) br->value |= *br->input++;
+    }
+  }
+  return bit;
+}
+
+static int ReadLiteral(BoolDecoder* const br, int bits) {
+  int v = 0;
+  while (bits-- > 0) {
+    v = (v << 1) | ReadBool(br, 128);
+  }
+  return v;
+}
+
+static int ReadSignedLiteral(BoolDecoder* const br, int bits) {
+  const int v = ReadLiteral(br, bits);
+  return ReadBool(br, 128) ? -v : v;
+}
+
+/* Quantizer to quantizer index mapping of the libvpx encoder (q_trans) */
+static const uint8 kQuantizerToIndex[64] = {
+   0,   1,   2,   3,   4,   5,   7,   8,   9,  10,  12,  13,  15,  17,  18,  19,
+  20,  21,  23,  24,  25,  26,  27,  28,  29,  30,  31,  33,  35,  37,  39,  41,
+  43,  45,  47,  49,  51,  53,  55,  57,  59,  61,  64,  67,  70,  73,  76,  79,
+  82,  85,  88,  91,  94,  97, 100, 103, 106, 109, 112, 115, 118, 121, 124, 127
+};
+
+WebPResult WebPGetQuantizer(const uint8* data,
+                            int data_size,
+                            int* QP) {
+  int width, height;
+  if (QP) *QP = -1;
+  if (WebPGetInfo(data, data_size, &width, &height) != webp_success) {
+    return webp_failure;
+  }
+  SkipRiffHeader(&data, &data_size);
+  const uint32 partition_length =
+      (data[0] | (data[1] << 8) | (data[2] << 16)) >> 5;
+  if (partition_length > (uint32)(data_size - 10)) {
+    return webp_failure;   /* truncated first partition */
+  }
+
+  BoolDecoder br;
+  InitBoolDecoder(&br, data + 10, partition_length);
+  ReadLiteral(&br, 2);      /* color_space, clamping_type */
+
+  int segment_q[4] = { 0, 0, 0, 0 };
+  int num_segments = 1;
+  int absolute_delta = 0;
+  int s;
+  if (ReadBool(&br, 128)) {           /* segmentation_enabled */
+    const int update_map = ReadBool(&br, 128);
+    if (ReadBool(&br, 128)) {         /* update_segment_feature_data */
+      absolute_delta = ReadBool(&br, 128);
+      for (s = 0; s < 4; ++s) {
+        segment_q[s] = ReadBool(&br, 128) ? ReadSignedLiteral(&br, 7) : 0;
+      }
+      for (s = 0; s < 4; ++s) {       /* loop filter updates */
+        if (ReadBool(&br, 128)) ReadSignedLiteral(&br, 6);
+      }
+      num_segments = 4;
+    }
+    if (update_map) {
+      for (s = 0; s < 3; ++s) {
+        if (ReadBool(&br, 128)) ReadLiteral(&br, 8);
+      }
+    }
+  }
+  ReadLiteral(&br, 1 + 6 + 3);        /* filter_type, level, sharpness */
+  if (ReadBool(&br, 128)) {           /* loop_filter_adj_enable */
+    if (ReadBool(&br, 128)) {         /* mode_ref_lf_delta_update */
+      for (s = 0; s < 8; ++s) {
+        if (ReadBool(&br, 128)) ReadSignedLiteral(&br, 6);
+      }
+    }
+  }
+  ReadLiteral(&br, 2);                /* log2_nbr_of_dct_partitions */
+  const int base_q = ReadLiteral(&br, 7);
+
+  /* The finest quantizer of any segment decides the quality. */
+  int q_index = 127;
+  for (s = 0; s < num_segments; ++s) {
+    int q = absolute_delta ? segment_q[s] : base_q + segment_q[s];
+    if (q < 0) q = 0;
+    if (q > 127) q = 127;
+    if (q < q_index) q_index = q;
+  }
+
+  int qp = 0;
+  while (qp < 63 && kQuantizerToIndex[qp] < q_index) {
+    ++qp;
+  }
+  if (QP) *QP = qp;
+
+  return webp_success;
+}
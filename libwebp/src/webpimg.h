@@ -38,6 +38,14 @@
 extern "C" {
 #endif  /* __cplusplus */
 
+/* Upper bound on the number of threads used by the *Threaded conversions.
+ * Threading is only available when built with WEBP_USE_PTHREAD; otherwise
+ * those routines run on the calling thread.
+ */
+#define WEBP_MAX_THREADS 16
+
+#include <stddef.h>
+
 typedef unsigned char uint8;
 typedef unsigned int uint32;
 typedef enum WebPResultType {
@@ -74,6 +82,29 @@ WebPResult WebPDecode(const uint8* data,
                       int* p_width,
                       int* p_height);
 
+/* Same as WebPDecode, but decodes into caller supplied buffers instead of
+ * allocating them, so the caller can reuse its buffers across images.
+ * Input:
+ *      1. data: the WebP data stream (array of bytes)
+ *      2. data_size: count of bytes in the WebP data stream
+ *      3, 4, 5. Y, U, V: output buffers of at least height rows of y_stride
+ *                        bytes, and (height + 1) / 2 rows of uv_stride bytes
+ *      6, 7. y_stride, uv_stride: the row strides of the output buffers
+ *      8, 9. width, height: the expected image dimensions, as returned by
+ *                           WebPGetInfo. Decoding fails if the frame has a
+ *                           different size.
+ * Return: success/failure
+ */
+WebPResult WebPDecodeInto(const uint8* data,
+                          int data_size,
+                          uint8* Y,
+                          uint8* U,
+                          uint8* V,
+                          int y_stride,
+                          int uv_stride,
+                          int width,
+                          int height);
+
 /* WebPEncode: Takes a Y, U, V data buffers (with color components U and V
  *             subsampled to 1/2 resolution) and generates the WebP string.
  * Input:
@@ -110,9 +141,209 @@ WebPResult WebPEncode(const uint8* Y,
                       int* p_out_size_bytes,
                       double* psnr);
 
+/* Encoder settings for WebPEncodeEx. Initialize with WebPEncodeConfigInit
+ * before changing individual fields.
+ */
+typedef struct WebPEncodeConfig {
+  int QP;           /* quantization parameter, 0 (best) .. 63 */
+
+  /* Allocator for the output buffer, and the matching release function the
+   * caller uses to free it. WebPEncodeConfigInit sets malloc() and free().
+   */
+  void* (*alloc)(void* opaque, size_t size);
+  void (*release)(void* opaque, void* ptr);
+  void* opaque;
+
+  /* Optional segmentation: one segment id (0..3) per 16x16 macroblock, row
+   * by row, and the QP offset of each segment. NULL codes every macroblock
+   * with QP. See WebPSegmentMap.
+   */
+  const uint8* segment_map;
+  int segment_delta_qp[4];
+
+  /* Encoding effort: the deadline passed to vpx_codec_encode (0 for
+   * VPX_DL_BEST_QUALITY) and VP8E_SET_CPUUSED, higher being faster.
+   * WebPEncodeConfigSetDeadline picks them from a time budget.
+   */
+  unsigned long deadline;
+  int cpu_used;
+
+  /* Optional output callback. When set, WebPEncodeEx hands the RIFF header
+   * and then the VP8 data to writer in pieces of at most
+   * WEBP_WRITER_CHUNK_SIZE bytes, straight from the buffer of the codec,
+   * instead of copying them into a buffer from alloc. *p_out is then NULL
+   * and *p_out_size_bytes the number of bytes written; psnr must be NULL.
+   * writer returns 1 on success, or 0 to abort the encoding.
+   */
+  int (*writer)(void* opaque, const uint8* data, size_t size);
+  void* writer_opaque;
+} WebPEncodeConfig;
+
+#define WEBP_WRITER_CHUNK_SIZE 8192
+
+void WebPEncodeConfigInit(WebPEncodeConfig* config, int QP);
+
+/* Sets the effort of config to the highest one expected to encode a
+ * y_width x y_height image within deadline_ms milliseconds. The estimates
+ * are rough single image throughputs; the lowest effort is used when none
+ * of them fits. deadline_ms <= 0 restores the best quality effort.
+ * Return: the number of steps below the best quality effort.
+ */
+int WebPEncodeConfigSetDeadline(WebPEncodeConfig* config,
+                                int y_width,
+                                int y_height,
+                                long deadline_ms);
+
+/* Same as WebPEncode, with the settings taken from config. The output buffer
+ * is obtained from config->alloc and must be freed with config->release,
+ * unless config->writer is set.
+ */
+WebPResult WebPEncodeEx(const uint8* Y,
+                        const uint8* U,
+                        const uint8* V,
+                        int y_width,
+                        int y_height,
+                        int y_stride,
+                        int uv_width,
+                        int uv_height,
+                        int uv_stride,
+                        const WebPEncodeConfig* config,
+                        unsigned char** p_out,
+                        int* p_out_size_bytes,
+                        double* psnr);
+
+/* One image of a WebPEncodeJobs batch. The input fields are the same as the
+ * arguments of WebPEncodeEx; out, out_size_bytes and result are set by
+ * WebPEncodeJobs.
+ */
+typedef struct WebPEncodeJob {
+  const uint8* Y;
+  const uint8* U;
+  const uint8* V;
+  int y_width;
+  int y_height;
+  int y_stride;
+  int uv_width;
+  int uv_height;
+  int uv_stride;
+
+  unsigned char* out;     /* to be freed with config->release */
+  int out_size_bytes;
+  WebPResult result;
+} WebPEncodeJob;
+
+/* Encodes num_jobs images with the same settings, spreading them over up to
+ * num_threads threads. config->alloc and config->release must then be safe
+ * to call from any thread, as the malloc() based defaults are, and
+ * config->writer must not be set.
+ * Return: success if every job succeeded. The outputs of the jobs that
+ *         succeeded are kept either way.
+ */
+WebPResult WebPEncodeJobs(WebPEncodeJob* jobs,
+                          int num_jobs,
+                          const WebPEncodeConfig* config,
+                          int num_threads);
+
+/* Segments of WebPSegmentMap, with their default QP offsets */
+enum {
+  WEBP_SEGMENT_ROI = 0,     /* region of interest, finer */
+  WEBP_SEGMENT_FLAT = 1,    /* smooth areas, where artifacts show, as is */
+  WEBP_SEGMENT_DETAIL = 2,  /* some texture, slightly coarser */
+  WEBP_SEGMENT_BUSY = 3     /* strong texture masks the error, coarser */
+};
+
+/* Computes a segment map from the activity (mean absolute deviation) of
+ * each 16x16 macroblock of the Y plane, and points config at it with the
+ * default QP offsets of the segments.
+ * Input:
+ *      1. Y: the Y plane
+ *      2, 3, 4. y_width, y_height, y_stride: its dimensions and row stride
+ *      5. roi: NULL, or the x, y, width and height of a rectangle whose
+ *              macroblocks go to WEBP_SEGMENT_ROI
+ * Output:
+ *      6. map: ((y_width + 15) / 16) * ((y_height + 15) / 16) segment ids
+ *      7. config: segment_map and segment_delta_qp are set
+ */
+void WebPSegmentMap(const uint8* Y,
+                    int y_width,
+                    int y_height,
+                    int y_stride,
+                    const int* roi,
+                    uint8* map,
+                    WebPEncodeConfig* config);
+
+/* Returns the PSNR (in dB) between two images of y_width x y_height pixels
+ * in YUV 4:2:0 format, both with unpadded rows.
+ */
+double GetPSNRYuv(const uint8* Y1,
+                  const uint8* U1,
+                  const uint8* V1,
+                  const uint8* Y2,
+                  const uint8* U2,
+                  const uint8* V2,
+                  int y_width,
+                  int y_height);
+
+/* Predicts the largest QP at which an image is expected to reach the target
+ * luma SSIM. A proxy of up to 4x4 tiles of 64x64 pixels, spread over the
+ * image, is encoded at a few probe QPs and the target is interpolated on
+ * the resulting SSIM curve. Tiles keep the full resolution so that coding
+ * artifacts are not averaged away as they would be by scaling.
+ * Input:
+ *      1, 2, 3. Y, U, V: the image
+ *      4, 5. y_width, y_height: its dimensions
+ *      6, 7. y_stride, uv_stride: the row strides of the planes
+ *      8. target_ssim: the SSIM to reach, e.g. 0.95
+ *      9. config: the settings of the trial encodes; QP and segment_map are
+ *                 ignored
+ * Return: the QP, or -1 on failure
+ */
+int WebPPredictQP(const uint8* Y,
+                  const uint8* U,
+                  const uint8* V,
+                  int y_width,
+                  int y_height,
+                  int y_stride,
+                  int uv_stride,
+                  double target_ssim,
+                  const WebPEncodeConfig* config);
+
+/* Returns the mean SSIM (http://en.wikipedia.org/wiki/Structural_similarity)
+ * between two images of y_width x y_height pixels in YUV 4:2:0 format, both
+ * with unpadded rows, over 8x8 windows at a 4 pixel step. Only the luma is
+ * compared unless with_chroma is non-zero, in which case the planes are
+ * weighted by their number of samples. Uses SSE2 where available.
+ */
+double GetSSIMYuv(const uint8* Y1,
+                  const uint8* U1,
+                  const uint8* V1,
+                  const uint8* Y2,
+                  const uint8* U2,
+                  const uint8* V2,
+                  int y_width,
+                  int y_height,
+                  int with_chroma);
+
+/* Returns the difference (in dB) between two images. One represented
+ * using Y,U,V vectors and the other is webp image data.
+ * Input:
+ *   Y1/U1/V1: The Y/U/V data of the first image
+ *   imgdata: data buffer containing webp image
+ *   imgdata_size: size of the imgdata buffer
+ *
+ * Returns the PSNR value computed bewteen the two images
+ */
+double WebPGetPSNR(const uint8* Y1,
+                   const uint8* U1,
+                   const uint8* V1,
+                   uint8* imgdata,
+                   int imgdata_size);
+
 /* Converts from YUV (with color subsampling) such as produced by the WebPDecode
  * routine into 32 bits per pixel RGBA data array. This data array can be
  * directly used by the Leptonica Pix in-memory image format.
+ * When both chroma planes are flat (e.g. a grayscale image), the chroma
+ * upsampling is skipped and each pixel is looked up from its luma.
  * Input:
  *      1, 2, 3. Y, U, V: the input data buffers
  *      4. pixwpl: the desired words per line corresponding to the supplied
@@ -131,6 +362,19 @@ void YUV420toRGBA(uint8* Y,
                   int height,
                   uint32* pixdata);
 
+/* Same as YUV420toRGBA, but splits the frame into num_threads independent
+ * bands of row pairs that are converted concurrently. num_threads <= 1
+ * converts on the calling thread.
+ */
+void YUV420toRGBAThreaded(uint8* Y,
+                          uint8* U,
+                          uint8* V,
+                          int words_per_line,
+                          int width,
+                          int height,
+                          uint32* pixdata,
+                          int num_threads);
+
 /* Generates Y, U, V data (with color subsampling) from 32 bits
  * per pixel RGBA data buffer. The resulting YUV data can be directly fed into
  * the WebPEncode routine.
@@ -149,6 +393,120 @@ void RGBAToYUV420(uint32* pixdata,
                   uint8* U,
                   uint8* V);
 
+/* Same as RGBAToYUV420, but splits the frame into num_threads independent
+ * bands of row pairs that are converted concurrently. num_threads <= 1
+ * converts on the calling thread.
+ */
+void RGBAToYUV420Threaded(uint32* pixdata,
+                          int words_per_line,
+                          int width,
+                          int height,
+                          uint8* Y,
+                          uint8* U,
+                          uint8* V,
+                          int num_threads);
+
+/* Same as RGBAToYUV420 for a buffer whose pixels all have equal red, green
+ * and blue components: only luma is computed and the U, V planes are filled
+ * with 128, which is exactly what the chroma formulas give for r == g == b.
+ * Callers find out whether the buffer is gray while they fill it.
+ */
+void GrayRGBAToYUV420(const uint32* pixdata,
+                      int words_per_line,
+                      int width,
+                      int height,
+                      uint8* Y,
+                      uint8* U,
+                      uint8* V,
+                      int num_threads);
+
+/* Generates Y, U, V data (with color subsampling) from an image with 8 bit
+ * palette indices. The luma and chroma contribution of each palette entry is
+ * computed once, so the result is identical to expanding the indices to RGBA
+ * and calling RGBAToYUV420, at a fraction of the cost. A palette whose
+ * entries are all gray skips the chroma computation altogether.
+ * Input:
+ *    1. rows: height pointers to rows of width palette indices
+ *    2. palette: 256 RGBA entries, in the same layout as RGBAToYUV420 input
+ *    3, 4. image width and height respectively
+ * Output:
+ *    5, 6, 7. Output YUV data buffers
+ * Input:
+ *    8. num_threads: number of row bands converted concurrently
+ */
+void PaletteToYUV420(const uint8* const* rows,
+                     const uint32* palette,
+                     int width,
+                     int height,
+                     uint8* Y,
+                     uint8* U,
+                     uint8* V,
+                     int num_threads);
+
+/* Palette reduction methods of YUV420Quantize */
+enum {
+  WEBP_QUANTIZE_MEDIAN_CUT = 0,   /* adaptive palette, nearest entry */
+  WEBP_QUANTIZE_ORDERED = 1       /* fixed palette, 4x4 ordered dither */
+};
+
+/* Reduces Y, U, V data (with color subsampling) to at most max_colors
+ * colors, working on the samples as they are decoded, without an RGB frame.
+ * WEBP_QUANTIZE_MEDIAN_CUT splits the color histogram of the frame in boxes
+ * of equal population and maps each pixel to the nearest box mean.
+ * WEBP_QUANTIZE_ORDERED needs no histogram: the palette is the largest RGB
+ * cube of levels that fits in max_colors, green first, and the pixels are
+ * dithered between its corners. Frames without chroma detail, and palettes
+ * of fewer than 8 colors, get a ramp of luma levels at the frame chroma
+ * (or neutral chroma) instead.
+ * Input:
+ *    1, 2, 3. Y, U, V: the input data buffers, with unpadded rows
+ *    4, 5. width, height: the image dimensions
+ *    6. max_colors: from 2 to 256
+ *    7. method: WEBP_QUANTIZE_MEDIAN_CUT or WEBP_QUANTIZE_ORDERED
+ * Output:
+ *    8. rows: height pointers to rows of width palette indices
+ *    9. palette: max_colors RGBA entries, in the same layout as RGBAToYUV420
+ *                input
+ *    10. num_colors: the number of palette entries used
+ * Input:
+ *    11. num_threads: number of row bands mapped concurrently
+ * Return: success/failure
+ */
+WebPResult YUV420Quantize(const uint8* Y,
+                          const uint8* U,
+                          const uint8* V,
+                          int width,
+                          int height,
+                          int max_colors,
+                          int method,
+                          uint8* const* rows,
+                          uint32* palette,
+                          int* num_colors,
+                          int num_threads);
+
+/* Scales Y, U, V data (with color subsampling) down to width x height,
+ * averaging the source pixels that each output pixel covers.
+ * Input:
+ *    1, 2, 3. src_Y, src_U, src_V: the input data buffers, with unpadded rows
+ *    4, 5. src_width, src_height: the input image dimensions
+ * Output:
+ *    6, 7, 8. Y, U, V: the output data buffers, with unpadded rows
+ * Input:
+ *    9, 10. width, height: the output image dimensions, no larger than the
+ *                          input ones
+ * Return: success/failure
+ */
+WebPResult YUV420Scale(const uint8* src_Y,
+                       const uint8* src_U,
+                       const uint8* src_V,
+                       int src_width,
+                       int src_height,
+                       uint8* Y,
+                       uint8* U,
+                       uint8* V,
+                       int width,
+                       int height);
+
 /* This function adjust from YUV420J (jpeg decoding) to YUV420 (webp input)
  * Hints: http://en.wikipedia.org/wiki/YCbCr
  */
@@ -174,6 +532,37 @@ WebPResult WebPGetInfo(const uint8* data,
                        int *width,
                        int *height);
 
+/* Reads the quantizer of a WebP image from its frame header, without
+ * decoding the image data.
+ *
+ * Input:
+ *      1. data: the WebP data stream (array of bytes)
+ *      2. data_size: count of bytes in the WebP data stream
+ *
+ * Output:
+ *      QP: the quantization parameter the image was encoded with, on the
+ *          0 (best) .. 63 scale of WebPEncode. With segmentation, the finest
+ *          quantizer of any segment.
+ *
+ * Return: success/failure
+ */
+WebPResult WebPGetQuantizer(const uint8* data,
+                            int data_size,
+                            int* QP);
+
+/* Checks the RIFF header and the header of the "VP8 " chunk that must come
+ * first, and skips both (20 bytes).
+ *
+ * Input:
+ *      1. data_ptr: the WebP data stream, of at least 30 bytes to be taken
+ *                   for a RIFF container; advanced past the headers
+ *      2. data_size_ptr: count of bytes in the stream, reduced to match
+ *
+ * Return: the size of the VP8 chunk, 0 for an invalid RIFF header, or
+ *         0xffffffff for data without a RIFF header, which is left as is
+ */
+int SkipRiffHeader(const uint8** data_ptr, int *data_size_ptr);
+
 #ifdef __cplusplus
 }
 #endif  /* __cplusplus */
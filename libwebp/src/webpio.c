@@ -0,0 +1,467 @@
+/*
+ * Image file readers feeding the WebP encoder
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "webpio.h"
+
+/*---------------------------------------------------------------------*
+ *                              JPEG errors                            *
+ *---------------------------------------------------------------------*/
+
+/* libjpeg reports fatal errors through error_exit, which must not return:
+ * jump back to the caller instead of calling exit() like the default one.
+ */
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+} JPEGErrorMgr;
+
+static void JPEGErrorExit(j_common_ptr cinfo) {
+  JPEGErrorMgr* const err = (JPEGErrorMgr*)cinfo->err;
+  longjmp(err->jump, 1);
+}
+
+static void JPEGOutputMessage(j_common_ptr cinfo) {
+  (void)cinfo;  /* keep warnings off stderr */
+}
+
+static struct jpeg_error_mgr* JPEGSetupErrors(JPEGErrorMgr* err) {
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = JPEGErrorExit;
+  err->pub.output_message = JPEGOutputMessage;
+  return &err->pub;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Reading JPEG                           *
+ *---------------------------------------------------------------------*/
+
+/* Source manager reading from a memory buffer. Older libjpeg versions have
+ * no jpeg_mem_src(), so it is spelled out here.
+ */
+static void JPEGInitSource(j_decompress_ptr cinfo) {
+  (void)cinfo;
+}
+
+static boolean JPEGFillInputBuffer(j_decompress_ptr cinfo) {
+  /* the data is truncated: insert a fake EOI marker, like jdatasrc.c */
+  static const JOCTET kEOI[2] = { 0xFF, JPEG_EOI };
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  cinfo->src->next_input_byte = kEOI;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void JPEGSkipInputData(j_decompress_ptr cinfo, long num_bytes) {
+  struct jpeg_source_mgr* const src = cinfo->src;
+  if (num_bytes <= 0) {
+    return;
+  }
+  if ((size_t)num_bytes > src->bytes_in_buffer) {
+    JPEGFillInputBuffer(cinfo);
+  } else {
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
+  }
+}
+
+static void JPEGTermSource(j_decompress_ptr cinfo) {
+  (void)cinfo;
+}
+
+static void JPEGMemorySource(j_decompress_ptr cinfo,
+                             struct jpeg_source_mgr* src,
+                             const uint8* data,
+                             int data_size) {
+  src->init_source = JPEGInitSource;
+  src->fill_input_buffer = JPEGFillInputBuffer;
+  src->skip_input_data = JPEGSkipInputData;
+  src->resync_to_restart = jpeg_resync_to_restart;
+  src->term_source = JPEGTermSource;
+  src->next_input_byte = (const JOCTET*)data;
+  src->bytes_in_buffer = (size_t)data_size;
+  cinfo->src = src;
+}
+
+WebPResult JPEGGetInfo(const uint8* data,
+                       int data_size,
+                       int* width,
+                       int* height) {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
+  JPEGErrorMgr err;
+
+  if (width) *width = 0;
+  if (height) *height = 0;
+  if (!data || data_size <= 0) {
+    return webp_failure;
+  }
+
+  cinfo.err = JPEGSetupErrors(&err);
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    return webp_failure;
+  }
+  jpeg_create_decompress(&cinfo);
+  JPEGMemorySource(&cinfo, &src, data, data_size);
+  jpeg_read_header(&cinfo, TRUE);
+  if (width) *width = cinfo.image_width;
+  if (height) *height = cinfo.image_height;
+  jpeg_destroy_decompress(&cinfo);
+
+  return webp_success;
+}
+
+/* Returns 1 if the image can be read as raw YCbCr 4:2:0 planes. */
+static int IsRawYUV420(const struct jpeg_decompress_struct* cinfo) {
+  const jpeg_component_info* const comp = cinfo->comp_info;
+  return cinfo->jpeg_color_space == JCS_YCbCr
+      && cinfo->num_components == 3
+      && comp[0].h_samp_factor == 2 && comp[0].v_samp_factor == 2
+      && comp[1].h_samp_factor == 1 && comp[1].v_samp_factor == 1
+      && comp[2].h_samp_factor == 1 && comp[2].v_samp_factor == 1;
+}
+
+/* Size of the band buffer used by ReadRawYUV420: one iMCU row of 16 luma
+ * and 8 chroma rows, padded to whole MCUs.
+ */
+static size_t RawBandSize(int width) {
+  const size_t band_stride = (width + 15) & ~15;
+  return 16 * band_stride + 2 * 8 * (band_stride >> 1);
+}
+
+/* Reads the raw planes one iMCU row at a time into band, maps them to the
+ * WebP range and copies the visible part to Y, U, V.
+ */
+static void ReadRawYUV420(struct jpeg_decompress_struct* cinfo,
+                          uint8* band,
+                          uint8* Y,
+                          uint8* U,
+                          uint8* V) {
+  const int width = cinfo->image_width;
+  const int height = cinfo->image_height;
+  const int uv_width = (width + 1) >> 1;
+  const int uv_height = (height + 1) >> 1;
+  const int band_stride = (width + 15) & ~15;
+  const int band_uv_stride = band_stride >> 1;
+  uint8* const band_Y = band;
+  uint8* const band_U = band_Y + 16 * band_stride;
+  uint8* const band_V = band_U + 8 * band_uv_stride;
+  JSAMPROW y_rows[16], u_rows[8], v_rows[8];
+  JSAMPARRAY planes[3];
+  int i;
+
+  for (i = 0; i < 16; ++i) {
+    y_rows[i] = band_Y + i * band_stride;
+  }
+  for (i = 0; i < 8; ++i) {
+    u_rows[i] = band_U + i * band_uv_stride;
+    v_rows[i] = band_V + i * band_uv_stride;
+  }
+  planes[0] = y_rows;
+  planes[1] = u_rows;
+  planes[2] = v_rows;
+
+  cinfo->raw_data_out = TRUE;
+  jpeg_start_decompress(cinfo);
+  while (cinfo->output_scanline < cinfo->output_height) {
+    const int y = cinfo->output_scanline;
+    const int rows = (height - y < 16) ? height - y : 16;
+    const int uv_rows = (uv_height - (y >> 1) < 8) ? uv_height - (y >> 1) : 8;
+    jpeg_read_raw_data(cinfo, planes, 16);
+    AdjustColorspace(band_Y, band_U, band_V, band_stride, 16);
+    for (i = 0; i < rows; ++i) {
+      memcpy(Y + (y + i) * width, y_rows[i], width);
+    }
+    for (i = 0; i < uv_rows; ++i) {
+      memcpy(U + ((y >> 1) + i) * uv_width, u_rows[i], uv_width);
+      memcpy(V + ((y >> 1) + i) * uv_width, v_rows[i], uv_width);
+    }
+  }
+  jpeg_finish_decompress(cinfo);
+}
+
+/* Size of the buffer used by ReadRGBAsYUV420: a pair of RGBA rows and
+ * one decoded scanline.
+ */
+static size_t RGBBandSize(int width) {
+  return 2 * width * sizeof(uint32) + 3 * width;
+}
+
+/* Reads the image as RGB (or gray) scanlines and converts them two rows at
+ * a time.
+ */
+static void ReadRGBAsYUV420(struct jpeg_decompress_struct* cinfo,
+                            uint8* band,
+                            uint8* Y,
+                            uint8* U,
+                            uint8* V) {
+  const int width = cinfo->image_width;
+  const int height = cinfo->image_height;
+  const int uv_width = (width + 1) >> 1;
+  uint32* const pixdata = (uint32*)band;
+  JSAMPROW scanline = band + 2 * width * sizeof(uint32);
+  int x, y, i;
+
+  cinfo->out_color_space = (cinfo->jpeg_color_space == JCS_GRAYSCALE)
+                           ? JCS_GRAYSCALE : JCS_RGB;
+  jpeg_start_decompress(cinfo);
+  for (y = 0; y < height; y += 2) {
+    const int rows = (height - y < 2) ? height - y : 2;
+    for (i = 0; i < rows; ++i) {
+      uint32* const dst = pixdata + i * width;
+      const uint8* src = scanline;
+      jpeg_read_scanlines(cinfo, &scanline, 1);
+      if (cinfo->output_components == 3) {
+        for (x = 0; x < width; ++x, src += 3) {
+          dst[x] = ((uint32)src[0] << 24) | (src[1] << 16) | (src[2] << 8);
+        }
+      } else {
+        for (x = 0; x < width; ++x) {
+          dst[x] = src[x] * 0x01010100U;
+        }
+      }
+    }
+    RGBAToYUV420(pixdata, width, width, rows,
+                 Y + y * width,
+                 U + (y >> 1) * uv_width,
+                 V + (y >> 1) * uv_width);
+  }
+  jpeg_finish_decompress(cinfo);
+}
+
+WebPResult JPEGDecodeYUV420(const uint8* data,
+                            int data_size,
+                            uint8* Y,
+                            uint8* U,
+                            uint8* V,
+                            int width,
+                            int height) {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
+  JPEGErrorMgr err;
+  uint8* volatile band = NULL;
+
+  if (!data || data_size <= 0 || !Y || !U || !V
+      || width <= 0 || height <= 0) {
+    return webp_failure;
+  }
+
+  cinfo.err = JPEGSetupErrors(&err);
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(band);
+    return webp_failure;
+  }
+  jpeg_create_decompress(&cinfo);
+  JPEGMemorySource(&cinfo, &src, data, data_size);
+  jpeg_read_header(&cinfo, TRUE);
+  /* the buffers were sized from JPEGGetInfo: refuse any other size */
+  if ((int)cinfo.image_width != width || (int)cinfo.image_height != height) {
+    jpeg_destroy_decompress(&cinfo);
+    return webp_failure;
+  }
+
+  if (IsRawYUV420(&cinfo)) {
+    band = (uint8*)malloc(RawBandSize(width));
+    if (band != NULL) {
+      ReadRawYUV420(&cinfo, band, Y, U, V);
+    }
+  } else {
+    band = (uint8*)malloc(RGBBandSize(width));
+    if (band != NULL) {
+      ReadRGBAsYUV420(&cinfo, band, Y, U, V);
+    }
+  }
+  jpeg_destroy_decompress(&cinfo);
+  if (band == NULL) {
+    return webp_failure;
+  }
+  free(band);
+
+  return webp_success;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Writing JPEG                           *
+ *---------------------------------------------------------------------*/
+
+/* Destination manager handing the compressed data to a WebPIOWriter. */
+typedef struct {
+  struct jpeg_destination_mgr pub;
+  WebPIOWriter writer;
+  void* opaque;
+  JOCTET buffer[4096];
+} JPEGDestination;
+
+static void JPEGInitDestination(j_compress_ptr cinfo) {
+  JPEGDestination* const dest = (JPEGDestination*)cinfo->dest;
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = sizeof(dest->buffer);
+}
+
+static boolean JPEGEmptyOutputBuffer(j_compress_ptr cinfo) {
+  JPEGDestination* const dest = (JPEGDestination*)cinfo->dest;
+  if (!dest->writer(dest->opaque, dest->buffer, sizeof(dest->buffer))) {
+    ERREXIT(cinfo, JERR_FILE_WRITE);
+  }
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = sizeof(dest->buffer);
+  return TRUE;
+}
+
+static void JPEGTermDestination(j_compress_ptr cinfo) {
+  JPEGDestination* const dest = (JPEGDestination*)cinfo->dest;
+  const size_t size = sizeof(dest->buffer) - dest->pub.free_in_buffer;
+  if (size > 0 && !dest->writer(dest->opaque, dest->buffer, size)) {
+    ERREXIT(cinfo, JERR_FILE_WRITE);
+  }
+}
+
+/* Copies the band of 16 luma rows starting at row y (and the matching 8
+ * chroma rows) into the MCU padded band buffer, repeating the last column
+ * and row of the image into the padding, and maps it to the JPEG range.
+ */
+static void FillRawBand(const uint8* Y,
+                        const uint8* U,
+                        const uint8* V,
+                        int width,
+                        int height,
+                        int y,
+                        uint8* band) {
+  const int uv_width = (width + 1) >> 1;
+  const int uv_height = (height + 1) >> 1;
+  const int band_stride = (width + 15) & ~15;
+  const int band_uv_stride = band_stride >> 1;
+  uint8* const band_Y = band;
+  uint8* const band_U = band_Y + 16 * band_stride;
+  uint8* const band_V = band_U + 8 * band_uv_stride;
+  int i;
+
+  for (i = 0; i < 16; ++i) {
+    const int row = (y + i < height) ? y + i : height - 1;
+    uint8* const dst = band_Y + i * band_stride;
+    memcpy(dst, Y + row * width, width);
+    memset(dst + width, dst[width - 1], band_stride - width);
+  }
+  for (i = 0; i < 8; ++i) {
+    const int row = ((y >> 1) + i < uv_height) ? (y >> 1) + i : uv_height - 1;
+    uint8* const dst_U = band_U + i * band_uv_stride;
+    uint8* const dst_V = band_V + i * band_uv_stride;
+    memcpy(dst_U, U + row * uv_width, uv_width);
+    memset(dst_U + uv_width, dst_U[uv_width - 1], band_uv_stride - uv_width);
+    memcpy(dst_V, V + row * uv_width, uv_width);
+    memset(dst_V + uv_width, dst_V[uv_width - 1], band_uv_stride - uv_width);
+  }
+  AdjustColorspaceBack(band_Y, band_U, band_V, band_stride, 16);
+}
+
+WebPResult JPEGEncodeYUV420(const uint8* Y,
+                            const uint8* U,
+                            const uint8* V,
+                            int width,
+                            int height,
+                            int quality,
+                            WebPIOWriter writer,
+                            void* opaque) {
+  struct jpeg_compress_struct cinfo;
+  JPEGDestination dest;
+  JPEGErrorMgr err;
+  JSAMPROW y_rows[16], u_rows[8], v_rows[8];
+  JSAMPARRAY planes[3];
+  int i;
+
+  if (!Y || !U || !V || width <= 0 || height <= 0 || !writer) {
+    return webp_failure;
+  }
+  uint8* const band = (uint8*)malloc(RawBandSize(width));
+  if (band == NULL) {
+    return webp_failure;
+  }
+  const int band_stride = (width + 15) & ~15;
+  const int band_uv_stride = band_stride >> 1;
+  for (i = 0; i < 16; ++i) {
+    y_rows[i] = band + i * band_stride;
+  }
+  for (i = 0; i < 8; ++i) {
+    u_rows[i] = band + 16 * band_stride + i * band_uv_stride;
+    v_rows[i] = band + 16 * band_stride + (8 + i) * band_uv_stride;
+  }
+  planes[0] = y_rows;
+  planes[1] = u_rows;
+  planes[2] = v_rows;
+
+  cinfo.err = JPEGSetupErrors(&err);
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    free(band);
+    return webp_failure;
+  }
+  jpeg_create_compress(&cinfo);
+  dest.pub.init_destination = JPEGInitDestination;
+  dest.pub.empty_output_buffer = JPEGEmptyOutputBuffer;
+  dest.pub.term_destination = JPEGTermDestination;
+  dest.writer = writer;
+  dest.opaque = opaque;
+  cinfo.dest = &dest.pub;
+
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  /* same 4:2:0 layout as the WebP planes */
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = 2;
+  cinfo.comp_info[1].h_samp_factor = 1;
+  cinfo.comp_info[1].v_samp_factor = 1;
+  cinfo.comp_info[2].h_samp_factor = 1;
+  cinfo.comp_info[2].v_samp_factor = 1;
+  cinfo.raw_data_in = TRUE;
+
+  jpeg_start_compress(&cinfo, TRUE);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    FillRawBand(Y, U, V, width, height, cinfo.next_scanline, band);
+    jpeg_write_raw_data(&cinfo, planes, 16);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(band);
+
+  return webp_success;
+}
@@ -0,0 +1,181 @@
+/*
+ * Image file readers feeding the WebP encoder
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Readers that decode other image formats straight into the YUV 4:2:0
+ * planes taken by WebPEncode, without going through a full RGBA frame.
+ * The planes have unpadded rows (stride == width), like everywhere in
+ * webpimg.h.
+ *
+ * These routines only depend on the C library and the respective codec
+ * library, so they can be shared by the PHP extension and the tools. The
+ * JPEG routines live in webpio.c and the PNG ones in webpio_png.c, so that
+ * each can be built only where its library is available.
+ */
+
+#ifndef WEBP_WEBPIO_H_
+#define WEBP_WEBPIO_H_
+
+#include "webpimg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif  /* __cplusplus */
+
+/* Receives size bytes of output from the writers below. Returns 1 on
+ * success, or 0 to abort the encoding.
+ */
+typedef int (*WebPIOWriter)(void* opaque, const uint8* data, size_t size);
+
+/* Fills data with up to size bytes of input for the streaming readers
+ * below. Returns the count of bytes stored, or 0 at the end of the input
+ * or on error.
+ */
+typedef size_t (*WebPIOReader)(void* opaque, uint8* data, size_t size);
+
+/* Reads the dimensions of a JPEG image from its header.
+ * Input:
+ *      1. data: the JPEG data stream (array of bytes)
+ *      2. data_size: count of bytes in the JPEG data stream
+ * Output:
+ *      3, 4. width, height: the dimensions of the image
+ * Return: success/failure
+ */
+WebPResult JPEGGetInfo(const uint8* data,
+                       int data_size,
+                       int* width,
+                       int* height);
+
+/* Decodes a JPEG image into Y, U, V planes ready for WebPEncode.
+ * Baseline and progressive YCbCr JPEGs with 2x2 chroma subsampling are
+ * decoded as raw planes and only mapped from the full range YUV420J of
+ * JPEG to YUV420 with AdjustColorspace, skipping the conversion to RGB and
+ * back. Other JPEGs (4:4:4, 4:2:2, grayscale, ...) are decoded to RGB two
+ * rows at a time and converted with RGBAToYUV420.
+ * Input:
+ *      1. data: the JPEG data stream (array of bytes)
+ *      2. data_size: count of bytes in the JPEG data stream
+ *      6, 7. width, height: the dimensions returned by JPEGGetInfo
+ * Output:
+ *      3, 4, 5. Y, U, V: caller allocated buffers of width * height and
+ *                        ((width + 1) / 2) * ((height + 1) / 2) bytes
+ * Return: success/failure
+ */
+WebPResult JPEGDecodeYUV420(const uint8* data,
+                            int data_size,
+                            uint8* Y,
+                            uint8* U,
+                            uint8* V,
+                            int width,
+                            int height);
+
+/* Encodes Y, U, V planes as produced by WebPDecode into a baseline JPEG
+ * with 2x2 chroma subsampling. The planes are mapped to the full range
+ * YUV420J of JPEG with AdjustColorspaceBack and written with the raw data
+ * interface of libjpeg, skipping the conversion to RGB and back. The input
+ * planes are left untouched.
+ * Input:
+ *      1, 2, 3. Y, U, V: the input planes, of width * height and
+ *                        ((width + 1) / 2) * ((height + 1) / 2) bytes
+ *      4, 5. width, height: the dimensions of the image
+ *      6. quality: the JPEG quality, 0 to 100
+ *      7, 8. writer, opaque: callback receiving the JPEG data as it is
+ *                            produced, and its first argument
+ * Return: success/failure
+ */
+WebPResult JPEGEncodeYUV420(const uint8* Y,
+                            const uint8* U,
+                            const uint8* V,
+                            int width,
+                            int height,
+                            int quality,
+                            WebPIOWriter writer,
+                            void* opaque);
+
+/* Reads the dimensions of a PNG image from its IHDR chunk.
+ * Input:
+ *      1. data: the PNG data stream (array of bytes)
+ *      2. data_size: count of bytes in the PNG data stream
+ * Output:
+ *      3, 4. width, height: the dimensions of the image
+ * Return: success/failure
+ */
+WebPResult PNGGetInfo(const uint8* data,
+                      int data_size,
+                      int* width,
+                      int* height);
+
+/* Decodes a PNG image into Y, U, V planes ready for WebPEncode. Rows are
+ * expanded to 8 bit RGB (or gray) by libpng and converted with RGBAToYUV420
+ * two at a time, so only a pair of rows is held besides the planes. The
+ * alpha channel is dropped, like imagewebp() does. Interlaced images need
+ * every pass before a row is complete and are read whole first.
+ * Input:
+ *      1. data: the PNG data stream (array of bytes)
+ *      2. data_size: count of bytes in the PNG data stream
+ *      6, 7. width, height: the dimensions returned by PNGGetInfo
+ * Output:
+ *      3, 4, 5. Y, U, V: caller allocated buffers of width * height and
+ *                        ((width + 1) / 2) * ((height + 1) / 2) bytes
+ * Return: success/failure
+ */
+WebPResult PNGDecodeYUV420(const uint8* data,
+                           int data_size,
+                           uint8* Y,
+                           uint8* U,
+                           uint8* V,
+                           int width,
+                           int height);
+
+/* Same as PNGDecodeYUV420, but pulls the PNG data stream from a callback
+ * as libpng asks for it, so the compressed image is not held in memory
+ * either. The stream must start at the PNG signature; a caller that read
+ * the IHDR chunk for PNGGetInfo hands those bytes back first.
+ * Input:
+ *      1, 2. reader, opaque: callback supplying the PNG data stream, and
+ *                            its first argument
+ *      6, 7. width, height: the dimensions returned by PNGGetInfo
+ * Output:
+ *      3, 4, 5. Y, U, V: caller allocated buffers of width * height and
+ *                        ((width + 1) / 2) * ((height + 1) / 2) bytes
+ * Return: success/failure
+ */
+WebPResult PNGDecodeYUV420Stream(WebPIOReader reader,
+                                 void* opaque,
+                                 uint8* Y,
+                                 uint8* U,
+                                 uint8* V,
+                                 int width,
+                                 int height);
+
+#ifdef __cplusplus
+}
+#endif  /* __cplusplus */
+
+#endif  /* WEBP_WEBPIO_H_ */
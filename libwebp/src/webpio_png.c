@@ -0,0 +1,265 @@
+/*
+ * PNG reader feeding the WebP encoder
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <png.h>
+
+#include "webpio.h"
+
+/*---------------------------------------------------------------------*
+ *                              PNG errors                             *
+ *---------------------------------------------------------------------*/
+
+/* libpng longjmp()s to png_jmpbuf itself after the error callback returns,
+ * but older versions abort() if it does, so jump from here.
+ */
+static void PNGError(png_structp png, png_const_charp message) {
+  (void)message;
+  longjmp(png_jmpbuf(png), 1);
+}
+
+static void PNGWarning(png_structp png, png_const_charp message) {
+  (void)png;
+  (void)message;  /* keep warnings off stderr */
+}
+
+/*---------------------------------------------------------------------*
+ *                              Reading PNG                            *
+ *---------------------------------------------------------------------*/
+
+typedef struct {
+  const uint8* data;
+  size_t size;
+  size_t offset;
+} PNGMemoryReader;
+
+static void PNGReadData(png_structp png, png_bytep out, png_size_t length) {
+  PNGMemoryReader* const reader = (PNGMemoryReader*)png_get_io_ptr(png);
+  if (length > reader->size - reader->offset) {
+    png_error(png, "truncated PNG");
+  }
+  memcpy(out, reader->data + reader->offset, length);
+  reader->offset += length;
+}
+
+typedef struct {
+  WebPIOReader read;
+  void* opaque;
+} PNGStreamReader;
+
+static void PNGReadStream(png_structp png, png_bytep out, png_size_t length) {
+  PNGStreamReader* const reader = (PNGStreamReader*)png_get_io_ptr(png);
+  while (length > 0) {
+    const size_t got = reader->read(reader->opaque, out, length);
+    if (got == 0 || got > length) {
+      png_error(png, "truncated PNG");
+    }
+    out += got;
+    length -= got;
+  }
+}
+
+WebPResult PNGGetInfo(const uint8* data,
+                      int data_size,
+                      int* width,
+                      int* height) {
+  /* signature, then the IHDR chunk: length, "IHDR", width, height, ... */
+  if (width) *width = 0;
+  if (height) *height = 0;
+  if (!data || data_size < 24 || png_sig_cmp((png_bytep)data, 0, 8)
+      || memcmp(data + 12, "IHDR", 4)) {
+    return webp_failure;
+  }
+  if (data[16] & 0x80 || data[20] & 0x80) {
+    return webp_failure;
+  }
+  if (width) {
+    *width = (data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+  }
+  if (height) {
+    *height = (data[20] << 24) | (data[21] << 16) | (data[22] << 8) | data[23];
+  }
+
+  return webp_success;
+}
+
+/* Packs rows of 8 bit RGB (channels == 3) or gray samples into the RGBA
+ * words taken by RGBAToYUV420.
+ */
+static void PackRows(const uint8* src,
+                     int channels,
+                     int width,
+                     int rows,
+                     uint32* pixdata) {
+  int x, i;
+  for (i = 0; i < rows; ++i) {
+    uint32* const dst = pixdata + i * width;
+    if (channels == 3) {
+      for (x = 0; x < width; ++x, src += 3) {
+        dst[x] = ((uint32)src[0] << 24) | (src[1] << 16) | (src[2] << 8);
+      }
+    } else {
+      for (x = 0; x < width; ++x) {
+        dst[x] = src[x] * 0x01010100U;
+      }
+      src += width;
+    }
+  }
+}
+
+static WebPResult DecodeYUV420(png_rw_ptr read_data,
+                               void* io,
+                               uint8* Y,
+                               uint8* U,
+                               uint8* V,
+                               int width,
+                               int height) {
+  const int uv_width = (width + 1) >> 1;
+  png_structp png;
+  png_infop info;
+  uint8* volatile band = NULL;
+  uint32* pixdata;
+  uint8* samples;
+  size_t row_bytes;
+  int passes, channels, pass, y;
+
+  png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+                               PNGError, PNGWarning);
+  if (png == NULL) {
+    return webp_failure;
+  }
+  info = png_create_info_struct(png);
+  if (info == NULL) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    return webp_failure;
+  }
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    free(band);
+    return webp_failure;
+  }
+
+  png_set_read_fn(png, io, read_data);
+  png_read_info(png, info);
+  /* the buffers were sized from PNGGetInfo: refuse any other size */
+  if ((int)png_get_image_width(png, info) != width
+      || (int)png_get_image_height(png, info) != height) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return webp_failure;
+  }
+
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_strip_alpha(png);
+  passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+  channels = png_get_channels(png, info);
+  row_bytes = (size_t)width * channels;
+
+  /* a pair of RGBA rows, and the samples of two rows (of all of them for
+   * an interlaced image)
+   */
+  band = (uint8*)malloc(2 * width * sizeof(uint32)
+                        + ((passes > 1) ? height : 2) * row_bytes);
+  if (band == NULL) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return webp_failure;
+  }
+  pixdata = (uint32*)band;
+  samples = band + 2 * width * sizeof(uint32);
+
+  if (passes > 1) {
+    for (pass = 0; pass < passes; ++pass) {
+      for (y = 0; y < height; ++y) {
+        png_read_row(png, samples + y * row_bytes, NULL);
+      }
+    }
+  }
+  for (y = 0; y < height; y += 2) {
+    const int rows = (height - y < 2) ? height - y : 2;
+    const uint8* src = samples;
+    if (passes > 1) {
+      src += y * row_bytes;
+    } else {
+      png_read_row(png, samples, NULL);
+      if (rows == 2) {
+        png_read_row(png, samples + row_bytes, NULL);
+      }
+    }
+    PackRows(src, channels, width, rows, pixdata);
+    RGBAToYUV420(pixdata, width, width, rows,
+                 Y + y * width,
+                 U + (y >> 1) * uv_width,
+                 V + (y >> 1) * uv_width);
+  }
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  free(band);
+
+  return webp_success;
+}
+
+WebPResult PNGDecodeYUV420(const uint8* data,
+                           int data_size,
+                           uint8* Y,
+                           uint8* U,
+                           uint8* V,
+                           int width,
+                           int height) {
+  PNGMemoryReader reader;
+
+  if (!data || data_size <= 0 || !Y || !U || !V
+      || width <= 0 || height <= 0) {
+    return webp_failure;
+  }
+  reader.data = data;
+  reader.size = (size_t)data_size;
+  reader.offset = 0;
+  return DecodeYUV420(PNGReadData, &reader, Y, U, V, width, height);
+}
+
+WebPResult PNGDecodeYUV420Stream(WebPIOReader read,
+                                 void* opaque,
+                                 uint8* Y,
+                                 uint8* U,
+                                 uint8* V,
+                                 int width,
+                                 int height) {
+  PNGStreamReader reader;
+
+  if (!read || !Y || !U || !V || width <= 0 || height <= 0) {
+    return webp_failure;
+  }
+  reader.read = read;
+  reader.opaque = opaque;
+  return DecodeYUV420(PNGReadStream, &reader, Y, U, V, width, height);
+}
@@ -44,6 +44,7 @@ extern "C" {
 #include <php.h>
 #include <ext/standard/info.h>
 #include <Zend/zend_extensions.h>
+#include <Zend/zend_exceptions.h>
 #ifndef HAVE_GD_BUNDLED
 #include <gd.h>
 #else
@@ -52,11 +53,130 @@ extern "C" {
 
 #if PHP_VERSION_ID >= 50300
 #define GD_API_IS_HIDDEN
+#endif /* PHP >= 5.3 */
+
+#endif /* HAVE_GD_BUNDLED */
+
+/* pipeline stages timed by the statistics */
+enum {
+	PHP_WEBP_STAGE_IO = 0,
+	PHP_WEBP_STAGE_PACK,
+	PHP_WEBP_STAGE_CONVERT,
+	PHP_WEBP_STAGE_CODEC,
+	PHP_WEBP_STAGE_PSNR,
+	PHP_WEBP_NUM_STAGES
+};
+
+/* operations counted by the statistics */
+enum {
+	PHP_WEBP_OP_NONE = -1,
+	PHP_WEBP_OP_ENCODE = 0,
+	PHP_WEBP_OP_DECODE,
+	PHP_WEBP_NUM_OPS
+};
+
+/* statistics of a single encode or decode call */
+typedef struct _php_webp_stats {
+	int op;
+	int width;
+	int height;
+	int qp;
+	long bytes_in;
+	long bytes_out;
+	long alloc_bytes;
+	int degraded;
+	int metrics;
+	double psnr;
+	double ssim;
+	double mark;
+	double time[PHP_WEBP_NUM_STAGES];
+} php_webp_stats;
+
+/* statistics aggregated over the lifetime of the worker */
+typedef struct _php_webp_totals {
+	long count;
+	long failures;
+	double bytes_in;
+	double bytes_out;
+	double time[PHP_WEBP_NUM_STAGES];
+} php_webp_totals;
+
+#ifdef HAVE_WEBP_STATUS
+/* buckets of the status histograms: one per QP, and latencies below
+ * 1, 2, 4 ... 16384 ms plus the longer ones */
+#define PHP_WEBP_STATUS_QPS 64
+#define PHP_WEBP_STATUS_LATENCIES 16
+
+/* counters of one operation in the status segment */
+typedef struct _php_webp_status_op {
+	long count;
+	long failures;
+	long bytes_in;
+	long bytes_out;
+	long time_us;
+	long qp[PHP_WEBP_STATUS_QPS];
+	long latency[PHP_WEBP_STATUS_LATENCIES];
+} php_webp_status_op;
+
+/* statistics shared by every process and thread of the server, updated
+ * with atomic additions only */
+typedef struct _php_webp_status {
+	long start_time;
+	php_webp_status_op ops[PHP_WEBP_NUM_OPS];
+} php_webp_status;
+#endif
+
+/* frame buffers kept in the scratch arena */
+enum {
+	PHP_WEBP_SCRATCH_PIXELS = 0,
+	PHP_WEBP_SCRATCH_YUV,
+	PHP_WEBP_SCRATCH_RECON,
+	PHP_WEBP_SCRATCH_OUTPUT,
+	PHP_WEBP_NUM_SCRATCH
+};
+
+/* a scratch buffer reused across calls and requests */
+typedef struct _php_webp_scratch {
+	void *ptr;
+	size_t size;
+	long idle;
+	zend_bool used;
+	zend_bool busy;
+} php_webp_scratch;
+
+/* a WebPImage object, the planes are decoded on demand */
+typedef struct _php_webp_image {
+	zend_object std;
+	char *data;
+	int data_size;
+	int width;
+	int height;
+	unsigned char *yuv;
+} php_webp_image;
 
 ZEND_BEGIN_MODULE_GLOBALS(webp)
+	long conversion_threads;
+	long conversion_threshold;
+	zend_bool stats_enabled;
+#ifdef HAVE_WEBP_STATUS
+	zend_bool status_enabled;
+#endif
+	php_webp_stats last_stats;
+	php_webp_totals totals[PHP_WEBP_NUM_OPS];
+	long max_pixels;
+	long scratch_limit;
+	long scratch_idle_requests;
+	long encode_deadline_ms;
+	size_t scratch_size;
+	php_webp_scratch scratch[PHP_WEBP_NUM_SCRATCH];
+#ifdef GD_API_IS_HIDDEN
 	zval *ict_name;
 	zend_fcall_info ict_fci;
 	zend_fcall_info_cache ict_fcc;
+	zval *ic_name;
+	zend_fcall_info ic_fci;
+	zend_fcall_info_cache ic_fcc;
+#endif
 ZEND_END_MODULE_GLOBALS(webp)
 
 #ifdef ZTS
@@ -64,9 +184,6 @@ ZEND_END_MODULE_GLOBALS(webp)
 #else
 #define WEBPG(v) (webp_globals.v)
 #endif
-#endif /* PHP >= 5.3 */
-
-#endif /* HAVE_GD_BUNDLED */
 
 #ifdef  __cplusplus
 } /* extern "C" */
@@ -0,0 +1,37 @@
+--TEST--
+webp_last_stats() function
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !file_exists('examples/Lenna.png')) {
+    die('skip ');
+}
+?>
+--INI--
+webp.stats=1
+--FILE--
+<?php
+var_dump(webp_last_stats());
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-stats.webp', 80, $difference);
+$stats = webp_last_stats();
+echo $stats['operation'], "\n";
+var_dump($stats['width'] == imagesx($im), $stats['bytes_out'] == filesize('examples/Lenna-stats.webp'));
+var_dump($stats['time']['codec'] > 0, $stats['time']['psnr'] > 0);
+imagecreatefromwebp('examples/Lenna-stats.webp');
+$stats = webp_last_stats();
+echo $stats['operation'], "\n";
+var_dump($stats['bytes_in'] == filesize('examples/Lenna-stats.webp'));
+unlink('examples/Lenna-stats.webp');
+ini_set('webp.stats', 0);
+var_dump(webp_last_stats());
+?>
+--EXPECT--
+bool(false)
+encode
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+decode
+bool(true)
+bool(false)
@@ -0,0 +1,31 @@
+--TEST--
+scratch buffers are reused across calls
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !file_exists('examples/Lenna.png')) {
+    die('skip ');
+}
+?>
+--INI--
+webp.stats=1
+webp.scratch_limit=67108864
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-scratch.webp', 80, $difference);
+$stats = webp_last_stats();
+var_dump($stats['allocated_bytes'] > 0);
+imagewebp($im, 'examples/Lenna-scratch.webp', 80, $difference2);
+$stats = webp_last_stats();
+var_dump($stats['allocated_bytes'], $difference == $difference2);
+imagecreatefromwebp('examples/Lenna-scratch.webp');
+imagecreatefromwebp('examples/Lenna-scratch.webp');
+$stats = webp_last_stats();
+var_dump($stats['allocated_bytes']);
+unlink('examples/Lenna-scratch.webp');
+?>
+--EXPECT--
+bool(true)
+int(0)
+bool(true)
+int(0)
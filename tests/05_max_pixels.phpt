@@ -0,0 +1,26 @@
+--TEST--
+webp.max_pixels limit
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !file_exists('examples/Lenna.png')) {
+    die('skip ');
+}
+?>
+--INI--
+webp.max_pixels=0
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+var_dump(imagewebp($im, 'examples/Lenna-max-pixels.webp'));
+ini_set('webp.max_pixels', imagesx($im) * imagesy($im) - 1);
+var_dump(@imagecreatefromwebp('examples/Lenna-max-pixels.webp'));
+var_dump(@imagewebp($im, 'examples/Lenna-max-pixels.webp'));
+ini_set('webp.max_pixels', imagesx($im) * imagesy($im));
+var_dump(is_resource(imagecreatefromwebp('examples/Lenna-max-pixels.webp')));
+unlink('examples/Lenna-max-pixels.webp');
+?>
+--EXPECT--
+bool(true)
+bool(false)
+bool(false)
+bool(true)
@@ -0,0 +1,29 @@
+--TEST--
+webp_from_jpeg() function
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_from_jpeg')
+    || !function_exists('imagejpeg') || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+imagejpeg($im, 'examples/Lenna-from-jpeg.jpg', 90);
+$data = webp_from_jpeg('examples/Lenna-from-jpeg.jpg', 80);
+var_dump(substr($data, 0, 4), substr($data, 8, 8));
+file_put_contents('examples/Lenna-from-jpeg.webp', $data);
+$im2 = imagecreatefromwebp('examples/Lenna-from-jpeg.webp');
+var_dump(imagesx($im2) == imagesx($im), imagesy($im2) == imagesy($im));
+var_dump(@webp_from_jpeg('examples/Lenna.png'));
+unlink('examples/Lenna-from-jpeg.jpg');
+unlink('examples/Lenna-from-jpeg.webp');
+?>
+--EXPECT--
+string(4) "RIFF"
+string(8) "WEBPVP8 "
+bool(true)
+bool(true)
+bool(false)
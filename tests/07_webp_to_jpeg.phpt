@@ -0,0 +1,29 @@
+--TEST--
+webp_to_jpeg() function
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_to_jpeg')
+    || !function_exists('imagecreatefromjpeg') || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-to-jpeg.webp');
+$data = webp_to_jpeg(file_get_contents('examples/Lenna-to-jpeg.webp'), 90);
+var_dump(bin2hex(substr($data, 0, 2)), bin2hex(substr($data, -2)));
+file_put_contents('examples/Lenna-to-jpeg.jpg', $data);
+$im2 = imagecreatefromjpeg('examples/Lenna-to-jpeg.jpg');
+var_dump(imagesx($im2) == imagesx($im), imagesy($im2) == imagesy($im));
+var_dump(@webp_to_jpeg('not a webp image'));
+unlink('examples/Lenna-to-jpeg.webp');
+unlink('examples/Lenna-to-jpeg.jpg');
+?>
+--EXPECT--
+string(4) "ffd8"
+string(4) "ffd9"
+bool(true)
+bool(true)
+bool(false)
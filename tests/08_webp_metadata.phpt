@@ -0,0 +1,62 @@
+--TEST--
+webp_get_metadata() and webp_set_metadata() functions
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_set_metadata')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-metadata.webp');
+var_dump(webp_get_metadata('examples/Lenna-metadata.webp'));
+var_dump(webp_set_metadata('examples/Lenna-metadata.webp',
+    array('ICOP' => 'Copyright', 'ICMT' => 'Lenna')));
+var_dump(webp_get_metadata('examples/Lenna-metadata.webp'));
+var_dump(webp_set_metadata('examples/Lenna-metadata.webp',
+    array('ICMT' => null, 'INAM' => 'Lena'), 'examples/Lenna-metadata2.webp'));
+var_dump(webp_get_metadata('examples/Lenna-metadata2.webp'));
+var_dump(@webp_set_metadata('examples/Lenna-metadata.webp', array('EXIF' => '')));
+$im2 = imagecreatefromwebp('examples/Lenna-metadata2.webp');
+var_dump(imagesx($im2) == imagesx($im), imagesy($im2) == imagesy($im));
+var_dump(webp_set_metadata('examples/Lenna-metadata2.webp',
+    array('IART' => 'Playboy'), './examples/../examples/Lenna-metadata2.webp'));
+var_dump(webp_get_metadata('examples/Lenna-metadata2.webp'));
+$im2 = imagecreatefromwebp('examples/Lenna-metadata2.webp');
+var_dump(imagesx($im2) == imagesx($im));
+unlink('examples/Lenna-metadata.webp');
+unlink('examples/Lenna-metadata2.webp');
+?>
+--EXPECT--
+array(0) {
+}
+bool(true)
+array(2) {
+  ["ICMT"]=>
+  string(5) "Lenna"
+  ["ICOP"]=>
+  string(9) "Copyright"
+}
+bool(true)
+array(2) {
+  ["ICOP"]=>
+  string(9) "Copyright"
+  ["INAM"]=>
+  string(4) "Lena"
+}
+bool(false)
+bool(true)
+bool(true)
+bool(true)
+array(3) {
+  ["ICOP"]=>
+  string(9) "Copyright"
+  ["IART"]=>
+  string(7) "Playboy"
+  ["INAM"]=>
+  string(4) "Lena"
+}
+bool(true)
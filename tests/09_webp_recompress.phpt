@@ -0,0 +1,35 @@
+--TEST--
+webp_recompress() function
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_recompress')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-recompress.webp', 90);
+$data = file_get_contents('examples/Lenna-recompress.webp');
+$low = webp_recompress($data, 30);
+var_dump(strlen($low) < strlen($data), substr($low, 0, 4));
+var_dump(webp_recompress($data, 90) === $data);
+var_dump(webp_recompress($low, 90) === $low);
+var_dump(webp_recompress($low, 90, true) === $low);
+file_put_contents('examples/Lenna-recompress.webp', $low);
+$im2 = imagecreatefromwebp('examples/Lenna-recompress.webp');
+var_dump(imagesx($im2) == imagesx($im), imagesy($im2) == imagesy($im));
+var_dump(@webp_recompress('not a webp image'));
+unlink('examples/Lenna-recompress.webp');
+?>
+--EXPECT--
+bool(true)
+string(4) "RIFF"
+bool(true)
+bool(true)
+bool(false)
+bool(true)
+bool(true)
+bool(false)
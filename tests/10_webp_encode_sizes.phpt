@@ -0,0 +1,37 @@
+--TEST--
+webp_encode_sizes() function
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_encode_sizes')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+$width = imagesx($im);
+$sizes = webp_encode_sizes($im, array(64, $width, 128, 64, $width * 2), array('quality' => 50));
+var_dump(array_keys($sizes) === array($width, 128, 64));
+foreach ($sizes as $w => $data) {
+    file_put_contents('examples/Lenna-sizes.webp', $data);
+    $im2 = imagecreatefromwebp('examples/Lenna-sizes.webp');
+    var_dump(imagesx($im2) == $w,
+        imagesy($im2) == round(imagesy($im) * $w / $width));
+}
+var_dump(webp_encode_sizes($im, array()));
+var_dump(@webp_encode_sizes($im, array(0)));
+unlink('examples/Lenna-sizes.webp');
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(0) {
+}
+bool(false)
@@ -0,0 +1,32 @@
+--TEST--
+webp_encode() function with a placeholder
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_encode')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+$data = webp_encode($im, array('quality' => 80, 'placeholder' => 16), $info);
+var_dump(substr($data, 0, 4), $info['width'] == imagesx($im));
+var_dump(strlen($info['placeholder']) < strlen($data) / 10);
+file_put_contents('examples/Lenna-placeholder.webp', $info['placeholder']);
+$lq = imagecreatefromwebp('examples/Lenna-placeholder.webp');
+var_dump(max(imagesx($lq), imagesy($lq)));
+webp_encode($im, array('placeholder' => 16, 'placeholder_uri' => true), $info);
+var_dump(strpos($info['placeholder'], 'data:image/webp;base64,UklGR') === 0);
+webp_encode($im, null, $info);
+var_dump(isset($info['placeholder']));
+unlink('examples/Lenna-placeholder.webp');
+?>
+--EXPECT--
+string(4) "RIFF"
+bool(true)
+bool(true)
+int(16)
+bool(true)
+bool(false)
@@ -0,0 +1,32 @@
+--TEST--
+webp_encode() function with adaptive quantization
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_encode')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+$plain = webp_encode($im, array('quality' => 80));
+$adaptive = webp_encode($im, array('quality' => 80, 'adaptive' => true));
+$roi = webp_encode($im, array('quality' => 80, 'roi' => array(200, 200, 150, 150)));
+var_dump(strlen($adaptive) < strlen($plain));
+foreach (array($adaptive, $roi) as $data) {
+    file_put_contents('examples/Lenna-adaptive.webp', $data);
+    $im2 = imagecreatefromwebp('examples/Lenna-adaptive.webp');
+    var_dump(imagesx($im2) == imagesx($im), imagesy($im2) == imagesy($im));
+}
+var_dump(@webp_encode($im, array('roi' => array(1, 2))));
+unlink('examples/Lenna-adaptive.webp');
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
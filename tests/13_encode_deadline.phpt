@@ -0,0 +1,37 @@
+--TEST--
+webp.encode_deadline_ms and the deadline_ms option
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_encode')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--INI--
+webp.encode_deadline_ms=0
+webp.stats=1
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+webp_encode($im, array(), $info);
+var_dump($info['degraded']);
+$data = webp_encode($im, array('deadline_ms' => 1), $info);
+var_dump($info['degraded'] > 0, substr($data, 0, 4));
+webp_encode($im, array('deadline_ms' => 100000), $info);
+var_dump($info['degraded']);
+ini_set('webp.encode_deadline_ms', 1);
+imagewebp($im, 'examples/Lenna-deadline.webp');
+$stats = webp_last_stats();
+var_dump($stats['degraded'] > 0);
+$im2 = imagecreatefromwebp('examples/Lenna-deadline.webp');
+var_dump(imagesx($im2) == imagesx($im));
+unlink('examples/Lenna-deadline.webp');
+?>
+--EXPECT--
+int(0)
+bool(true)
+string(4) "RIFF"
+int(0)
+bool(true)
+bool(true)
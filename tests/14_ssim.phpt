@@ -0,0 +1,36 @@
+--TEST--
+SSIM of the encoded image
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_encode')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--INI--
+webp.stats=1
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+webp_encode($im, array('quality' => 90, 'psnr' => true, 'ssim' => true), $high);
+webp_encode($im, array('quality' => 10, 'ssim_chroma' => true), $low);
+var_dump($high['psnr'] > 30, $high['ssim'] > 0.9, $high['ssim'] <= 1.0);
+var_dump(isset($low['psnr']), $low['ssim'] < $high['ssim']);
+imagewebp($im, 'examples/Lenna-ssim.webp', 90, $difference);
+$stats = webp_last_stats();
+var_dump($stats['psnr'] == $difference, $stats['ssim'] > 0.9);
+imagewebp($im, 'examples/Lenna-ssim.webp');
+$stats = webp_last_stats();
+var_dump(isset($stats['ssim']));
+unlink('examples/Lenna-ssim.webp');
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
@@ -0,0 +1,29 @@
+--TEST--
+webp_encode() with the quality chosen from a target SSIM
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_encode')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+$auto = webp_encode($im, array('quality' => 'auto', 'ssim' => true), $info);
+var_dump(is_string($auto), $info['quality'] >= 0, $info['quality'] <= 100);
+var_dump($info['ssim'] > 0.9);
+webp_encode($im, array('target_ssim' => 0.99), $high);
+webp_encode($im, array('target_ssim' => 0.80), $low);
+var_dump($high['quality'] >= $low['quality']);
+webp_encode($im, array('quality' => 100), $fixed);
+var_dump($fixed['quality']);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+int(100)
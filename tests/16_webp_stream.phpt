@@ -0,0 +1,54 @@
+--TEST--
+imagewebp() to a stream, and the webp.encode stream filter
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !file_exists('examples/Lenna.png')
+    || !in_array('webp.encode', stream_get_filters())
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+$file = 'examples/Lenna-stream.webp';
+imagewebp($im, $file, 80);
+$expected = file_get_contents($file);
+
+$fp = fopen('php://memory', 'w+b');
+var_dump(imagewebp($im, $fp, 80));
+rewind($fp);
+var_dump(stream_get_contents($fp) === $expected);
+fclose($fp);
+
+$width = imagesx($im);
+$height = imagesy($im);
+$fp = fopen($file, 'wb');
+$filter = stream_filter_append($fp, 'webp.encode', STREAM_FILTER_WRITE,
+    array('width' => $width, 'height' => $height, 'quality' => 80));
+var_dump(is_resource($filter));
+for ($y = 0; $y < $height; $y++) {
+    $row = '';
+    for ($x = 0; $x < $width; $x++) {
+        $row .= pack('N', imagecolorat($im, $x, $y) << 8);
+    }
+    fwrite($fp, $row);
+}
+fclose($fp);
+var_dump(file_get_contents($file) === $expected);
+
+$fp = fopen('php://memory', 'wb');
+var_dump(@stream_filter_append($fp, 'webp.encode', STREAM_FILTER_WRITE,
+    array('width' => 0, 'height' => 1)));
+var_dump(@stream_filter_append($fp, 'webp.encode', STREAM_FILTER_WRITE,
+    array('width' => 1, 'height' => 1, 'format' => 'cmyk')));
+fclose($fp);
+unlink($file);
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+bool(false)
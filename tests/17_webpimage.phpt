@@ -0,0 +1,62 @@
+--TEST--
+WebPImage class
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !class_exists('WebPImage')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-object.webp', 80);
+webp_set_metadata('examples/Lenna-object.webp', array('INAM' => 'Lenna'));
+$data = file_get_contents('examples/Lenna-object.webp');
+
+$image = new WebPImage($data);
+var_dump($image->getWidth() == imagesx($im), $image->getHeight() == imagesy($im));
+var_dump(abs($image->getQuality() - 80) <= 2);
+var_dump($image->getData() === $data);
+var_dump($image->getMetadata());
+
+$im1 = $image->toGd();
+$im2 = imagecreatefromwebp('examples/Lenna-object.webp');
+$im3 = $image->toGd();
+var_dump(is_resource($im1), $im1 !== $im3);
+$same = true;
+for ($y = 0; $y < imagesy($im2); $y += 7) {
+    for ($x = 0; $x < imagesx($im2); $x += 7) {
+        $c = imagecolorat($im2, $x, $y);
+        $same = $same && imagecolorat($im1, $x, $y) == $c
+            && imagecolorat($im3, $x, $y) == $c;
+    }
+}
+var_dump($same);
+
+$image = WebPImage::fromFile('examples/Lenna-object.webp');
+var_dump($image->getData() === $data);
+var_dump(@WebPImage::fromFile('examples/Lenna.png'));
+try {
+    new WebPImage('not a webp image');
+} catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+}
+unlink('examples/Lenna-object.webp');
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(1) {
+  ["INAM"]=>
+  string(5) "Lenna"
+}
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+Failed to decode WebP image
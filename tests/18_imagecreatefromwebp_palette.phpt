@@ -0,0 +1,58 @@
+--TEST--
+imagecreatefromwebp() to a palette image
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !file_exists('examples/Lenna.png')) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-palette.webp');
+
+$pal = imagecreatefromwebp('examples/Lenna-palette.webp', array('palette' => 256));
+var_dump(imageistruecolor($pal), imagecolorstotal($pal) <= 256);
+var_dump(imagesx($pal) == imagesx($im), imagesy($pal) == imagesy($im));
+var_dump(imagegif($pal, 'examples/Lenna-palette.gif'));
+
+$pal = imagecreatefromwebp('examples/Lenna-palette.webp',
+    array('palette' => 16, 'dither' => true));
+var_dump(imageistruecolor($pal), imagecolorstotal($pal) <= 16);
+
+$image = WebPImage::fromFile('examples/Lenna-palette.webp');
+$pal = $image->toGd(array('palette' => 64));
+var_dump(imageistruecolor($pal), imagecolorstotal($pal) <= 64);
+var_dump(imageistruecolor($image->toGd()));
+
+var_dump(@imagecreatefromwebp('examples/Lenna-palette.webp', array('palette' => 1)));
+
+// without chroma detail, the palette is a ramp of grays
+imagefilter($im, IMG_FILTER_GRAYSCALE);
+imagewebp($im, 'examples/Lenna-palette.webp');
+$pal = imagecreatefromwebp('examples/Lenna-palette.webp', array('palette' => 32));
+$gray = true;
+for ($i = 0; $i < imagecolorstotal($pal); $i++) {
+    $c = imagecolorsforindex($pal, $i);
+    if (abs($c['red'] - $c['green']) > 2 || abs($c['blue'] - $c['green']) > 2) {
+        $gray = false;
+    }
+}
+var_dump(imagecolorstotal($pal) > 1, $gray);
+unlink('examples/Lenna-palette.webp');
+unlink('examples/Lenna-palette.gif');
+?>
+--EXPECT--
+bool(false)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+bool(true)
+bool(false)
+bool(true)
+bool(true)
+bool(false)
+bool(true)
+bool(true)
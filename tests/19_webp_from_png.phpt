@@ -0,0 +1,40 @@
+--TEST--
+webp_from_png() function
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_from_png')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--FILE--
+<?php
+$data = webp_from_png('examples/Lenna.png', 80);
+$stats = webp_last_stats();
+var_dump($stats['bytes_in'] == filesize('examples/Lenna.png'));
+var_dump(substr($data, 0, 4), substr($data, 8, 8));
+file_put_contents('examples/Lenna-from-png.webp', $data);
+$im = imagecreatefrompng('examples/Lenna.png');
+$im2 = imagecreatefromwebp('examples/Lenna-from-png.webp');
+var_dump(imagesx($im2) == imagesx($im), imagesy($im2) == imagesy($im));
+imageinterlace($im, 1);
+imagepng($im, 'examples/Lenna-interlaced.png');
+var_dump(strlen(webp_from_png('examples/Lenna-interlaced.png', 80)) > 0);
+var_dump(@webp_from_png('examples/Lenna-from-png.webp'));
+$png = file_get_contents('examples/Lenna.png');
+file_put_contents('examples/Lenna-truncated.png', substr($png, 0, strlen($png) >> 1));
+var_dump(@webp_from_png('examples/Lenna-truncated.png'));
+unlink('examples/Lenna-from-png.webp');
+unlink('examples/Lenna-truncated.png');
+unlink('examples/Lenna-interlaced.png');
+?>
+--EXPECT--
+bool(true)
+string(4) "RIFF"
+string(8) "WEBPVP8 "
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+bool(false)
@@ -0,0 +1,48 @@
+--TEST--
+webp_get_status() function
+--SKIPIF--
+<?php
+if (!extension_loaded('webp') || !function_exists('webp_get_status')
+    || !file_exists('examples/Lenna.png')
+) {
+    die('skip ');
+}
+?>
+--INI--
+webp.stats=1
+webp.status=1
+--FILE--
+<?php
+$before = webp_get_status();
+var_dump($before['start_time'] <= time());
+$im = imagecreatefrompng('examples/Lenna.png');
+imagewebp($im, 'examples/Lenna-status.webp', 80);
+imagecreatefromwebp('examples/Lenna-status.webp');
+@imagecreatefromwebp('examples/Lenna.png');
+$after = webp_get_status();
+$encode = $after['encode'];
+$decode = $after['decode'];
+var_dump($encode['count'] - $before['encode']['count']);
+var_dump($decode['count'] - $before['decode']['count']);
+var_dump($decode['failures'] - $before['decode']['failures']);
+var_dump($encode['bytes_out'] - $before['encode']['bytes_out']
+    == filesize('examples/Lenna-status.webp'));
+var_dump(count($encode['qp']), count($encode['latency']));
+var_dump(array_sum($encode['latency']) == $encode['count']);
+var_dump($encode['qp'][12] - $before['encode']['qp'][12]);
+var_dump(array_sum($decode['qp']) - array_sum($before['decode']['qp']));
+var_dump($encode['time'] > $before['encode']['time']);
+unlink('examples/Lenna-status.webp');
+?>
+--EXPECT--
+bool(true)
+int(1)
+int(2)
+int(1)
+bool(true)
+int(64)
+int(16)
+bool(true)
+int(1)
+int(1)
+bool(true)
@@ -0,0 +1,570 @@
+/*
+ * Rate-distortion benchmark of WebPEncode
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Usage: rdbench [-q first:last:step] [-n runs] [-s WxH]... [-w out.csv]
+ *                [-b baseline.csv [-x max_percent]] [file]...
+ *
+ * Encodes every image of a fixed corpus with WebPEncode at each QP of the
+ * range given with -q (8:56:8 by default) and writes one CSV row per point
+ * to stdout:
+ *
+ *   image,width,height,qp,bytes,bpp,psnr,ssim,encode_ms
+ *
+ * psnr is the one computed by WebPEncode, ssim the luma GetSSIMYuv of the
+ * decoded image, and encode_ms the median of -n runs (3 by default). The
+ * corpus is a set of synthetic images (a smooth gradient, sharp edges like
+ * text and line art, and fine texture) of each size given with -s, 512x512
+ * by default, plus any PNG, JPEG or WebP file named on the command line.
+ *
+ * -w also writes the rows to a file, to be kept as the baseline. -b reads
+ * such a baseline back and reports on stderr the Bjontegaard delta rate
+ * (BD-rate) of every image against it, over PSNR and over SSIM (in dB):
+ * the average change of the size at equal quality, negative being better.
+ * The exit status is 1 when the mean PSNR BD-rate is above -x percent
+ * (0.5 by default), so that a change of the encoder settings in VPXEncode
+ * that costs compression efficiency fails the run. The baseline must have
+ * been made with the same corpus and QP range; images missing from it are
+ * reported and skipped.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webpimg.h"
+#include "webpio.h"
+#include "toolutil.h"
+
+#define MAX_POINTS 64
+#define MAX_IMAGES 256
+
+typedef struct {
+  int QP;
+  double bytes;
+  double bpp;
+  double psnr;
+  double ssim;
+  double encode_ms;
+} RDPoint;
+
+typedef struct {
+  char name[256];
+  int width;
+  int height;
+  int num_points;
+  RDPoint points[MAX_POINTS];
+} RDCurve;
+
+typedef struct {
+  char name[256];
+  int width;
+  int height;
+  uint8* yuv;         /* Y, then U, then V, unpadded */
+} RDImage;
+
+static int CompareDouble(const void* a, const void* b) {
+  const double x = *(const double*)a, y = *(const double*)b;
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Corpus                                 *
+ *---------------------------------------------------------------------*/
+
+enum {
+  SYNTHETIC_GRADIENT = 0,
+  SYNTHETIC_EDGES,
+  SYNTHETIC_TEXTURE,
+  NUM_SYNTHETIC
+};
+
+static const char* const kSyntheticNames[NUM_SYNTHETIC] = {
+  "gradient", "edges", "texture"
+};
+
+static int AllocImage(RDImage* img, int width, int height) {
+  const size_t uv_size = (size_t)((width + 1) >> 1) * ((height + 1) >> 1);
+  img->width = width;
+  img->height = height;
+  img->yuv = (uint8*)malloc((size_t)width * height + 2 * uv_size);
+  return img->yuv != NULL;
+}
+
+/* Deterministic images covering the content types the encoder settings
+ * trade against each other: smooth areas where blocking shows, sharp edges
+ * where ringing shows, and texture that costs bits whatever the QP.
+ */
+static int MakeSynthetic(RDImage* img, int kind, int width, int height) {
+  uint32* const pix = (uint32*)malloc((size_t)width * height * sizeof(*pix));
+  unsigned int seed = 0x12345678u;
+  int x, y;
+  if (!pix || !AllocImage(img, width, height)) {
+    free(pix);
+    return 0;
+  }
+  snprintf(img->name, sizeof(img->name), "%s-%dx%d",
+           kSyntheticNames[kind], width, height);
+  for (y = 0; y < height; ++y) {
+    for (x = 0; x < width; ++x) {
+      int r, g, b, n;
+      seed = seed * 1103515245u + 12345u;
+      n = (int)((seed >> 16) & 255);
+      if (kind == SYNTHETIC_GRADIENT) {
+        r = (x * 255) / width + (n & 7) - 4;
+        g = (y * 255) / height + (n & 7) - 4;
+        b = ((x + y) * 127) / (width + height) + 64;
+      } else if (kind == SYNTHETIC_EDGES) {
+        /* dark strokes on a light background, and a few colored boxes */
+        const int stroke = ((x / 3) % 7 == 0 && (y / 12) % 2 == 0)
+                           || ((y / 2) % 11 == 0 && (x / 40) % 3 != 2);
+        const int box = ((x / 64) + (y / 64)) % 5 == 0;
+        r = stroke ? 20 : box ? 200 : 245;
+        g = stroke ? 20 : box ? 60 : 245;
+        b = stroke ? 30 : box ? 40 : 240;
+      } else {
+        r = 128 + (n - 128) / 2 + (int)(40. * sin(x * 0.31) * cos(y * 0.27));
+        g = r - 10 + (n & 15);
+        b = 96 + (n >> 2);
+      }
+      r = (r < 0) ? 0 : (r > 255) ? 255 : r;
+      g = (g < 0) ? 0 : (g > 255) ? 255 : g;
+      b = (b < 0) ? 0 : (b > 255) ? 255 : b;
+      pix[(size_t)y * width + x] = ((uint32)r << 24) | (g << 16) | (b << 8);
+    }
+  }
+  RGBAToYUV420(pix, width, width, height, img->yuv,
+               img->yuv + (size_t)width * height,
+               img->yuv + (size_t)width * height
+                   + (size_t)((width + 1) >> 1) * ((height + 1) >> 1));
+  free(pix);
+  return 1;
+}
+
+static int LoadFile(RDImage* img, const char* path) {
+  size_t size = 0;
+  unsigned char* const data = ReadFile(path, &size);
+  const char* base = strrchr(path, '/');
+  int width = 0, height = 0, ok = 0;
+  if (!data) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  snprintf(img->name, sizeof(img->name), "%s", base ? base + 1 : path);
+  if (size > 8 && !memcmp(data, "\x89PNG", 4)) {
+    ok = PNGGetInfo(data, (int)size, &width, &height) == webp_success
+         && AllocImage(img, width, height)
+         && PNGDecodeYUV420(data, (int)size, img->yuv,
+                            img->yuv + (size_t)width * height,
+                            img->yuv + (size_t)width * height
+                                + (size_t)((width + 1) >> 1)
+                                  * ((height + 1) >> 1),
+                            width, height) == webp_success;
+  } else if (size > 3 && data[0] == 0xFF && data[1] == 0xD8) {
+    ok = JPEGGetInfo(data, (int)size, &width, &height) == webp_success
+         && AllocImage(img, width, height)
+         && JPEGDecodeYUV420(data, (int)size, img->yuv,
+                             img->yuv + (size_t)width * height,
+                             img->yuv + (size_t)width * height
+                                 + (size_t)((width + 1) >> 1)
+                                   * ((height + 1) >> 1),
+                             width, height) == webp_success;
+  } else if (size > 12 && !memcmp(data, "RIFF", 4)) {
+    ok = WebPGetInfo(data, (int)size, &width, &height) == webp_success
+         && AllocImage(img, width, height)
+         && WebPDecodeInto(data, (int)size, img->yuv,
+                           img->yuv + (size_t)width * height,
+                           img->yuv + (size_t)width * height
+                               + (size_t)((width + 1) >> 1)
+                                 * ((height + 1) >> 1),
+                           width, (width + 1) >> 1,
+                           width, height) == webp_success;
+  }
+  if (!ok) fprintf(stderr, "%s: unsupported or broken image\n", path);
+  free(data);
+  return ok;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Measurements                           *
+ *---------------------------------------------------------------------*/
+
+static int MeasureCurve(const RDImage* img, int first, int last, int step,
+                        int runs, RDCurve* curve) {
+  const int width = img->width, height = img->height;
+  const int uv_width = (width + 1) >> 1, uv_height = (height + 1) >> 1;
+  const uint8* const Y = img->yuv;
+  const uint8* const U = Y + (size_t)width * height;
+  const uint8* const V = U + (size_t)uv_width * uv_height;
+  double times[16];
+  int QP, i;
+
+  memset(curve, 0, sizeof(*curve));
+  strcpy(curve->name, img->name);
+  curve->width = width;
+  curve->height = height;
+  for (QP = first; QP <= last && curve->num_points < MAX_POINTS; QP += step) {
+    RDPoint* const point = &curve->points[curve->num_points];
+    uint8 *dY = NULL, *dU = NULL, *dV = NULL;
+    unsigned char* out = NULL;
+    int out_size = 0, dw = 0, dh = 0;
+    double psnr = 0.;
+
+    for (i = 0; i < runs; ++i) {
+      const double start = Now();
+      free(out);
+      out = NULL;
+      if (WebPEncode(Y, U, V, width, height, width,
+                     uv_width, uv_height, uv_width,
+                     QP, &out, &out_size, &psnr) != webp_success) {
+        fprintf(stderr, "%s: encoding at QP %d failed\n", img->name, QP);
+        return 0;
+      }
+      times[i] = Now() - start;
+    }
+    qsort(times, runs, sizeof(times[0]), CompareDouble);
+    if (WebPDecode(out, out_size, &dY, &dU, &dV, &dw, &dh) != webp_success
+        || dw != width || dh != height) {
+      fprintf(stderr, "%s: decoding at QP %d failed\n", img->name, QP);
+      free(dY);
+      free(out);
+      return 0;
+    }
+    point->QP = QP;
+    point->bytes = out_size;
+    point->bpp = 8. * out_size / ((double)width * height);
+    point->psnr = psnr;
+    point->ssim = GetSSIMYuv(Y, U, V, dY, dU, dV, width, height, 0);
+    point->encode_ms = times[runs / 2] * 1e3;
+    ++curve->num_points;
+    free(dY);
+    free(out);
+  }
+  return 1;
+}
+
+static void WriteCurve(FILE* fp, const RDCurve* curve) {
+  int i;
+  for (i = 0; i < curve->num_points; ++i) {
+    const RDPoint* const p = &curve->points[i];
+    fprintf(fp, "%s,%d,%d,%d,%.0f,%.8f,%.6f,%.9f,%.3f\n",
+            curve->name, curve->width, curve->height, p->QP, p->bytes,
+            p->bpp, p->psnr, p->ssim, p->encode_ms);
+  }
+}
+
+/* Reads the curves of a file written with -w. Returns their number, or -1
+ * if the file cannot be read.
+ */
+static int ReadBaseline(const char* path, RDCurve* curves, int max_curves) {
+  FILE* const fp = fopen(path, "r");
+  char line[512];
+  int num_curves = 0;
+  if (!fp) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    char name[256];
+    RDPoint p;
+    int width, height, i;
+    RDCurve* curve = NULL;
+    if (sscanf(line, "%255[^,],%d,%d,%d,%lf,%lf,%lf,%lf,%lf",
+               name, &width, &height, &p.QP, &p.bytes, &p.bpp,
+               &p.psnr, &p.ssim, &p.encode_ms) != 9) {
+      continue;   /* the header line */
+    }
+    for (i = 0; i < num_curves; ++i) {
+      if (!strcmp(curves[i].name, name)) curve = &curves[i];
+    }
+    if (!curve) {
+      if (num_curves == max_curves) continue;
+      curve = &curves[num_curves++];
+      memset(curve, 0, sizeof(*curve));
+      strcpy(curve->name, name);
+      curve->width = width;
+      curve->height = height;
+    }
+    if (curve->num_points < MAX_POINTS) {
+      curve->points[curve->num_points++] = p;
+    }
+  }
+  fclose(fp);
+  return num_curves;
+}
+
+/*---------------------------------------------------------------------*
+ *                              BD-rate                                *
+ *---------------------------------------------------------------------*/
+
+/* Least squares fit of a cubic c[0] + c[1] x + c[2] x^2 + c[3] x^3 through
+ * n points, solving the normal equations by Gaussian elimination.
+ */
+static int FitCubic(const double* x, const double* y, int n, double c[4]) {
+  double a[4][5];
+  int i, j, k;
+  memset(a, 0, sizeof(a));
+  for (k = 0; k < n; ++k) {
+    double xi[7];
+    xi[0] = 1.;
+    for (i = 1; i < 7; ++i) xi[i] = xi[i - 1] * x[k];
+    for (i = 0; i < 4; ++i) {
+      for (j = 0; j < 4; ++j) a[i][j] += xi[i + j];
+      a[i][4] += xi[i] * y[k];
+    }
+  }
+  for (i = 0; i < 4; ++i) {
+    int pivot = i;
+    for (j = i + 1; j < 4; ++j) {
+      if (fabs(a[j][i]) > fabs(a[pivot][i])) pivot = j;
+    }
+    if (fabs(a[pivot][i]) < 1e-12) return 0;
+    for (k = 0; k < 5; ++k) {
+      const double t = a[i][k];
+      a[i][k] = a[pivot][k];
+      a[pivot][k] = t;
+    }
+    for (j = 0; j < 4; ++j) {
+      if (j != i) {
+        const double f = a[j][i] / a[i][i];
+        for (k = i; k < 5; ++k) a[j][k] -= f * a[i][k];
+      }
+    }
+  }
+  for (i = 0; i < 4; ++i) c[i] = a[i][4] / a[i][i];
+  return 1;
+}
+
+static double IntegrateCubic(const double c[4], double lo, double hi) {
+  return c[0] * (hi - lo) + c[1] * (hi * hi - lo * lo) / 2.
+         + c[2] * (hi * hi * hi - lo * lo * lo) / 3.
+         + c[3] * (hi * hi * hi * hi - lo * lo * lo * lo) / 4.;
+}
+
+/* Quality of a point on the scale the BD-rate is computed over: PSNR, or
+ * SSIM in dB.
+ */
+static double Quality(const RDPoint* p, int use_ssim) {
+  return use_ssim ? -10. * log10(1. - p->ssim) : p->psnr;
+}
+
+/* Bjontegaard delta rate of test against base, in percent: the log of the
+ * rate is fitted as a cubic of the quality for both curves, and the fits
+ * are averaged over the quality range the curves share. The quality is
+ * mapped to [-1, 1] over that range first, which keeps the fit well
+ * conditioned. Points of perfect quality (infinite dB) are left out.
+ * Returns 0 if the curves have fewer than 4 usable points or do not
+ * overlap.
+ */
+static int BDRate(const RDCurve* base, const RDCurve* test, int use_ssim,
+                  double* rate) {
+  const RDCurve* const curves[2] = { base, test };
+  double q[2][MAX_POINTS], r[2][MAX_POINTS], c[2][4];
+  double lo = -HUGE_VAL, hi = HUGE_VAL, center, scale;
+  int n[2], k, i;
+  for (k = 0; k < 2; ++k) {
+    double q_min = HUGE_VAL, q_max = -HUGE_VAL;
+    n[k] = 0;
+    for (i = 0; i < curves[k]->num_points; ++i) {
+      const RDPoint* const p = &curves[k]->points[i];
+      const double quality = Quality(p, use_ssim);
+      if (!isfinite(quality) || p->bpp <= 0.) continue;
+      q[k][n[k]] = quality;
+      r[k][n[k]] = log(p->bpp);
+      if (quality < q_min) q_min = quality;
+      if (quality > q_max) q_max = quality;
+      ++n[k];
+    }
+    if (n[k] < 4) return 0;
+    if (q_min > lo) lo = q_min;
+    if (q_max < hi) hi = q_max;
+  }
+  if (hi <= lo) return 0;
+  center = (hi + lo) / 2.;
+  scale = (hi - lo) / 2.;
+  for (k = 0; k < 2; ++k) {
+    for (i = 0; i < n[k]; ++i) q[k][i] = (q[k][i] - center) / scale;
+    if (!FitCubic(q[k], r[k], n[k], c[k])) return 0;
+  }
+  *rate = (exp((IntegrateCubic(c[1], -1., 1.) - IntegrateCubic(c[0], -1., 1.))
+               / 2.) - 1.) * 100.;
+  return 1;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Main                                   *
+ *---------------------------------------------------------------------*/
+
+static void Usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-q first:last:step] [-n runs] [-s WxH]... "
+          "[-w out.csv] [-b baseline.csv [-x max_percent]] [file]...\n",
+          prog);
+}
+
+int main(int argc, char* argv[]) {
+  static const char kHeader[] =
+      "image,width,height,qp,bytes,bpp,psnr,ssim,encode_ms\n";
+  static RDCurve curves[MAX_IMAGES], baseline[MAX_IMAGES];
+  int sizes[64][2];
+  int num_sizes = 0, num_files = 0, num_curves = 0, num_baseline = 0;
+  int first = 8, last = 56, step = 8, runs = 3;
+  const char* write_path = NULL;
+  const char* baseline_path = NULL;
+  double max_rate = 0.5;
+  FILE* out = NULL;
+  int i, k, failures = 0;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d:%d:%d", &first, &last, &step) != 3) {
+        first = -1;
+      }
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      if (num_sizes < 64 && sscanf(argv[++i], "%dx%d", &sizes[num_sizes][0],
+                                   &sizes[num_sizes][1]) == 2) {
+        ++num_sizes;
+      }
+    } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+      write_path = argv[++i];
+    } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (!strcmp(argv[i], "-x") && i + 1 < argc) {
+      max_rate = atof(argv[++i]);
+    } else if (argv[i][0] == '-') {
+      Usage(argv[0]);
+      return 2;
+    } else {
+      argv[++num_files] = argv[i];   /* keep only the paths */
+    }
+  }
+  if (first < 0 || last > 63 || first > last || step < 1
+      || runs < 1 || runs > 16) {
+    Usage(argv[0]);
+    return 2;
+  }
+  if (!num_sizes) {
+    sizes[0][0] = sizes[0][1] = 512;
+    num_sizes = 1;
+  }
+  if (baseline_path) {
+    num_baseline = ReadBaseline(baseline_path, baseline, MAX_IMAGES);
+    if (num_baseline < 0) return 2;
+  }
+  if (write_path && !(out = fopen(write_path, "w"))) {
+    fprintf(stderr, "%s: %s\n", write_path, strerror(errno));
+    return 2;
+  }
+
+  fputs(kHeader, stdout);
+  if (out) fputs(kHeader, out);
+  for (i = 0; i < num_sizes * NUM_SYNTHETIC + num_files; ++i) {
+    RDImage img;
+    memset(&img, 0, sizeof(img));
+    if (i < num_sizes * NUM_SYNTHETIC) {
+      const int* const size = sizes[i / NUM_SYNTHETIC];
+      if (size[0] <= 0 || size[1] <= 0 || size[0] > 16383 || size[1] > 16383
+          || !MakeSynthetic(&img, i % NUM_SYNTHETIC, size[0], size[1])) {
+        ++failures;
+        continue;
+      }
+    } else {
+      if (!LoadFile(&img, argv[i - num_sizes * NUM_SYNTHETIC + 1])) {
+        ++failures;
+        continue;
+      }
+    }
+    if (num_curves < MAX_IMAGES
+        && MeasureCurve(&img, first, last, step, runs, &curves[num_curves])) {
+      WriteCurve(stdout, &curves[num_curves]);
+      if (out) WriteCurve(out, &curves[num_curves]);
+      ++num_curves;
+    } else {
+      ++failures;
+    }
+    free(img.yuv);
+  }
+  if (out) fclose(out);
+
+  if (baseline_path) {
+    double sum = 0., sum_ssim = 0.;
+    int n = 0, n_ssim = 0;
+    for (i = 0; i < num_curves; ++i) {
+      const RDCurve* base = NULL;
+      double rate, rate_ssim;
+      int ok, ok_ssim;
+      for (k = 0; k < num_baseline; ++k) {
+        if (!strcmp(baseline[k].name, curves[i].name)) base = &baseline[k];
+      }
+      if (!base) {
+        fprintf(stderr, "%-32s not in the baseline\n", curves[i].name);
+        continue;
+      }
+      ok = BDRate(base, &curves[i], 0, &rate);
+      ok_ssim = BDRate(base, &curves[i], 1, &rate_ssim);
+      fprintf(stderr, "%-32s BD-rate PSNR ", curves[i].name);
+      if (ok) {
+        fprintf(stderr, "%+7.2f%%", rate);
+        sum += rate;
+        ++n;
+      } else {
+        fprintf(stderr, "    n/a ");
+      }
+      fprintf(stderr, "  SSIM ");
+      if (ok_ssim) {
+        fprintf(stderr, "%+7.2f%%\n", rate_ssim);
+        sum_ssim += rate_ssim;
+        ++n_ssim;
+      } else {
+        fprintf(stderr, "    n/a\n");
+      }
+    }
+    if (n) {
+      fprintf(stderr, "%-32s BD-rate PSNR %+7.2f%%  SSIM ", "mean", sum / n);
+      if (n_ssim) {
+        fprintf(stderr, "%+7.2f%%\n", sum_ssim / n_ssim);
+      } else {
+        fprintf(stderr, "    n/a\n");
+      }
+      if (sum / n > max_rate) {
+        fprintf(stderr, "compression efficiency regressed by more than "
+                "%.2f%%\n", max_rate);
+        ++failures;
+      }
+    } else {
+      fprintf(stderr, "no image could be compared to the baseline\n");
+      ++failures;
+    }
+  }
+  return failures ? 1 : 0;
+}
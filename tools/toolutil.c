@@ -0,0 +1,70 @@
+/*
+ * Helpers shared by the tools
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "toolutil.h"
+
+double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+unsigned char* ReadFileHead(const char* path, size_t max_size, size_t* size) {
+  FILE* fp = fopen(path, "rb");
+  unsigned char* data = NULL;
+  long len;
+  if (!fp) return NULL;
+  if (!fseek(fp, 0, SEEK_END) && (len = ftell(fp)) > 0
+      && !fseek(fp, 0, SEEK_SET)) {
+    if ((size_t)len > max_size) len = (long)max_size;
+    if ((data = (unsigned char*)malloc(len + 1)) == NULL) {
+      errno = ENOMEM;
+    } else if (fread(data, 1, len, fp) != (size_t)len) {
+      free(data);
+      data = NULL;
+      errno = EIO;
+    } else {
+      data[len] = '\0';   /* lets text headers be sscanf()ed safely */
+      *size = (size_t)len;
+    }
+  } else {
+    errno = EIO;
+  }
+  fclose(fp);
+  return data;
+}
+
+unsigned char* ReadFile(const char* path, size_t* size) {
+  return ReadFileHead(path, (size_t)-1, size);
+}
@@ -0,0 +1,55 @@
+/*
+ * Helpers shared by the tools
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Small helpers used by webpbench, webpconv and rdbench: a monotonic clock
+ * and whole or partial file reads. They only depend on the C library.
+ */
+
+#ifndef WEBP_TOOLS_TOOLUTIL_H_
+#define WEBP_TOOLS_TOOLUTIL_H_
+
+#include <stddef.h>
+
+/* Returns a monotonic timestamp in seconds. */
+double Now(void);
+
+/* Reads a whole file into a malloc()ed buffer and stores its length in
+ * *size. The data is followed by a NUL byte that *size does not count.
+ * Returns NULL, with errno set, on failure or for an empty file.
+ */
+unsigned char* ReadFile(const char* path, size_t* size);
+
+/* Same as ReadFile, but reads at most max_size bytes from the start of the
+ * file, for the headers of an image. *size is less than max_size only when
+ * the whole file was read.
+ */
+unsigned char* ReadFileHead(const char* path, size_t max_size, size_t* size);
+
+#endif  /* WEBP_TOOLS_TOOLUTIL_H_ */
@@ -0,0 +1,397 @@
+/*
+ * Stage-by-stage benchmark of the WebP encode/decode pipeline
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Usage: webpbench [-n iterations] [-q QP] [-t threads] [-s WxH]... [file]...
+ *
+ * Times every stage of the pipeline used by imagewebp() and
+ * imagecreatefromwebp() separately:
+ *
+ *   pack     GD truecolor pixels -> RGBA words
+ *   rgb2yuv  RGBAToYUV420
+ *   encode   WebPEncode (VPXEncode plus the RIFF header)
+ *   psnr     WebPGetPSNR (re-decode and compare)
+ *   decode   WebPDecode (VPXDecode)
+ *   yuv2rgb  YUV420toRGBA
+ *
+ * Inputs are synthetic images of the sizes given with -s (a default set
+ * when none is given) and any binary PPM (P6) or WebP files named on the
+ * command line. One JSON object per image and stage is written to stdout.
+ * Its process_peak_rss_kb is the high-water mark of the whole process so
+ * far, not of the stage: it only grows from one line to the next.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "webpimg.h"
+#include "toolutil.h"
+
+enum {
+  STAGE_PACK = 0,
+  STAGE_RGB2YUV,
+  STAGE_ENCODE,
+  STAGE_PSNR,
+  STAGE_DECODE,
+  STAGE_YUV2RGB,
+  NUM_STAGES
+};
+
+static const char* const kStageNames[NUM_STAGES] = {
+  "pack", "rgb2yuv", "encode", "psnr", "decode", "yuv2rgb"
+};
+
+typedef struct {
+  char name[256];
+  int width;
+  int height;
+  int** tpixels;     /* GD style truecolor rows (0x7fRRGGBB) */
+} BenchImage;
+
+static long PeakMemoryKB(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru)) return -1;
+  return ru.ru_maxrss;
+}
+
+/* Writes s as a JSON string, escaping quotes, backslashes and controls. */
+static void PrintJSONString(const char* s) {
+  putchar('"');
+  for (; *s; ++s) {
+    const unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\') {
+      printf("\\%c", c);
+    } else if (c < 0x20) {
+      printf("\\u%04x", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+static int CompareDouble(const void* a, const void* b) {
+  const double x = *(const double*)a, y = *(const double*)b;
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static double Percentile(const double* sorted, int n, double p) {
+  int idx = (int)(p * (n - 1) + 0.5);
+  if (idx < 0) idx = 0;
+  if (idx >= n) idx = n - 1;
+  return sorted[idx];
+}
+
+static int** AllocRows(int width, int height) {
+  int** rows = (int**)malloc(height * sizeof(*rows));
+  int* data = (int*)malloc((size_t)width * height * sizeof(*data));
+  int y;
+  if (!rows || !data) {
+    free(rows);
+    free(data);
+    return NULL;
+  }
+  for (y = 0; y < height; ++y) {
+    rows[y] = data + (size_t)y * width;
+  }
+  return rows;
+}
+
+static void FreeImage(BenchImage* img) {
+  if (img->tpixels) {
+    free(img->tpixels[0]);
+    free(img->tpixels);
+    img->tpixels = NULL;
+  }
+}
+
+/* Smooth gradients with a little noise: compresses like a photo rather
+ * than like a flat test card.
+ */
+static int MakeSynthetic(BenchImage* img, int width, int height) {
+  unsigned int seed = 0x12345678u;
+  int x, y;
+  img->width = width;
+  img->height = height;
+  snprintf(img->name, sizeof(img->name), "synthetic-%dx%d", width, height);
+  if (!(img->tpixels = AllocRows(width, height))) return 0;
+  for (y = 0; y < height; ++y) {
+    for (x = 0; x < width; ++x) {
+      int r, g, b, n;
+      seed = seed * 1103515245u + 12345u;
+      n = (int)((seed >> 16) & 15) - 8;
+      r = (x * 255) / width + n;
+      g = (y * 255) / height + n;
+      b = ((x + y) * 127) / (width + height) + 64 + n;
+      r = (r < 0) ? 0 : (r > 255) ? 255 : r;
+      g = (g < 0) ? 0 : (g > 255) ? 255 : g;
+      b = (b < 0) ? 0 : (b > 255) ? 255 : b;
+      img->tpixels[y][x] = (r << 16) | (g << 8) | b;
+    }
+  }
+  return 1;
+}
+
+static int LoadPPM(BenchImage* img, const unsigned char* data, size_t size) {
+  int width, height, maxval, offset = 0, x, y;
+  const unsigned char* p;
+  if (sscanf((const char*)data, "P6 %d %d %d%n",
+             &width, &height, &maxval, &offset) != 3
+      || maxval != 255 || width <= 0 || height <= 0) {
+    return 0;
+  }
+  p = data + offset + 1;
+  if ((size_t)(p - data) + (size_t)width * height * 3 > size) return 0;
+  img->width = width;
+  img->height = height;
+  if (!(img->tpixels = AllocRows(width, height))) return 0;
+  for (y = 0; y < height; ++y) {
+    for (x = 0; x < width; ++x) {
+      img->tpixels[y][x] = (p[0] << 16) | (p[1] << 8) | p[2];
+      p += 3;
+    }
+  }
+  return 1;
+}
+
+static int LoadWebP(BenchImage* img, const unsigned char* data, size_t size) {
+  uint8 *Y = NULL, *U = NULL, *V = NULL;
+  uint32* pix;
+  int width, height, x, y;
+  if (WebPDecode(data, (int)size, &Y, &U, &V, &width, &height)
+      != webp_success) {
+    free(Y);
+    return 0;
+  }
+  pix = (uint32*)malloc((size_t)width * height * sizeof(*pix));
+  if (!pix || !(img->tpixels = AllocRows(width, height))) {
+    free(pix);
+    free(Y);
+    return 0;
+  }
+  YUV420toRGBA(Y, U, V, width, width, height, pix);
+  for (y = 0; y < height; ++y) {
+    for (x = 0; x < width; ++x) {
+      img->tpixels[y][x] = (int)(pix[(size_t)y * width + x] >> 8);
+    }
+  }
+  img->width = width;
+  img->height = height;
+  free(pix);
+  free(Y);
+  return 1;
+}
+
+static int LoadFile(BenchImage* img, const char* path) {
+  size_t size = 0;
+  unsigned char* data = ReadFile(path, &size);
+  int ok = 0;
+  if (!data) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  snprintf(img->name, sizeof(img->name), "%s", path);
+  if (size > 2 && data[0] == 'P' && data[1] == '6') {
+    ok = LoadPPM(img, data, size);
+  } else if (size > 12 && !memcmp(data, "RIFF", 4)) {
+    ok = LoadWebP(img, data, size);
+  }
+  if (!ok) fprintf(stderr, "%s: unsupported or broken image\n", path);
+  free(data);
+  return ok;
+}
+
+static int RunImage(const BenchImage* img, int iterations, int QP,
+                    int threads) {
+  const int width = img->width, height = img->height;
+  const int uv_width = (width + 1) >> 1, uv_height = (height + 1) >> 1;
+  const size_t y_size = (size_t)width * height;
+  const size_t uv_size = (size_t)uv_width * uv_height;
+  const double mpix = (double)y_size / 1e6;
+  double* samples[NUM_STAGES];
+  uint32* pix = (uint32*)malloc(y_size * sizeof(*pix));
+  uint8* yuv = (uint8*)malloc(y_size + 2 * uv_size);
+  size_t out_bytes = 0;
+  int i, s, x, y, ok = (pix && yuv);
+
+  for (s = 0; s < NUM_STAGES; ++s) {
+    samples[s] = (double*)malloc(iterations * sizeof(double));
+    if (!samples[s]) ok = 0;
+  }
+
+  for (i = 0; ok && i < iterations; ++i) {
+    uint8 *Y = yuv, *U = yuv + y_size, *V = U + uv_size;
+    uint8 *dY = NULL, *dU = NULL, *dV = NULL;
+    unsigned char* out = NULL;
+    int out_size = 0, dw = 0, dh = 0;
+    uint32* p = pix;
+    double t0, t1;
+
+    t0 = Now();
+    for (y = 0; y < height; ++y) {
+      const int* const row = img->tpixels[y];
+      for (x = 0; x < width; ++x) {
+        *p++ = (uint32)row[x] << 8;
+      }
+    }
+    t1 = Now();
+    samples[STAGE_PACK][i] = t1 - t0;
+
+    RGBAToYUV420Threaded(pix, width, width, height, Y, U, V, threads);
+    t0 = Now();
+    samples[STAGE_RGB2YUV][i] = t0 - t1;
+
+    if (WebPEncode(Y, U, V, width, height, width,
+                   uv_width, uv_height, uv_width,
+                   QP, &out, &out_size, NULL) != webp_success) {
+      fprintf(stderr, "%s: encode failed\n", img->name);
+      ok = 0;
+      break;
+    }
+    t1 = Now();
+    samples[STAGE_ENCODE][i] = t1 - t0;
+    out_bytes = (size_t)out_size;
+
+    WebPGetPSNR(Y, U, V, out, out_size);
+    t0 = Now();
+    samples[STAGE_PSNR][i] = t0 - t1;
+
+    if (WebPDecode(out, out_size, &dY, &dU, &dV, &dw, &dh) != webp_success) {
+      fprintf(stderr, "%s: decode failed\n", img->name);
+      free(dY);
+      free(out);
+      ok = 0;
+      break;
+    }
+    t1 = Now();
+    samples[STAGE_DECODE][i] = t1 - t0;
+
+    YUV420toRGBAThreaded(dY, dU, dV, dw, dw, dh, pix, threads);
+    t0 = Now();
+    samples[STAGE_YUV2RGB][i] = t0 - t1;
+
+    free(dY);
+    free(out);
+  }
+
+  for (s = 0; ok && s < NUM_STAGES; ++s) {
+    double total = 0.;
+    for (i = 0; i < iterations; ++i) total += samples[s][i];
+    qsort(samples[s], iterations, sizeof(double), CompareDouble);
+    printf("{\"image\":");
+    PrintJSONString(img->name);
+    printf(",\"width\":%d,\"height\":%d,\"qp\":%d,"
+           "\"threads\":%d,\"stage\":\"%s\",\"iterations\":%d,"
+           "\"mp_per_s\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+           "\"output_bytes\":%lu,\"process_peak_rss_kb\":%ld}\n",
+           width, height, QP, threads, kStageNames[s],
+           iterations, (total > 0.) ? mpix * iterations / total : 0.,
+           Percentile(samples[s], iterations, 0.50) * 1e3,
+           Percentile(samples[s], iterations, 0.99) * 1e3,
+           (unsigned long)out_bytes, PeakMemoryKB());
+  }
+
+  for (s = 0; s < NUM_STAGES; ++s) free(samples[s]);
+  free(yuv);
+  free(pix);
+  return ok;
+}
+
+static void Usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-n iterations] [-q QP] [-t threads] [-s WxH]... "
+          "[file.ppm|file.webp]...\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+  static const int kDefaultSizes[][2] = {
+    { 320, 240 }, { 1280, 720 }, { 1920, 1080 }, { 4000, 3000 }
+  };
+  int sizes[64][2];
+  int num_sizes = 0, num_files = 0;
+  int iterations = 10, QP = 20, threads = 1;
+  int i, failures = 0;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+      QP = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      if (num_sizes < 64 && sscanf(argv[++i], "%dx%d", &sizes[num_sizes][0],
+                                   &sizes[num_sizes][1]) == 2) {
+        ++num_sizes;
+      }
+    } else if (argv[i][0] == '-') {
+      Usage(argv[0]);
+      return 2;
+    } else {
+      ++num_files;
+    }
+  }
+  if (iterations < 1 || QP < 0 || QP > 63 || threads < 1) {
+    Usage(argv[0]);
+    return 2;
+  }
+  if (!num_sizes && !num_files) {
+    num_sizes = sizeof(kDefaultSizes) / sizeof(kDefaultSizes[0]);
+    memcpy(sizes, kDefaultSizes, sizeof(kDefaultSizes));
+  }
+
+  for (i = 0; i < num_sizes; ++i) {
+    BenchImage img;
+    memset(&img, 0, sizeof(img));
+    if (sizes[i][0] <= 0 || sizes[i][1] <= 0
+        || sizes[i][0] > 16383 || sizes[i][1] > 16383
+        || !MakeSynthetic(&img, sizes[i][0], sizes[i][1])
+        || !RunImage(&img, iterations, QP, threads)) {
+      ++failures;
+    }
+    FreeImage(&img);
+  }
+  for (i = 1; i < argc; ++i) {
+    BenchImage img;
+    if (argv[i][0] == '-') {
+      ++i;
+      continue;
+    }
+    memset(&img, 0, sizeof(img));
+    if (!LoadFile(&img, argv[i]) || !RunImage(&img, iterations, QP, threads)) {
+      ++failures;
+    }
+    FreeImage(&img);
+  }
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,715 @@
+/*
+ * Parallel batch converter from PNG, JPEG and WebP to WebP
+ *
+ * Copyright (c) 2011 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-webp
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2011 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Usage: webpconv [-q QP | -s SSIM] [-t threads] [-m MiB] [-o dir] [-l list]
+ *                 [-f] [-v] [file|dir]...
+ *
+ * Converts PNG, JPEG and WebP files to WebP without PHP in the loop, with
+ * the same kernels as the extension: PNGDecodeYUV420, JPEGDecodeYUV420
+ * (webp_from_jpeg()) or WebPDecodeInto, then WebPEncodeEx, and
+ * WebPPredictQP for -s (webp_encode()'s "target_ssim").
+ *
+ * Directories are walked recursively for *.png, *.jpg, *.jpeg and *.webp
+ * files; -l reads more paths from a file, one per line ("-" for stdin).
+ * Each output replaces the extension of its input, next to it or, with -o,
+ * under dir at the path relative to the directory named on the command line
+ * (just the file name for files named directly). Outputs are written to a
+ * temporary file renamed into place, and inputs whose output is at least as
+ * new are skipped unless -f is given, so an interrupted run can be resumed.
+ *
+ * The walk feeds a pool of worker threads, each with its own queue; idle
+ * workers steal the oldest paths of the others. The walk pauses while
+ * QUEUE_DEPTH paths per worker are waiting, and a worker waits before
+ * reading a file while its frame and its compressed data, added to those
+ * in flight, would exceed the -m budget, so memory stays bounded whatever
+ * the size of the backlog. The dimensions come from the head of the file.
+ * An image larger than the whole budget is converted alone.
+ *
+ * Failures are reported on stderr as they happen, -v reports every file on
+ * stdout, and a throughput summary is printed at the end. The exit status
+ * is 1 if any file failed.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "webpimg.h"
+#include "webpio.h"
+#include "toolutil.h"
+
+#define QUEUE_DEPTH 64        /* waiting paths per worker */
+#define HEAD_SIZE 4096        /* first read for the dimensions of an image */
+#define MAX_DIMENSION 16383   /* largest VP8 frame */
+
+enum {
+  FORMAT_PNG = 0,
+  FORMAT_JPEG,
+  FORMAT_WEBP,
+  NUM_FORMATS
+};
+
+static const char* const kFormatNames[NUM_FORMATS] = {
+  "png", "jpeg", "webp"
+};
+
+typedef struct {
+  char* path;         /* malloc()ed */
+  size_t root_len;    /* length of the directory named on the command line
+                         path was found in, 0 for files named directly */
+} Task;
+
+/* Fixed size ring of tasks: the owner takes the newest one, thieves the
+ * oldest.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  Task tasks[QUEUE_DEPTH];
+  int head;
+  int count;
+} TaskQueue;
+
+typedef struct {
+  unsigned long converted[NUM_FORMATS];
+  unsigned long skipped;
+  unsigned long failed;
+  double in_bytes;
+  double out_bytes;
+  double pixels;
+} Counters;
+
+typedef struct Pool Pool;
+
+typedef struct {
+  Pool* pool;
+  int id;
+  pthread_t thread;
+  TaskQueue queue;
+  Counters counters;  /* only touched by this worker until it is joined */
+} Worker;
+
+struct Pool {
+  Worker* workers;
+  int num_workers;
+  int next_queue;     /* round robin position of the walk */
+  unsigned long walk_failed;
+
+  /* options */
+  int QP;
+  double target_ssim;
+  const char* out_dir;
+  size_t memory_budget;
+  int force;
+  int verbose;
+
+  pthread_mutex_t lock;   /* guards the fields below */
+  pthread_cond_t work;    /* a task was queued, or the walk is over */
+  pthread_cond_t space;   /* a task was taken */
+  pthread_cond_t memory;  /* a frame was released */
+  int queued;             /* tasks queued or being queued */
+  int walk_done;
+  size_t memory_in_flight;
+  int frames_in_flight;
+};
+
+static long PeakMemoryKB(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru)) return -1;
+  return ru.ru_maxrss;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Task queues                            *
+ *---------------------------------------------------------------------*/
+
+static int QueuePush(TaskQueue* queue, const Task* task) {
+  int ok = 0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count < QUEUE_DEPTH) {
+    queue->tasks[(queue->head + queue->count) % QUEUE_DEPTH] = *task;
+    ++queue->count;
+    ok = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return ok;
+}
+
+static int QueuePop(TaskQueue* queue, Task* task, int steal) {
+  int ok = 0;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0) {
+    if (steal) {
+      *task = queue->tasks[queue->head];
+      queue->head = (queue->head + 1) % QUEUE_DEPTH;
+    } else {
+      *task = queue->tasks[(queue->head + queue->count - 1) % QUEUE_DEPTH];
+    }
+    --queue->count;
+    ok = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return ok;
+}
+
+/* Queues path, waiting while every queue is full. Takes ownership of
+ * path. Only called by the walk.
+ */
+static void Submit(Pool* pool, char* path, size_t root_len) {
+  Task task;
+  task.path = path;
+  task.root_len = root_len;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->queued >= pool->num_workers * QUEUE_DEPTH) {
+    pthread_cond_wait(&pool->space, &pool->lock);
+  }
+  ++pool->queued;
+  pthread_mutex_unlock(&pool->lock);
+
+  /* queued counts every task not taken yet, so some queue has room */
+  for (;;) {
+    TaskQueue* const queue = &pool->workers[pool->next_queue].queue;
+    pool->next_queue = (pool->next_queue + 1) % pool->num_workers;
+    if (QueuePush(queue, &task)) break;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static int TryTake(Worker* self, Task* task) {
+  Pool* const pool = self->pool;
+  int i;
+  if (QueuePop(&self->queue, task, 0)) return 1;
+  for (i = 1; i < pool->num_workers; ++i) {
+    Worker* const victim = &pool->workers[(self->id + i) % pool->num_workers];
+    if (QueuePop(&victim->queue, task, 1)) return 1;
+  }
+  return 0;
+}
+
+/* Returns 0 once the walk is over and every task has been taken. */
+static int Take(Worker* self, Task* task) {
+  Pool* const pool = self->pool;
+  while (!TryTake(self, task)) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queued == 0) {
+      if (pool->walk_done) {
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+      }
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  pthread_mutex_lock(&pool->lock);
+  --pool->queued;
+  pthread_cond_signal(&pool->space);
+  pthread_mutex_unlock(&pool->lock);
+  return 1;
+}
+
+static void AcquireMemory(Pool* pool, size_t size) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->frames_in_flight > 0
+         && pool->memory_in_flight + size > pool->memory_budget) {
+    pthread_cond_wait(&pool->memory, &pool->lock);
+  }
+  pool->memory_in_flight += size;
+  ++pool->frames_in_flight;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void ReleaseMemory(Pool* pool, size_t size) {
+  pthread_mutex_lock(&pool->lock);
+  pool->memory_in_flight -= size;
+  --pool->frames_in_flight;
+  pthread_cond_broadcast(&pool->memory);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*---------------------------------------------------------------------*
+ *                              Files                                  *
+ *---------------------------------------------------------------------*/
+
+/* Writes data to a temporary file next to path and renames it to path,
+ * creating the missing directories of path first.
+ */
+static int WriteFile(const char* path, const unsigned char* data, size_t size,
+                     int id) {
+  char* const tmp = (char*)malloc(strlen(path) + 32);
+  char* p;
+  FILE* fp;
+  int ok = 0;
+  if (!tmp) return 0;
+  strcpy(tmp, path);
+  for (p = strchr(tmp + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(tmp, 0777);   /* fopen() reports what really fails */
+    *p = '/';
+  }
+  sprintf(tmp + strlen(path), ".%d.tmp", id);
+  if ((fp = fopen(tmp, "wb")) != NULL) {
+    ok = (fwrite(data, 1, size, fp) == size);
+    ok = !fclose(fp) && ok;
+    ok = ok && !rename(tmp, path);
+    if (!ok) unlink(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+static int HasImageExtension(const char* name) {
+  static const char* const kExtensions[] = {
+    ".png", ".jpg", ".jpeg", ".webp"
+  };
+  const char* const dot = strrchr(name, '.');
+  size_t i;
+  if (!dot) return 0;
+  for (i = 0; i < sizeof(kExtensions) / sizeof(kExtensions[0]); ++i) {
+    if (!strcasecmp(dot, kExtensions[i])) return 1;
+  }
+  return 0;
+}
+
+/* Returns the malloc()ed output path of task. */
+static char* OutputPath(const Pool* pool, const Task* task) {
+  const char* rel = task->path;
+  const char* base;
+  const char* dot;
+  char* out;
+  size_t len;
+
+  if (pool->out_dir) {
+    if (task->root_len) {
+      rel += task->root_len;
+    } else if ((base = strrchr(rel, '/')) != NULL) {
+      rel = base + 1;
+    }
+    while (*rel == '/') ++rel;
+  }
+  base = strrchr(rel, '/');
+  dot = strrchr(base ? base : rel, '.');
+  len = dot ? (size_t)(dot - rel) : strlen(rel);
+
+  out = (char*)malloc((pool->out_dir ? strlen(pool->out_dir) + 1 : 0)
+                      + len + sizeof(".webp"));
+  if (!out) return NULL;
+  out[0] = '\0';
+  if (pool->out_dir) {
+    strcat(strcpy(out, pool->out_dir), "/");
+  }
+  strncat(out, rel, len);
+  strcat(out, ".webp");
+  return out;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Conversion                             *
+ *---------------------------------------------------------------------*/
+
+static int DetectFormat(const unsigned char* data, size_t size) {
+  if (size > 8 && !memcmp(data, "\x89PNG\r\n\x1a\n", 8)) {
+    return FORMAT_PNG;
+  } else if (size > 3 && data[0] == 0xFF && data[1] == 0xD8) {
+    return FORMAT_JPEG;
+  } else if (size > 12 && !memcmp(data, "RIFF", 4)
+             && !memcmp(data + 8, "WEBP", 4)) {
+    return FORMAT_WEBP;
+  }
+  return -1;
+}
+
+static void Fail(Worker* self, const char* path, const char* reason) {
+  fprintf(stderr, "%s: %s\n", path, reason);
+  ++self->counters.failed;
+}
+
+static void Convert(Worker* self, const Task* task) {
+  Pool* const pool = self->pool;
+  const char* const path = task->path;
+  char* const out_path = OutputPath(pool, task);
+  struct stat in_stat, out_stat;
+  unsigned char* data = NULL;
+  unsigned char* out = NULL;
+  uint8* yuv = NULL;
+  uint8 *Y, *U, *V;
+  size_t size = 0, head_size, frame_size, reserved;
+  int format, width = 0, height = 0, uv_width, uv_height, out_size = 0;
+  WebPEncodeConfig config;
+  WebPResult result;
+  double start = Now();
+
+  if (!out_path) {
+    Fail(self, path, strerror(ENOMEM));
+    return;
+  }
+  if (stat(path, &in_stat)) {
+    Fail(self, path, strerror(errno));
+    free(out_path);
+    return;
+  }
+  if (!pool->force && !stat(out_path, &out_stat)
+      && ((in_stat.st_dev == out_stat.st_dev
+           && in_stat.st_ino == out_stat.st_ino)
+          || out_stat.st_mtime >= in_stat.st_mtime)) {
+    ++self->counters.skipped;
+    free(out_path);
+    return;
+  }
+
+  /* find the dimensions from the head of the file, growing it for JPEG
+   * files with large markers, so that the frame and the whole file can be
+   * reserved together before the file is read */
+  for (head_size = HEAD_SIZE; ; head_size *= 16) {
+    if (!(data = ReadFileHead(path, head_size, &size))) {
+      Fail(self, path, strerror(errno));
+      free(out_path);
+      return;
+    }
+    format = DetectFormat(data, size);
+    if (format == FORMAT_PNG) {
+      result = PNGGetInfo(data, (int)size, &width, &height);
+    } else if (format == FORMAT_JPEG) {
+      result = JPEGGetInfo(data, (int)size, &width, &height);
+    } else if (format == FORMAT_WEBP) {
+      result = WebPGetInfo(data, (int)size, &width, &height);
+    } else {
+      result = webp_failure;
+    }
+    free(data);
+    data = NULL;
+    if (result == webp_success || format < 0 || size < head_size
+        || head_size > 0x7fffffff) {
+      break;
+    }
+  }
+  if (in_stat.st_size > 0x7fffffff || result != webp_success
+      || width <= 0 || height <= 0) {
+    Fail(self, path, "unsupported or broken image");
+    free(out_path);
+    return;
+  }
+  if (width > MAX_DIMENSION || height > MAX_DIMENSION) {
+    Fail(self, path, "image too large for WebP");
+    free(out_path);
+    return;
+  }
+
+  /* the planes, as much again for the encoder and its output, and the file */
+  uv_width = (width + 1) >> 1;
+  uv_height = (height + 1) >> 1;
+  frame_size = (size_t)width * height + 2 * (size_t)uv_width * uv_height;
+  reserved = 2 * frame_size + (size_t)in_stat.st_size;
+  AcquireMemory(pool, reserved);
+
+  if (!(data = ReadFile(path, &size)) || size > 0x7fffffff) {
+    Fail(self, path, data ? "unsupported or broken image" : strerror(errno));
+    free(data);
+    ReleaseMemory(pool, reserved);
+    free(out_path);
+    return;
+  }
+  yuv = (uint8*)malloc(frame_size);
+  Y = yuv;
+  U = Y + (size_t)width * height;
+  V = U + (size_t)uv_width * uv_height;
+  result = webp_failure;
+  if (yuv != NULL) {
+    if (format == FORMAT_PNG) {
+      result = PNGDecodeYUV420(data, (int)size, Y, U, V, width, height);
+    } else if (format == FORMAT_JPEG) {
+      result = JPEGDecodeYUV420(data, (int)size, Y, U, V, width, height);
+    } else {
+      result = WebPDecodeInto(data, (int)size, Y, U, V, width, uv_width,
+                              width, height);
+    }
+  }
+  free(data);
+  if (result != webp_success) {
+    Fail(self, path, yuv ? "decoding failed" : strerror(ENOMEM));
+  } else {
+    WebPEncodeConfigInit(&config, pool->QP);
+    if (pool->target_ssim > 0.) {
+      const int QP = WebPPredictQP(Y, U, V, width, height, width, uv_width,
+                                   pool->target_ssim, &config);
+      if (QP >= 0) config.QP = QP;
+    }
+    result = WebPEncodeEx(Y, U, V, width, height, width,
+                          uv_width, uv_height, uv_width,
+                          &config, &out, &out_size, NULL);
+    if (result != webp_success) {
+      Fail(self, path, "encoding failed");
+    } else if (!WriteFile(out_path, out, (size_t)out_size, self->id)) {
+      Fail(self, out_path, strerror(errno));
+    } else {
+      ++self->counters.converted[format];
+      self->counters.in_bytes += (double)size;
+      self->counters.out_bytes += (double)out_size;
+      self->counters.pixels += (double)width * height;
+      if (pool->verbose) {
+        printf("%s -> %s: %dx%d, QP %d, %lu -> %d bytes, %.1f ms\n",
+               path, out_path, width, height, config.QP,
+               (unsigned long)size, out_size, (Now() - start) * 1e3);
+      }
+    }
+    if (out) config.release(config.opaque, out);
+  }
+  free(yuv);
+  ReleaseMemory(pool, reserved);
+  free(out_path);
+}
+
+static void* WorkerMain(void* arg) {
+  Worker* const self = (Worker*)arg;
+  Task task;
+  while (Take(self, &task)) {
+    Convert(self, &task);
+    free(task.path);
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Walk                                   *
+ *---------------------------------------------------------------------*/
+
+static void Walk(Pool* pool, const char* dir, size_t root_len) {
+  DIR* const dp = opendir(dir);
+  struct dirent* entry;
+  if (!dp) {
+    fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+    ++pool->walk_failed;
+    return;
+  }
+  while ((entry = readdir(dp)) != NULL) {
+    const char* const name = entry->d_name;
+    struct stat st;
+    char* path;
+    if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+    path = (char*)malloc(strlen(dir) + strlen(name) + 2);
+    if (!path) {
+      fprintf(stderr, "%s/%s: %s\n", dir, name, strerror(ENOMEM));
+      ++pool->walk_failed;
+      continue;
+    }
+    sprintf(path, "%s/%s", dir, name);
+    /* symbolic links to directories are not followed, to files they are */
+    if (!lstat(path, &st) && S_ISDIR(st.st_mode)) {
+      Walk(pool, path, root_len);
+      free(path);
+    } else if (HasImageExtension(name)) {
+      Submit(pool, path, root_len);
+    } else {
+      free(path);
+    }
+  }
+  closedir(dp);
+}
+
+static void AddPath(Pool* pool, const char* path) {
+  struct stat st;
+  size_t len = strlen(path);
+  char* copy;
+  if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
+    while (len > 1 && path[len - 1] == '/') --len;
+    if (!(copy = (char*)malloc(len + 1))) return;
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    Walk(pool, copy, len);
+    free(copy);
+  } else if ((copy = strdup(path)) != NULL) {
+    Submit(pool, copy, 0);
+  }
+}
+
+static int AddList(Pool* pool, const char* list) {
+  FILE* const fp = strcmp(list, "-") ? fopen(list, "r") : stdin;
+  char* line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  if (!fp) {
+    fprintf(stderr, "%s: %s\n", list, strerror(errno));
+    return 0;
+  }
+  while ((len = getline(&line, &capacity, fp)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len > 0) AddPath(pool, line);
+  }
+  free(line);
+  if (fp != stdin) fclose(fp);
+  return 1;
+}
+
+/*---------------------------------------------------------------------*
+ *                              Main                                   *
+ *---------------------------------------------------------------------*/
+
+static void Usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-q QP | -s SSIM] [-t threads] [-m MiB] [-o dir] "
+          "[-l list] [-f] [-v] [file|dir]...\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+  Pool pool;
+  Counters total;
+  const char* list = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long memory_mb = 1024;
+  unsigned long converted = 0;
+  double start, elapsed;
+  int i, f, num_paths = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.QP = 20;
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+      pool.QP = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      pool.target_ssim = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      threads = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+      memory_mb = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      pool.out_dir = argv[++i];
+    } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+      list = argv[++i];
+    } else if (!strcmp(argv[i], "-f")) {
+      pool.force = 1;
+    } else if (!strcmp(argv[i], "-v")) {
+      pool.verbose = 1;
+    } else if (argv[i][0] == '-') {
+      Usage(argv[0]);
+      return 2;
+    } else {
+      argv[++num_paths] = argv[i];   /* keep only the paths */
+    }
+  }
+  if (threads < 1) threads = 1;
+  if (pool.QP < 0 || pool.QP > 63 || pool.target_ssim < 0.
+      || pool.target_ssim > 1. || memory_mb < 1
+      || (!num_paths && !list)) {
+    Usage(argv[0]);
+    return 2;
+  }
+  pool.memory_budget = (size_t)memory_mb << 20;
+  pool.num_workers = (int)threads;
+
+  pool.workers = (Worker*)calloc(pool.num_workers, sizeof(Worker));
+  if (!pool.workers) {
+    fprintf(stderr, "%s\n", strerror(ENOMEM));
+    return 1;
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.space, NULL);
+  pthread_cond_init(&pool.memory, NULL);
+  for (i = 0; i < pool.num_workers; ++i) {
+    Worker* const w = &pool.workers[i];
+    w->pool = &pool;
+    w->id = i;
+    pthread_mutex_init(&w->queue.lock, NULL);
+  }
+  start = Now();
+  /* every queue must exist before the first worker tries to steal */
+  for (i = 0; i < pool.num_workers; ++i) {
+    Worker* const w = &pool.workers[i];
+    if (pthread_create(&w->thread, NULL, WorkerMain, w)) {
+      fprintf(stderr, "cannot start worker %d\n", i);
+      return 1;
+    }
+  }
+
+  for (i = 1; i <= num_paths; ++i) {
+    AddPath(&pool, argv[i]);
+  }
+  if (list && !AddList(&pool, list)) {
+    ++pool.walk_failed;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.walk_done = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (i = 0; i < pool.num_workers; ++i) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+  memset(&total, 0, sizeof(total));
+  total.failed = pool.walk_failed;
+  for (i = 0; i < pool.num_workers; ++i) {
+    const Counters* const c = &pool.workers[i].counters;
+    for (f = 0; f < NUM_FORMATS; ++f) {
+      total.converted[f] += c->converted[f];
+    }
+    total.skipped += c->skipped;
+    total.failed += c->failed;
+    total.in_bytes += c->in_bytes;
+    total.out_bytes += c->out_bytes;
+    total.pixels += c->pixels;
+    pthread_mutex_destroy(&pool.workers[i].queue.lock);
+  }
+  elapsed = Now() - start;
+
+  for (f = 0; f < NUM_FORMATS; ++f) converted += total.converted[f];
+  printf("files:  %lu converted (", converted);
+  for (f = 0; f < NUM_FORMATS; ++f) {
+    printf("%s%s %lu", f ? ", " : "", kFormatNames[f], total.converted[f]);
+  }
+  printf("), %lu skipped, %lu failed\n", total.skipped, total.failed);
+  printf("bytes:  %.0f in, %.0f out (%.1f%%)\n",
+         total.in_bytes, total.out_bytes,
+         (total.in_bytes > 0.) ? 100. * total.out_bytes / total.in_bytes : 0.);
+  printf("time:   %.2f s with %d threads, %.1f files/s, %.2f MP/s, "
+         "peak RSS %ld kB\n",
+         elapsed, pool.num_workers,
+         (elapsed > 0.) ? converted / elapsed : 0.,
+         (elapsed > 0.) ? total.pixels / 1e6 / elapsed : 0.,
+         PeakMemoryKB());
+
+  pthread_cond_destroy(&pool.memory);
+  pthread_cond_destroy(&pool.space);
+  pthread_cond_destroy(&pool.work);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.workers);
+  return total.failed ? 1 : 0;
+}
@@ -29,23 +29,203 @@
 
 #include "php_webp.h"
 #include "libwebp/src/webpimg.h"
+#include <ext/standard/base64.h>
+#if defined(HAVE_WEBP_JPEG) || defined(HAVE_WEBP_PNG)
+#include "libwebp/src/webpio.h"
+#endif
+#ifdef HAVE_WEBP_JPEG
+#include <ext/standard/php_smart_str.h>
+#endif
+#include <time.h>
+#ifndef CLOCK_MONOTONIC
+#include <sys/time.h>
+#endif
+#ifdef HAVE_WEBP_STATUS
+#include <sys/mman.h>
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+#endif
 
 #define MAX_IMAGE_SIDE_LENGTH 16383
 #define DEFAULT_QP 20
+#define DEFAULT_JPEG_QUALITY 75
+#define DEFAULT_PLACEHOLDER_QUALITY 10
+#define DEFAULT_TARGET_SSIM 0.95
+#define DATA_URI_PREFIX "data:image/webp;base64,"
 #define MAX_QP 63
 #define MIN_QP 0
 #define CALC_QUALITY(qp) (long)(100.0 * (float)(MAX_QP - (qp)) / (float)MAX_QP)
 #define CALC_QP(quality) (int)((float)MAX_QP * (1.0 - (float)(quality) / 100.0))
 
+/* RIFF header and VP8 frame header, enough for WebPGetInfo() */
+#define WEBP_HEADER_SIZE 30
+
+/*
+ * libvpx allocates its frames with malloc(), out of sight of the memory
+ * manager. Estimate them as frames of 4:2:0 samples with 32 pixel borders
+ * so that they can at least be checked against memory_limit.
+ */
+#define DECODER_FRAMES 4
+#define ENCODER_FRAMES 8
+#define CODEC_FOOTPRINT(width, height, frames) \
+	((size_t)(frames) * (size_t)((width) + 64) * (size_t)((height) + 64) * 3 / 2)
+
+/* quality metrics computed by pwp_measure() */
+#define PWP_METRIC_PSNR 1
+#define PWP_METRIC_SSIM 2
+#define PWP_METRIC_SSIM_CHROMA 4
+
+/* RIFF container layout */
+#define RIFF_HEADER_SIZE 12
+#define CHUNK_HEADER_SIZE 8
+#define MAX_CHUNKS 256
+#define MAX_METADATA_SIZE 0x100000
+#define METADATA_TAGS 4
+
+/* lock-free access to the status segment */
+#ifdef HAVE_WEBP_STATUS
+#define PWP_ATOMIC_ADD(var, n) __sync_fetch_and_add(&(var), (long)(n))
+#define PWP_ATOMIC_LOAD(var) __sync_fetch_and_add(&(var), 0L)
+#endif
+
 /* {{{ globals */
 
 static long default_quality = -1;
 static int le_gd = -1;
+static zend_class_entry *pwp_image_ce = NULL;
+static zend_object_handlers pwp_image_handlers;
+#ifdef HAVE_WEBP_STATUS
+static php_webp_status *pwp_status = NULL;
+#endif
 #ifdef GD_API_IS_HIDDEN
 static int le_fake = -1;
+#endif
 static ZEND_DECLARE_MODULE_GLOBALS(webp);
+
+/* }}} */
+/* {{{ ini entries */
+
+PHP_INI_BEGIN()
+	STD_PHP_INI_ENTRY("webp.max_pixels", "0",
+		PHP_INI_ALL, OnUpdateLong, max_pixels,
+		zend_webp_globals, webp_globals)
+	STD_PHP_INI_ENTRY("webp.conversion_threads", "4",
+		PHP_INI_ALL, OnUpdateLong, conversion_threads,
+		zend_webp_globals, webp_globals)
+	STD_PHP_INI_ENTRY("webp.conversion_threshold", "8388608",
+		PHP_INI_ALL, OnUpdateLong, conversion_threshold,
+		zend_webp_globals, webp_globals)
+	STD_PHP_INI_BOOLEAN("webp.stats", "1",
+		PHP_INI_ALL, OnUpdateBool, stats_enabled,
+		zend_webp_globals, webp_globals)
+#ifdef HAVE_WEBP_STATUS
+	STD_PHP_INI_BOOLEAN("webp.status", "1",
+		PHP_INI_SYSTEM, OnUpdateBool, status_enabled,
+		zend_webp_globals, webp_globals)
+#endif
+	STD_PHP_INI_ENTRY("webp.scratch_limit", "67108864",
+		PHP_INI_ALL, OnUpdateLong, scratch_limit,
+		zend_webp_globals, webp_globals)
+	STD_PHP_INI_ENTRY("webp.scratch_idle_requests", "1000",
+		PHP_INI_ALL, OnUpdateLong, scratch_idle_requests,
+		zend_webp_globals, webp_globals)
+	STD_PHP_INI_ENTRY("webp.encode_deadline_ms", "0",
+		PHP_INI_ALL, OnUpdateLong, encode_deadline_ms,
+		zend_webp_globals, webp_globals)
+PHP_INI_END()
+
+/* }}} */
+/* {{{ statistics labels */
+
+static const char *pwp_stage_names[PHP_WEBP_NUM_STAGES] = {
+	"io", "pack", "convert", "codec", "psnr"
+};
+
+static const char *pwp_op_names[PHP_WEBP_NUM_OPS] = {
+	"encode", "decode"
+};
+
+/* }}} */
+/* {{{ RIFF chunks */
+
+/* metadata chunks, the same as the WebP class of examples/RIFF.php */
+static const char *pwp_metadata_tags[METADATA_TAGS] = {
+	"ICMT", "ICOP", "IART", "INAM"
+};
+
+typedef struct {
+	char id[4];
+	size_t offset;
+	size_t size;
+	int tag;
+} pwp_chunk;
+
+#define CHUNK_SPAN(chunk) (CHUNK_HEADER_SIZE + (chunk)->size + ((chunk)->size & 1))
+
+#define pwp_get_le32(p) \
+	((uint32)((const unsigned char *)(p))[0] \
+	| ((uint32)((const unsigned char *)(p))[1] << 8) \
+	| ((uint32)((const unsigned char *)(p))[2] << 16) \
+	| ((uint32)((const unsigned char *)(p))[3] << 24))
+
+#define pwp_put_le32(p, v) do { \
+	unsigned char *_p = (unsigned char *)(p); \
+	uint32 _v = (uint32)(v); \
+	_p[0] = _v & 0xff; \
+	_p[1] = (_v >> 8) & 0xff; \
+	_p[2] = (_v >> 16) & 0xff; \
+	_p[3] = (_v >> 24) & 0xff; \
+} while (0)
+
+/* }}} */
+/* {{{ stream output */
+
+#define PWP_ENCODE_FILTER "webp.encode"
+
+/* destination of pwp_stream_writer(): a stream, or the output brigade
+ * of a webp.encode filter */
+typedef struct {
+	php_stream *stream;
+	php_stream_bucket_brigade *brigade;
+	int failed;
+#ifdef ZTS
+	void ***tsrm_ls;
+#endif
+} pwp_writer;
+
+#ifdef HAVE_WEBP_PNG
+/* source of pwp_png_reader(): the bytes read ahead for PNGGetInfo,
+ * then the rest of the stream */
+typedef struct {
+	php_stream *stream;
+	const uint8 *head;
+	size_t head_size;
+	size_t head_pos;
+	size_t bytes_in;
+#ifdef ZTS
+	void ***tsrm_ls;
+#endif
+} pwp_png_source;
 #endif
 
+/* state of a webp.encode filter: the pixels are converted to YUV two
+ * rows at a time as they arrive, and encoded when the stream closes */
+typedef struct {
+	int width;
+	int height;
+	int channels;
+	int qp;
+	int rows;       /* rows converted so far */
+	size_t fill;    /* bytes of the current pair of rows received */
+	size_t extra;   /* bytes received past the end of the image */
+	int done;
+	int persistent;
+	uint8 *yuv;     /* Y, U and V planes */
+	uint8 *raw;     /* the current pair of rows, as received */
+	uint32 *pixels; /* the same rows, packed for RGBAToYUV420() */
+} pwp_encode_filter;
+
 /* }}} */
 /* {{{ internal function prototypes */
 
@@ -57,21 +237,246 @@ _pwp_stream_open(const char *filename, const char *mode,
 #define pwp_url_open(filename, mode, opened_path) \
 	_pwp_stream_open(filename, mode, 0, opened_path TSRMLS_CC)
 
+static int
+pwp_quality_to_qp(long quality);
+
+static void
+_pwp_encode_config(WebPEncodeConfig *config, int qp TSRMLS_DC);
+#define pwp_encode_config(config, qp) _pwp_encode_config(config, qp TSRMLS_CC)
+
+static int
+_pwp_encode_deadline(WebPEncodeConfig *config, int width, int height,
+                     long deadline_ms TSRMLS_DC);
+#define pwp_encode_deadline(config, width, height, deadline_ms) \
+	_pwp_encode_deadline(config, width, height, deadline_ms TSRMLS_CC)
+
+static int
+_pwp_check_size(int width, int height TSRMLS_DC);
+#define pwp_check_size(width, height) _pwp_check_size(width, height TSRMLS_CC)
+
+static int
+_pwp_memory_check(size_t size TSRMLS_DC);
+#define pwp_memory_check(size) _pwp_memory_check(size TSRMLS_CC)
+
+static int
+_pwp_measure(const uint8 *y_ptr, const uint8 *u_ptr, const uint8 *v_ptr,
+             int width, int height, const unsigned char *out, int out_size_bytes,
+             int metrics TSRMLS_DC);
+#define pwp_measure(y_ptr, u_ptr, v_ptr, width, height, out, out_size_bytes, metrics) \
+	_pwp_measure(y_ptr, u_ptr, v_ptr, width, height, out, out_size_bytes, metrics TSRMLS_CC)
+
+static int
+_pwp_option_long(zval *options, const char *name, long *value TSRMLS_DC);
+#define pwp_option_long(options, name, value) \
+	_pwp_option_long(options, name, value TSRMLS_CC)
+
+static int
+_pwp_option_double(zval *options, const char *name, double *value TSRMLS_DC);
+#define pwp_option_double(options, name, value) \
+	_pwp_option_double(options, name, value TSRMLS_CC)
+
+static int
+_pwp_image_to_yuv(gdImagePtr im, uint8 *y_ptr, uint8 *u_ptr, uint8 *v_ptr TSRMLS_DC);
+#define pwp_image_to_yuv(im, y_ptr, u_ptr, v_ptr) \
+	_pwp_image_to_yuv(im, y_ptr, u_ptr, v_ptr TSRMLS_CC)
+
+static int
+_pwp_riff_scan(php_stream *stream, pwp_chunk *chunks, int *num_chunks TSRMLS_DC);
+#define pwp_riff_scan(stream, chunks, num_chunks) \
+	_pwp_riff_scan(stream, chunks, num_chunks TSRMLS_CC)
+
+static char *
+_pwp_riff_read(php_stream *stream, const pwp_chunk *chunk TSRMLS_DC);
+#define pwp_riff_read(stream, chunk) _pwp_riff_read(stream, chunk TSRMLS_CC)
+
+static int
+_pwp_riff_copy(php_stream *src, php_stream *dst, const pwp_chunk *chunk TSRMLS_DC);
+#define pwp_riff_copy(src, dst, chunk) _pwp_riff_copy(src, dst, chunk TSRMLS_CC)
+
+static size_t
+pwp_riff_write(php_stream *stream, const char *id, const char *data, size_t size);
+
+static int
+_pwp_same_file(const char *path1, const char *path2 TSRMLS_DC);
+#define pwp_same_file(path1, path2) _pwp_same_file(path1, path2 TSRMLS_CC)
+
+static int
+_pwp_conversion_threads(int width, int height TSRMLS_DC);
+#define pwp_conversion_threads(width, height) \
+	_pwp_conversion_threads(width, height TSRMLS_CC)
+
+static double
+pwp_stats_now(void);
+
+static void
+_pwp_stats_begin(int op TSRMLS_DC);
+#define pwp_stats_begin(op) _pwp_stats_begin(op TSRMLS_CC)
+
+static void
+_pwp_stats_lap(int stage TSRMLS_DC);
+#define pwp_stats_lap(stage) _pwp_stats_lap(stage TSRMLS_CC)
+
+static void
+_pwp_stats_end(int success TSRMLS_DC);
+#define pwp_stats_end(success) _pwp_stats_end(success TSRMLS_CC)
+
+static void
+_pwp_stats_quantizer(const char *data, size_t data_size TSRMLS_DC);
+#define pwp_stats_quantizer(data, data_size) \
+	_pwp_stats_quantizer(data, data_size TSRMLS_CC)
+
+#define PWP_STATS(v) WEBPG(last_stats).v
+
+#ifdef HAVE_WEBP_STATUS
+static void
+pwp_status_add(const php_webp_stats *stats, int success);
+
+static void
+pwp_status_op(zval *zv, php_webp_status_op *op);
+#endif
+
+static void *
+_pwp_scratch_get(int slot, size_t size TSRMLS_DC);
+#define pwp_scratch_get(slot, size) _pwp_scratch_get(slot, size TSRMLS_CC)
+
+static void
+_pwp_scratch_put(int slot, void *ptr TSRMLS_DC);
+#define pwp_scratch_put(slot, ptr) _pwp_scratch_put(slot, ptr TSRMLS_CC)
+
+static void
+_pwp_scratch_trim(TSRMLS_D);
+#define pwp_scratch_trim() _pwp_scratch_trim(TSRMLS_C)
+
+static void
+pwp_scratch_free(php_webp_scratch *scratch, size_t *total);
+
+static void *
+pwp_output_alloc(void *opaque, size_t size);
+
+static void
+pwp_output_release(void *opaque, void *ptr);
+
+#ifdef HAVE_WEBP_JPEG
+static int
+pwp_smart_str_writer(void *opaque, const uint8 *data, size_t size);
+#endif
+
+#ifdef HAVE_WEBP_PNG
+static size_t
+pwp_png_reader(void *opaque, uint8 *data, size_t size);
+#endif
+
+static void
+_pwp_writer_init(pwp_writer *writer, php_stream *stream,
+                 php_stream_bucket_brigade *brigade TSRMLS_DC);
+#define pwp_writer_init(writer, stream, brigade) \
+	_pwp_writer_init(writer, stream, brigade TSRMLS_CC)
+
+static int
+pwp_stream_writer(void *opaque, const uint8 *data, size_t size);
+
+static php_stream_filter *
+pwp_encode_filter_create(const char *filtername, zval *filterparams,
+                         int persistent TSRMLS_DC);
+
+static php_stream_filter_status_t
+pwp_encode_filter_func(php_stream *stream, php_stream_filter *thisfilter,
+                       php_stream_bucket_brigade *buckets_in,
+                       php_stream_bucket_brigade *buckets_out,
+                       size_t *bytes_consumed, int flags TSRMLS_DC);
+
+static void
+pwp_encode_filter_dtor(php_stream_filter *thisfilter TSRMLS_DC);
+
+static void
+pwp_encode_filter_feed(pwp_encode_filter *data, const char *buf, size_t len);
+
+static int
+_pwp_encode_filter_flush(php_stream *stream, pwp_encode_filter *data,
+                         php_stream_bucket_brigade *buckets_out TSRMLS_DC);
+#define pwp_encode_filter_flush(stream, data, buckets_out) \
+	_pwp_encode_filter_flush(stream, data, buckets_out TSRMLS_CC)
+
+static int
+_pwp_palette_options(zval *options, int *colors, int *method TSRMLS_DC);
+#define pwp_palette_options(options, colors, method) \
+	_pwp_palette_options(options, colors, method TSRMLS_CC)
+
+static gdImagePtr
+_pwp_yuv_to_image(uint8 *y_ptr, uint8 *u_ptr, uint8 *v_ptr,
+                  int width, int height, int colors, int method TSRMLS_DC);
+#define pwp_yuv_to_image(y_ptr, u_ptr, v_ptr, width, height, colors, method) \
+	_pwp_yuv_to_image(y_ptr, u_ptr, v_ptr, width, height, colors, method TSRMLS_CC)
+
+static int
+_pwp_metadata_read(php_stream *stream, zval *metadata TSRMLS_DC);
+#define pwp_metadata_read(stream, metadata) \
+	_pwp_metadata_read(stream, metadata TSRMLS_CC)
+
+static zend_object_value
+pwp_image_new(zend_class_entry *ce TSRMLS_DC);
+
+static void
+pwp_image_free(void *object TSRMLS_DC);
+
+static int
+pwp_image_attach(php_webp_image *intern, char *data, int data_size);
+
+static php_webp_image *
+_pwp_image_fetch(zval *object TSRMLS_DC);
+#define pwp_image_fetch(object) _pwp_image_fetch(object TSRMLS_CC)
+
+static int
+_pwp_image_decode(php_webp_image *intern TSRMLS_DC);
+#define pwp_image_decode(intern) _pwp_image_decode(intern TSRMLS_CC)
+
 #ifdef GD_API_IS_HIDDEN
+static int
+_pwp_gd_function_init(const char *name, zval **name_ptr,
+                      zend_fcall_info *fci, zend_fcall_info_cache *fcc TSRMLS_DC);
+#define pwp_gd_function_init(name, name_ptr, fci, fcc) \
+	_pwp_gd_function_init(name, name_ptr, fci, fcc TSRMLS_CC)
+
+static gdImagePtr
+_pwp_gd_create(zend_fcall_info *fci, zend_fcall_info_cache *fcc,
+               int sx, int sy TSRMLS_DC);
+
 static gdImagePtr
 _pwp_gdImageCreateTrueColor(int sx, int sy);
 #undef gdImageCreateTrueColor
 #define gdImageCreateTrueColor(sx, sy) _pwp_gdImageCreateTrueColor(sx, sy)
+
+static gdImagePtr
+_pwp_gdImageCreate(int sx, int sy);
+#undef gdImageCreate
+#define gdImageCreate(sx, sy) _pwp_gdImageCreate(sx, sy)
+
+static void
+_pwp_gdImageDestroy(gdImagePtr im);
+#undef gdImageDestroy
+#define gdImageDestroy(im) _pwp_gdImageDestroy(im)
 #endif
 
+/* }}} */
+/* {{{ stream filter */
+
+static php_stream_filter_ops pwp_encode_filter_ops = {
+	pwp_encode_filter_func,
+	pwp_encode_filter_dtor,
+	PWP_ENCODE_FILTER
+};
+
+static php_stream_filter_factory pwp_encode_filter_factory = {
+	pwp_encode_filter_create
+};
+
 /* }}} */
 /* {{{ module function prototypes */
 
 static PHP_MINIT_FUNCTION(webp);
-#ifdef GD_API_IS_HIDDEN
+static PHP_MSHUTDOWN_FUNCTION(webp);
 static PHP_RINIT_FUNCTION(webp);
 static PHP_RSHUTDOWN_FUNCTION(webp);
-#endif
 static PHP_MINFO_FUNCTION(webp);
 
 /* }}} */
@@ -79,6 +484,34 @@ static PHP_MINFO_FUNCTION(webp);
 
 static PHP_FUNCTION(imagecreatefromwebp);
 static PHP_FUNCTION(imagewebp);
+static PHP_FUNCTION(webp_encode);
+static PHP_FUNCTION(webp_last_stats);
+#ifdef HAVE_WEBP_STATUS
+static PHP_FUNCTION(webp_get_status);
+#endif
+static PHP_FUNCTION(webp_get_metadata);
+static PHP_FUNCTION(webp_set_metadata);
+static PHP_FUNCTION(webp_recompress);
+static PHP_FUNCTION(webp_encode_sizes);
+#ifdef HAVE_WEBP_JPEG
+static PHP_FUNCTION(webp_from_jpeg);
+static PHP_FUNCTION(webp_to_jpeg);
+#endif
+#ifdef HAVE_WEBP_PNG
+static PHP_FUNCTION(webp_from_png);
+#endif
+
+/* }}} */
+/* {{{ php method prototypes */
+
+static PHP_METHOD(WebPImage, __construct);
+static PHP_METHOD(WebPImage, fromFile);
+static PHP_METHOD(WebPImage, getWidth);
+static PHP_METHOD(WebPImage, getHeight);
+static PHP_METHOD(WebPImage, getQuality);
+static PHP_METHOD(WebPImage, getData);
+static PHP_METHOD(WebPImage, getMetadata);
+static PHP_METHOD(WebPImage, toGd);
 
 /* }}} */
 /* {{{ php function argument informations */
@@ -91,21 +524,123 @@ static PHP_FUNCTION(imagewebp);
 
 PHP_WEBP_BEGIN_ARG_INFO(arginfo_imagecreatefromwebp, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
 	ZEND_ARG_INFO(0, filename)
+	ZEND_ARG_INFO(0, options)
 ZEND_END_ARG_INFO()
 
 PHP_WEBP_BEGIN_ARG_INFO(arginfo_imagewebp, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
 	ZEND_ARG_INFO(0, image)
-	ZEND_ARG_INFO(0, filename)
+	ZEND_ARG_INFO(0, to)
 	ZEND_ARG_INFO(0, quality)
 	ZEND_ARG_INFO(1, difference)
 ZEND_END_ARG_INFO()
 
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_encode, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, options)
+	ZEND_ARG_INFO(1, info)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_last_stats, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+
+#ifdef HAVE_WEBP_STATUS
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_get_status, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+#endif
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_get_metadata, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, filename)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_set_metadata, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 2)
+	ZEND_ARG_INFO(0, filename)
+	ZEND_ARG_INFO(0, metadata)
+	ZEND_ARG_INFO(0, destination)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_recompress, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, data)
+	ZEND_ARG_INFO(0, quality)
+	ZEND_ARG_INFO(0, force)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_encode_sizes, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 2)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, widths)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
+#ifdef HAVE_WEBP_JPEG
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_from_jpeg, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, filename)
+	ZEND_ARG_INFO(0, quality)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_to_jpeg, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, data)
+	ZEND_ARG_INFO(0, quality)
+ZEND_END_ARG_INFO()
+#endif
+
+#ifdef HAVE_WEBP_PNG
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webp_from_png, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, filename)
+	ZEND_ARG_INFO(0, quality)
+ZEND_END_ARG_INFO()
+#endif
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webpimage___construct, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, data)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webpimage_fromfile, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 1)
+	ZEND_ARG_INFO(0, filename)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webpimage_none, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 0)
+ZEND_END_ARG_INFO()
+
+PHP_WEBP_BEGIN_ARG_INFO(arginfo_webpimage_togd, ZEND_SEND_BY_VAL, ZEND_RETURN_VALUE, 0)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
 /* }}} */
 /* {{{ webp_functions[] */
 
 static zend_function_entry webp_functions[] = {
 	PHP_FE(imagecreatefromwebp, arginfo_imagecreatefromwebp)
 	PHP_FE(imagewebp,           arginfo_imagewebp)
+	PHP_FE(webp_encode,         arginfo_webp_encode)
+	PHP_FE(webp_last_stats,     arginfo_webp_last_stats)
+#ifdef HAVE_WEBP_STATUS
+	PHP_FE(webp_get_status,     arginfo_webp_get_status)
+#endif
+	PHP_FE(webp_get_metadata,   arginfo_webp_get_metadata)
+	PHP_FE(webp_set_metadata,   arginfo_webp_set_metadata)
+	PHP_FE(webp_recompress,     arginfo_webp_recompress)
+	PHP_FE(webp_encode_sizes,   arginfo_webp_encode_sizes)
+#ifdef HAVE_WEBP_JPEG
+	PHP_FE(webp_from_jpeg,      arginfo_webp_from_jpeg)
+	PHP_FE(webp_to_jpeg,        arginfo_webp_to_jpeg)
+#endif
+#ifdef HAVE_WEBP_PNG
+	PHP_FE(webp_from_png,       arginfo_webp_from_png)
+#endif
+	{ NULL, NULL, NULL }
+};
+
+/* }}} */
+/* {{{ webp_image_methods[] */
+
+static zend_function_entry webp_image_methods[] = {
+	PHP_ME(WebPImage, __construct, arginfo_webpimage___construct, ZEND_ACC_PUBLIC | ZEND_ACC_CTOR)
+	PHP_ME(WebPImage, fromFile,    arginfo_webpimage_fromfile,    ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+	PHP_ME(WebPImage, getWidth,    arginfo_webpimage_none,        ZEND_ACC_PUBLIC)
+	PHP_ME(WebPImage, getHeight,   arginfo_webpimage_none,        ZEND_ACC_PUBLIC)
+	PHP_ME(WebPImage, getQuality,  arginfo_webpimage_none,        ZEND_ACC_PUBLIC)
+	PHP_ME(WebPImage, getData,     arginfo_webpimage_none,        ZEND_ACC_PUBLIC)
+	PHP_ME(WebPImage, getMetadata, arginfo_webpimage_none,        ZEND_ACC_PUBLIC)
+	PHP_ME(WebPImage, toGd,        arginfo_webpimage_togd,        ZEND_ACC_PUBLIC)
 	{ NULL, NULL, NULL }
 };
 
@@ -127,14 +662,9 @@ static zend_module_entry webp_module_entry = {
 	"webp",
 	webp_functions,
 	PHP_MINIT(webp),
-	NULL,
-#ifdef GD_API_IS_HIDDEN
+	PHP_MSHUTDOWN(webp),
 	PHP_RINIT(webp),
 	PHP_RSHUTDOWN(webp),
-#else
-	NULL,
-	NULL,
-#endif
 	PHP_MINFO(webp),
 	PHP_WEBP_VERSION,
 	STANDARD_MODULE_PROPERTIES
@@ -145,10 +675,39 @@ static zend_module_entry webp_module_entry = {
 ZEND_GET_MODULE(webp)
 #endif
 
+/* {{{ php_webp_init_globals() */
+
+static void
+php_webp_init_globals(zend_webp_globals *webp_globals)
+{
+	memset(webp_globals, 0, sizeof(zend_webp_globals));
+	webp_globals->last_stats.op = PHP_WEBP_OP_NONE;
+	webp_globals->last_stats.qp = -1;
+}
+
+/* }}} */
+/* {{{ php_webp_shutdown_globals() */
+
+static void
+php_webp_shutdown_globals(zend_webp_globals *webp_globals)
+{
+	int i;
+
+	for (i = 0; i < PHP_WEBP_NUM_SCRATCH; i++) {
+		pwp_scratch_free(&webp_globals->scratch[i], &webp_globals->scratch_size);
+	}
+}
+
+/* }}} */
 /* {{{ PHP_MINIT_FUNCTION */
 
 static PHP_MINIT_FUNCTION(webp)
 {
+	zend_class_entry ce;
+
+	ZEND_INIT_MODULE_GLOBALS(webp, php_webp_init_globals, php_webp_shutdown_globals);
+	REGISTER_INI_ENTRIES();
+
 	le_gd = phpi_get_le_gd();
 #ifdef GD_API_IS_HIDDEN
 	le_fake = zend_register_list_destructors(NULL, NULL, module_number);
@@ -158,36 +717,70 @@ static PHP_MINIT_FUNCTION(webp)
 	REGISTER_LONG_CONSTANT("WEBP_DEFAULT_QUALITY",
 			default_quality, CONST_PERSISTENT | CONST_CS);
 
-	return SUCCESS;
+#ifdef HAVE_WEBP_STATUS
+	/* mapped before the server forks its workers, so that they share it */
+	if (WEBPG(status_enabled)) {
+		void *segment = mmap(NULL, sizeof(php_webp_status),
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+		if (segment == MAP_FAILED) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Failed to map the status segment");
+		} else {
+			pwp_status = (php_webp_status *)segment;
+			pwp_status->start_time = (long)time(NULL);
+		}
+	}
+#endif
+
+	INIT_CLASS_ENTRY(ce, "WebPImage", webp_image_methods);
+	ce.create_object = pwp_image_new;
+	pwp_image_ce = zend_register_internal_class(&ce TSRMLS_CC);
+	memcpy(&pwp_image_handlers, zend_get_std_object_handlers(),
+			sizeof(zend_object_handlers));
+	pwp_image_handlers.clone_obj = NULL;
+
+	return php_stream_filter_register_factory(PWP_ENCODE_FILTER,
+			&pwp_encode_filter_factory TSRMLS_CC);
 }
 
 /* }}} */
-#ifdef GD_API_IS_HIDDEN
-/* {{{ PHP_RINIT_FUNCTION */
+/* {{{ PHP_MSHUTDOWN_FUNCTION */
 
-static PHP_RINIT_FUNCTION(webp)
+static PHP_MSHUTDOWN_FUNCTION(webp)
 {
-	zval *ict_name;
-	zend_fcall_info *fci;
-	zend_fcall_info_cache *fcc;
-	int result;
+	php_stream_filter_unregister_factory(PWP_ENCODE_FILTER TSRMLS_CC);
+	UNREGISTER_INI_ENTRIES();
+#ifdef HAVE_WEBP_STATUS
+	if (pwp_status) {
+		munmap(pwp_status, sizeof(php_webp_status));
+		pwp_status = NULL;
+	}
+#endif
+#ifndef ZTS
+	php_webp_shutdown_globals(&webp_globals);
+#endif
 
-	MAKE_STD_ZVAL(ict_name);
-	ZVAL_STRING(ict_name, "imagecreatetruecolor", 1);
-	fci = &WEBPG(ict_fci);
-	fcc = &WEBPG(ict_fcc);
+	return SUCCESS;
+}
 
-#if ZEND_EXTENSION_API_NO >= 220090626
-	result = zend_fcall_info_init(ict_name, 0, fci, fcc, NULL, NULL TSRMLS_CC);
-#else
-	result = zend_fcall_info_init(ict_name, fci, fcc TSRMLS_CC);
-#endif
+/* }}} */
+/* {{{ PHP_RINIT_FUNCTION */
 
-	if (FAILURE == result) {
-		zval_ptr_dtor(&ict_name);
+static PHP_RINIT_FUNCTION(webp)
+{
+#ifdef GD_API_IS_HIDDEN
+	if (FAILURE == pwp_gd_function_init("imagecreatetruecolor",
+			&WEBPG(ict_name), &WEBPG(ict_fci), &WEBPG(ict_fcc))
+	) {
+		return FAILURE;
+	}
+	if (FAILURE == pwp_gd_function_init("imagecreate",
+			&WEBPG(ic_name), &WEBPG(ic_fci), &WEBPG(ic_fcc))
+	) {
+		zval_ptr_dtor(&WEBPG(ict_name));
 		return FAILURE;
 	}
-	WEBPG(ict_name) = ict_name;
+#endif
 
 	return SUCCESS;
 }
@@ -197,309 +790,3436 @@ static PHP_RINIT_FUNCTION(webp)
 
 static PHP_RSHUTDOWN_FUNCTION(webp)
 {
+#ifdef GD_API_IS_HIDDEN
 	zval_ptr_dtor(&WEBPG(ict_name));
+	zval_ptr_dtor(&WEBPG(ic_name));
+#endif
+	pwp_scratch_trim();
 
 	return SUCCESS;
 }
 
 /* }}} */
-#endif
 /* {{{ PHP_MINFO_FUNCTION */
 
 static PHP_MINFO_FUNCTION(webp)
 {
+	char scratch_size[32];
+
 	php_info_print_table_start();
 	php_info_print_table_row(2, "Version", PHP_WEBP_VERSION " (" PHP_WEBP_RELEASE ")");
+	snprintf(scratch_size, sizeof(scratch_size), "%lu",
+			(unsigned long)WEBPG(scratch_size));
+	php_info_print_table_row(2, "Scratch buffers (bytes)", scratch_size);
+#ifdef HAVE_WEBP_STATUS
+	php_info_print_table_row(2, "Shared status", pwp_status ? "enabled" : "disabled");
+#endif
 	php_info_print_table_end();
+
+	if (WEBPG(stats_enabled)) {
+		const php_webp_totals *enc = &WEBPG(totals)[PHP_WEBP_OP_ENCODE];
+		const php_webp_totals *dec = &WEBPG(totals)[PHP_WEBP_OP_DECODE];
+		char buf[2][64], label[32];
+		int i;
+
+		php_info_print_table_start();
+		php_info_print_table_header(3, "Worker statistics", "Encode", "Decode");
+		snprintf(buf[0], sizeof(buf[0]), "%ld", enc->count);
+		snprintf(buf[1], sizeof(buf[1]), "%ld", dec->count);
+		php_info_print_table_row(3, "Calls", buf[0], buf[1]);
+		snprintf(buf[0], sizeof(buf[0]), "%ld", enc->failures);
+		snprintf(buf[1], sizeof(buf[1]), "%ld", dec->failures);
+		php_info_print_table_row(3, "Failures", buf[0], buf[1]);
+		snprintf(buf[0], sizeof(buf[0]), "%.0f", enc->bytes_in);
+		snprintf(buf[1], sizeof(buf[1]), "%.0f", dec->bytes_in);
+		php_info_print_table_row(3, "Bytes in", buf[0], buf[1]);
+		snprintf(buf[0], sizeof(buf[0]), "%.0f", enc->bytes_out);
+		snprintf(buf[1], sizeof(buf[1]), "%.0f", dec->bytes_out);
+		php_info_print_table_row(3, "Bytes out", buf[0], buf[1]);
+		for (i = 0; i < PHP_WEBP_NUM_STAGES; i++) {
+			snprintf(label, sizeof(label), "Time: %s (s)", pwp_stage_names[i]);
+			snprintf(buf[0], sizeof(buf[0]), "%.6f", enc->time[i]);
+			snprintf(buf[1], sizeof(buf[1]), "%.6f", dec->time[i]);
+			php_info_print_table_row(3, label, buf[0], buf[1]);
+		}
+		php_info_print_table_end();
+	}
+
+	DISPLAY_INI_ENTRIES();
 }
 
 /* }}} */
 /* {{{ imagecreatefromwebp() */
 
 /**
- * resource imagecreatefromwebp(string filename)
- * Create a new image from file or URL.
+ * resource imagecreatefromwebp(string filename [, array options])
+ * Create a new image from file or URL. The options are:
+ *   "palette" => int, create a palette image of at most this many colors,
+ *                quantized from the decoded YUV planes
+ *   "dither" => bool, use a fixed palette with ordered dithering instead of
+ *               the median cut palette of the image
  */
 static PHP_FUNCTION(imagecreatefromwebp)
 {
 	const char *filename = NULL;
 	int filename_len = 0;
+	zval *options = NULL;
+	int colors, method;
 	php_stream *stream;
+	char header[WEBP_HEADER_SIZE];
+	size_t header_size = 0, read_size;
 	char *data = NULL;
 	size_t data_size;
 
 	gdImagePtr im;
-	uint32 *pix_buf;
-	const uint32 *pix_ptr;
-	uint8 *y_ptr = NULL, *u_ptr = NULL, *v_ptr = NULL;
-	int x, y, width, height, words_per_line;
+	uint8 *yuv_buf, *y_ptr, *u_ptr, *v_ptr;
+	int width, height;
+	int uv_width, uv_height;
+	size_t y_nmemb, uv_nmemb;
 	WebPResult result;
 
 	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
-			"s", &filename, &filename_len)
+			"s|a!", &filename, &filename_len, &options)
 	) {
 		return;
 	}
+	if (FAILURE == pwp_palette_options(options, &colors, &method)) {
+		RETURN_FALSE;
+	}
+
+	pwp_stats_begin(PHP_WEBP_OP_DECODE);
 
 	stream = pwp_file_open(filename, "rb", NULL);
-	data_size = php_stream_copy_to_mem(stream, &data, PHP_STREAM_COPY_ALL, 0);
-	if (!data_size) {
-		if (data) {
-			efree(data);
-		}
+	if (!stream) {
+		pwp_stats_end(0);
 		RETURN_FALSE;
 	}
 
-	result = WebPDecode((const uint8 *)data, (int)data_size,
-			&y_ptr, &u_ptr, &v_ptr, &width, &height);
-	if (result == webp_failure) {
-		if (y_ptr) {
-			free(y_ptr);
+	/* check the dimensions before loading the whole file */
+	while (header_size < sizeof(header)) {
+		read_size = php_stream_read(stream, header + header_size,
+				sizeof(header) - header_size);
+		if (read_size == 0) {
+			break;
 		}
-		efree(data);
+		header_size += read_size;
+	}
+	if (WebPGetInfo((const uint8 *)header, (int)header_size,
+			&width, &height) == webp_failure
+	) {
+		php_stream_close(stream);
 		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		pwp_stats_end(0);
 		RETURN_FALSE;
 	}
-	efree(data);
-
-	words_per_line = width;
-	pix_buf = (uint32 *)ecalloc((size_t)(width * height), sizeof(uint32));
-	if (!pix_buf) {
-		free(y_ptr);
-		php_error(E_ERROR, "Failed to allocate memory");
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, DECODER_FRAMES)
+				+ (size_t)width * (size_t)height * (colors ? 1 : sizeof(int)))
+	) {
+		php_stream_close(stream);
+		pwp_stats_end(0);
 		RETURN_FALSE;
 	}
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
 
-	YUV420toRGBA(y_ptr, u_ptr, v_ptr, words_per_line, width, height, pix_buf);
-	free(y_ptr);
+	data_size = php_stream_copy_to_mem(stream, &data, PHP_STREAM_COPY_ALL, 0);
+	php_stream_close(stream);
+	data = (char *)erealloc(data, header_size + data_size);
+	memmove(data + header_size, data, data_size);
+	memcpy(data, header, header_size);
+	data_size += header_size;
+	PWP_STATS(bytes_in) = (long)data_size;
+	pwp_stats_quantizer(data, data_size);
+	pwp_stats_lap(PHP_WEBP_STAGE_IO);
 
-	im = gdImageCreateTrueColor(width, height);
-	if (!im) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to create image");
-		efree(pix_buf);
+	uv_width = (width + 1) >> 1;
+	uv_height = (height + 1) >> 1;
+	y_nmemb = (size_t)(width * height);
+	uv_nmemb = (size_t)(uv_width * uv_height);
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	if (yuv_buf == NULL) {
+		efree(data);
+		pwp_stats_end(0);
 		RETURN_FALSE;
 	}
+	y_ptr = yuv_buf;
+	u_ptr = y_ptr + y_nmemb;
+	v_ptr = u_ptr + uv_nmemb;
+	result = WebPDecodeInto((const uint8 *)data, (int)data_size,
+			y_ptr, u_ptr, v_ptr, width, uv_width, width, height);
+	efree(data);
+	if (result == webp_failure) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
 
-	pix_ptr = pix_buf;
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			im->tpixels[y][x] = (int)(*pix_ptr >> 8);
-			pix_ptr++;
-		}
+	im = pwp_yuv_to_image(y_ptr, u_ptr, v_ptr, width, height, colors, method);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+	if (!im) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
 	}
 
 	ZEND_REGISTER_RESOURCE(return_value, im, le_gd);
-	efree(pix_buf);
+	PWP_STATS(bytes_out) = (long)(width * height * (colors ? 1 : sizeof(int)));
+	pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+	pwp_stats_end(1);
 }
 
 /* }}} */
 /* {{{ imagewebp() */
 
 /**
- * bool imagewebp(resource image [, string filename = NULL
+ * bool imagewebp(resource image [, mixed to = NULL
  *     [, int quality = WEBP_DEFAULT_QUALITY [, float &difference = NULL] ]])
- * Output image to browser or file.
+ * Output image to browser, file or stream.
+ * to is a filename, or an open stream which is left open.
+ * The output is written to a stream, or to the browser, as the encoder
+ * produces it, in chunks, unless difference is given: it receives the PSNR
+ * of the output, which needs the whole of it, and webp_last_stats()
+ * reports its SSIM as well. A file is only created, or replaced, once the
+ * image is encoded, so a failure leaves an existing file as it was.
  */
 static PHP_FUNCTION(imagewebp)
 {
-	zval *image = NULL;
+	zval *image = NULL, *to = NULL;
 	gdImagePtr im;
-	const char *filename = NULL;
-	int filename_len = 0;
 	char *opened_path = NULL;
-	php_stream *stream;
-	size_t output_size;
+	php_stream *stream = NULL;
+	int close_stream = 1, open_failed = 0, write_failed = 0;
 	long quality = default_quality;
 	int qp;
 	zval *difference = NULL;
+	pwp_writer writer;
 
-	int x, y, width, height, words_per_line;
+	int width, height, words_per_line;
 	int uv_width, uv_height, uv_words_per_line;
 	size_t y_nmemb, uv_nmemb;
-	uint32 *pix_buf, *pix_ptr;
 	uint8 *yuv_buf, *y_ptr, *u_ptr, *v_ptr;
+	WebPEncodeConfig config;
 	WebPResult result;
 	unsigned char *out = NULL;
 	int out_size_bytes = 0;
 	double snr = 0.0;
 
 	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
-			"r|s!lz", &image, &filename, &filename_len, &quality, &difference)
+			"r|z/!lz", &image, &to, &quality, &difference)
 	) {
 		return;
 	}
 	ZEND_FETCH_RESOURCE(im, gdImagePtr, &image, -1, "Image", le_gd);
-
-	if (quality == default_quality) {
-		qp = DEFAULT_QP;
-	} else if (quality <= 0L) {
-		qp = MAX_QP;
-	} else if (quality >= 100L) {
-		qp = MIN_QP;
-	} else {
-		qp = CALC_QP(quality);
+	if (to && Z_TYPE_P(to) == IS_RESOURCE) {
+		php_stream_from_zval(stream, &to);
+		close_stream = 0;
+	} else if (to) {
+		convert_to_string(to);
 	}
 
+	pwp_stats_begin(PHP_WEBP_OP_ENCODE);
+
+	qp = pwp_quality_to_qp(quality);
+
 	width = gdImageSX(im);
 	height = gdImageSY(im);
-	if (width > MAX_IMAGE_SIDE_LENGTH || height > MAX_IMAGE_SIDE_LENGTH) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "The image size is too large");
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, ENCODER_FRAMES))
+	) {
+		pwp_stats_end(0);
 		RETURN_FALSE;
 	}
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
 
 	uv_width = (width + 1) >> 1;
 	uv_height = (height + 1) >> 1;
 	y_nmemb = (size_t)(width * height);
 	uv_nmemb = (size_t)(uv_width * uv_height);
-	pix_buf = (uint32 *)ecalloc(y_nmemb, sizeof(uint32));
-	yuv_buf = (uint8 *)ecalloc(y_nmemb + 2 * uv_nmemb, sizeof(uint8));
-	if (pix_buf == NULL || yuv_buf == NULL) {
-		if (yuv_buf) {
-			efree(yuv_buf);
-		}
-		if (pix_buf) {
-			efree(pix_buf);
-		}
-		php_error(E_ERROR, "Failed to allocate memory");
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	if (yuv_buf == NULL) {
+		pwp_stats_end(0);
 		RETURN_FALSE;
 	}
 	y_ptr = yuv_buf;
 	u_ptr = y_ptr + y_nmemb;
 	v_ptr = u_ptr + uv_nmemb;
 
-	pix_ptr = pix_buf;
-	if (gdImageTrueColor(im)) {
-		for (y = 0; y < height; y++) {
-			for (x = 0; x < width; x++) {
-				*pix_ptr = (uint32)gdImageTrueColorPixel(im, x, y) << 8;
-				pix_ptr++;
-			}
-		}
-	} else {
-		int c;
-		for (y = 0; y < height; y++) {
-			for (x = 0; x < width; x++) {
-				c = gdImagePalettePixel(im, x, y);
-				*pix_ptr = (((uint32)im->red[c]) << 24)
-						| (((uint32)im->green[c]) << 16)
-						| (((uint32)im->blue[c]) << 8);
-				pix_ptr++;
-			}
+	words_per_line = width;
+	uv_words_per_line = uv_width;
+	if (FAILURE == pwp_image_to_yuv(im, y_ptr, u_ptr, v_ptr)) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	if (stream == NULL && !to) {
+		stream = pwp_url_open("php://output", "wb", NULL);
+		if (stream == NULL) {
+			pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+			pwp_stats_end(0);
+			RETURN_FALSE;
 		}
 	}
 
-	words_per_line = width;
-	uv_words_per_line = uv_width;
-	RGBAToYUV420(pix_buf, words_per_line, width, height, y_ptr, u_ptr, v_ptr);
-	result = WebPEncode(y_ptr, u_ptr, v_ptr,
+	pwp_encode_config(&config, qp);
+	pwp_encode_deadline(&config, width, height, WEBPG(encode_deadline_ms));
+	if (difference == NULL && stream != NULL) {
+		/* nothing to measure: stream the output, the I/O is then timed
+		 * as part of the codec stage */
+		pwp_writer_init(&writer, stream, NULL);
+		config.writer = pwp_stream_writer;
+		config.writer_opaque = &writer;
+	}
+	result = WebPEncodeEx(y_ptr, u_ptr, v_ptr,
 			width, height, words_per_line,
 			uv_width, uv_height, uv_words_per_line,
-			qp, &out, &out_size_bytes,
-			difference ? &snr : NULL);
+			&config, &out, &out_size_bytes, NULL);
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	if (result == webp_success && difference
+		&& SUCCESS == pwp_measure(y_ptr, u_ptr, v_ptr, width, height,
+				out, out_size_bytes, PWP_METRIC_PSNR | PWP_METRIC_SSIM)
+	) {
+		snr = PWP_STATS(psnr);
+	}
 
-	efree(yuv_buf);
-	efree(pix_buf);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
 
-	if (result == webp_failure) {
+	if (config.writer) {
+		write_failed = writer.failed;
+	} else if (result == webp_success) {
+		if (stream == NULL) {
+			stream = pwp_file_open(Z_STRVAL_P(to), "wb", &opened_path);
+		}
+		if (stream == NULL) {
+			open_failed = 1;
+		} else {
+			write_failed = (php_stream_write(stream, (const char *)out,
+					(size_t)out_size_bytes) != (size_t)out_size_bytes);
+		}
+	}
+	if (open_failed) {
+		RETVAL_FALSE;
+	} else if (write_failed) {
+		if (opened_path) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"failed to write data to %s", opened_path);
+		} else {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"failed to write data");
+		}
+		RETVAL_FALSE;
+	} else if (result == webp_failure) {
 		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode WebP image");
-		RETURN_FALSE;
+		RETVAL_FALSE;
+	} else {
+		PWP_STATS(bytes_out) = (long)out_size_bytes;
+		if (difference) {
+			zval_dtor(difference);
+			ZVAL_DOUBLE(difference, snr);
+		}
+		RETVAL_TRUE;
+	}
+
+	if (close_stream && stream != NULL) {
+		php_stream_close(stream);
 	}
+	if (opened_path) {
+		efree(opened_path);
+	}
+	pwp_scratch_put(PHP_WEBP_SCRATCH_OUTPUT, out);
+	pwp_stats_lap(PHP_WEBP_STAGE_IO);
+	pwp_stats_end(Z_BVAL_P(return_value));
+}
+
+/* }}} */
+/* {{{ webp_encode() */
+
+/**
+ * string webp_encode(resource image [, array options [, array &info]])
+ * Encode the image to WebP data.
+ * options:
+ *   "quality" => int, default WEBP_DEFAULT_QUALITY, or "auto" to choose
+ *                the lowest quality expected to reach "target_ssim"
+ *   "target_ssim" => float, default 0.95, implies "quality" => "auto".
+ *                    The quality is predicted from trial encodes of
+ *                    tiles of the image; info["quality"] tells which.
+ *   "placeholder" => int, also encode a placeholder whose longer side is
+ *                    at most this many pixels into info["placeholder"].
+ *                    It is scaled down from the YUV planes of the image,
+ *                    and left out with a warning if that fails.
+ *   "placeholder_quality" => int, default 10
+ *   "placeholder_uri" => bool, give the placeholder as a data URI
+ *   "adaptive" => bool, vary the quantizer with the activity of each
+ *                 macroblock: coarser where texture hides the error
+ *   "roi" => array(x, y, width, height), a region of interest coded
+ *            finer than the rest, implies "adaptive"
+ *   "deadline_ms" => int, time budget of the encode, default
+ *                    webp.encode_deadline_ms. The encoding effort is
+ *                    lowered as needed to fit it, and info["degraded"]
+ *                    tells by how many steps.
+ *   "psnr" => bool, measure the PSNR of the output into info["psnr"]
+ *   "ssim" => bool, measure the SSIM of the luma into info["ssim"]
+ *   "ssim_chroma" => bool, measure the SSIM with the chroma included
+ */
+static PHP_FUNCTION(webp_encode)
+{
+	zval *image = NULL, *options = NULL, *info = NULL;
+	gdImagePtr im;
+	long quality = default_quality;
+	long placeholder = 0L, placeholder_quality = DEFAULT_PLACEHOLDER_QUALITY;
+	long placeholder_uri = 0L, adaptive = 0L;
+	long deadline_ms = WEBPG(encode_deadline_ms);
+	long psnr = 0L, ssim = 0L, ssim_chroma = 0L;
+	double target_ssim = DEFAULT_TARGET_SSIM;
+	int degraded, metrics, auto_quality = 0, qp;
+	zval **roi_entry, **entry;
+	int roi[4], has_roi = 0, i;
+	uint8 *segment_map = NULL;
 
-	if (difference) {
-		zval_dtor(difference);
-		ZVAL_DOUBLE(difference, snr);
+	int width, height, uv_width, uv_height, lq_width, lq_height, longer;
+	size_t y_nmemb, uv_nmemb, lq_y_nmemb, lq_uv_nmemb;
+	uint8 *yuv_buf, *y_ptr, *u_ptr, *v_ptr, *lq_buf;
+	WebPEncodeConfig config;
+	WebPResult result, lq_result;
+	unsigned char *out = NULL, *lq_out = NULL, *uri;
+	char *uri_str;
+	int out_size_bytes = 0, lq_size_bytes = 0, uri_len;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"r|a!z", &image, &options, &info)
+	) {
+		return;
 	}
+	ZEND_FETCH_RESOURCE(im, gdImagePtr, &image, -1, "Image", le_gd);
 
-	if (filename) {
-		stream = pwp_file_open(filename, "wb", &opened_path);
+	if (options && SUCCESS == zend_hash_find(Z_ARRVAL_P(options),
+			"quality", sizeof("quality"), (void **)&entry)
+		&& Z_TYPE_PP(entry) == IS_STRING
+		&& !strcasecmp(Z_STRVAL_PP(entry), "auto")
+	) {
+		auto_quality = 1;
 	} else {
-		stream = pwp_url_open("php://output", "wb", NULL);
+		pwp_option_long(options, "quality", &quality);
+	}
+	if (SUCCESS == pwp_option_double(options, "target_ssim", &target_ssim)) {
+		auto_quality = 1;
 	}
-	if (stream) {
-		output_size = php_stream_write(stream, (const char *)out, (size_t)out_size_bytes);
-		if (output_size != (size_t)out_size_bytes) {
-			if (opened_path) {
+	pwp_option_long(options, "placeholder", &placeholder);
+	pwp_option_long(options, "placeholder_quality", &placeholder_quality);
+	pwp_option_long(options, "placeholder_uri", &placeholder_uri);
+	pwp_option_long(options, "adaptive", &adaptive);
+	pwp_option_long(options, "deadline_ms", &deadline_ms);
+	pwp_option_long(options, "psnr", &psnr);
+	pwp_option_long(options, "ssim", &ssim);
+	pwp_option_long(options, "ssim_chroma", &ssim_chroma);
+	metrics = (psnr ? PWP_METRIC_PSNR : 0)
+			| ((ssim || ssim_chroma) ? PWP_METRIC_SSIM : 0)
+			| (ssim_chroma ? PWP_METRIC_SSIM_CHROMA : 0);
+	if (options && SUCCESS == zend_hash_find(Z_ARRVAL_P(options),
+			"roi", sizeof("roi"), (void **)&roi_entry)
+	) {
+		if (Z_TYPE_PP(roi_entry) != IS_ARRAY
+			|| zend_hash_num_elements(Z_ARRVAL_PP(roi_entry)) != 4
+		) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"roi must be an array of x, y, width and height");
+			RETURN_FALSE;
+		}
+		for (i = 0; i < 4; i++) {
+			if (FAILURE == zend_hash_index_find(Z_ARRVAL_PP(roi_entry),
+					(ulong)i, (void **)&entry)
+			) {
 				php_error_docref(NULL TSRMLS_CC, E_WARNING,
-						"failed to write data to %s", opened_path);
+						"roi must be an array of x, y, width and height");
+				RETURN_FALSE;
 			} else {
-				php_error_docref(NULL TSRMLS_CC, E_WARNING,
-						"failed to write data");
+				zval tmp = **entry;
+				zval_copy_ctor(&tmp);
+				convert_to_long(&tmp);
+				roi[i] = (int)Z_LVAL(tmp);
 			}
-			RETVAL_FALSE;
+		}
+		has_roi = adaptive = 1;
+	}
+
+	pwp_stats_begin(PHP_WEBP_OP_ENCODE);
+
+	width = gdImageSX(im);
+	height = gdImageSY(im);
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, ENCODER_FRAMES))
+	) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
+
+	uv_width = (width + 1) >> 1;
+	uv_height = (height + 1) >> 1;
+	y_nmemb = (size_t)(width * height);
+	uv_nmemb = (size_t)(uv_width * uv_height);
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	if (yuv_buf == NULL) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	y_ptr = yuv_buf;
+	u_ptr = y_ptr + y_nmemb;
+	v_ptr = u_ptr + uv_nmemb;
+
+	if (FAILURE == pwp_image_to_yuv(im, y_ptr, u_ptr, v_ptr)) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	qp = pwp_quality_to_qp(quality);
+	pwp_encode_config(&config, qp);
+	degraded = pwp_encode_deadline(&config, width, height, deadline_ms);
+	if (auto_quality) {
+		qp = WebPPredictQP(y_ptr, u_ptr, v_ptr, width, height,
+				width, uv_width, target_ssim, &config);
+		if (qp < 0) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Failed to predict the quality, using the default");
+			qp = DEFAULT_QP;
+		}
+		config.QP = qp;
+		PWP_STATS(qp) = qp;
+		pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+	}
+	if (adaptive) {
+		segment_map = (uint8 *)safe_emalloc((width + 15) >> 4, (height + 15) >> 4, 0);
+		WebPSegmentMap(y_ptr, width, height, width,
+				has_roi ? roi : NULL, segment_map, &config);
+		pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+	}
+	result = WebPEncodeEx(y_ptr, u_ptr, v_ptr,
+			width, height, width,
+			uv_width, uv_height, uv_width,
+			&config, &out, &out_size_bytes, NULL);
+	if (segment_map) {
+		efree(segment_map);
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	if (result == webp_success && info && metrics) {
+		pwp_measure(y_ptr, u_ptr, v_ptr, width, height,
+				out, out_size_bytes, metrics);
+	}
+
+	if (result == webp_success && info && placeholder > 0L) {
+		/* scale the planes we already have down to a few pixels */
+		longer = (width > height) ? width : height;
+		if (placeholder > (long)longer) {
+			placeholder = (long)longer;
+		}
+		lq_width = (int)(((double)width * placeholder + longer / 2) / longer);
+		lq_height = (int)(((double)height * placeholder + longer / 2) / longer);
+		if (lq_width < 1) {
+			lq_width = 1;
+		}
+		if (lq_height < 1) {
+			lq_height = 1;
+		}
+		lq_y_nmemb = (size_t)(lq_width * lq_height);
+		lq_uv_nmemb = (size_t)(((lq_width + 1) >> 1) * ((lq_height + 1) >> 1));
+		lq_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_RECON,
+				lq_y_nmemb + 2 * lq_uv_nmemb);
+		if (lq_buf == NULL
+			|| YUV420Scale(y_ptr, u_ptr, v_ptr, width, height,
+					lq_buf, lq_buf + lq_y_nmemb, lq_buf + lq_y_nmemb + lq_uv_nmemb,
+					lq_width, lq_height) == webp_failure
+		) {
+			lq_result = webp_failure;
 		} else {
-			RETVAL_TRUE;
+			pwp_encode_config(&config, pwp_quality_to_qp(placeholder_quality));
+			lq_result = WebPEncodeEx(lq_buf, lq_buf + lq_y_nmemb,
+					lq_buf + lq_y_nmemb + lq_uv_nmemb,
+					lq_width, lq_height, lq_width,
+					(lq_width + 1) >> 1, (lq_height + 1) >> 1, (lq_width + 1) >> 1,
+					&config, &lq_out, &lq_size_bytes, NULL);
+		}
+		pwp_scratch_put(PHP_WEBP_SCRATCH_RECON, lq_buf);
+		pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+		/* the image itself is fine: return it without the placeholder */
+		if (lq_result == webp_failure) {
+			lq_out = NULL;
+			lq_size_bytes = 0;
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Failed to encode the placeholder, it is left out");
 		}
-	} else {
-		RETVAL_FALSE;
 	}
-	if (opened_path) {
-		efree(opened_path);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+
+	if (result == webp_failure) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(bytes_out) = (long)(out_size_bytes + lq_size_bytes);
+
+	if (info) {
+		zval_dtor(info);
+		array_init(info);
+		add_assoc_long(info, "width", (long)width);
+		add_assoc_long(info, "height", (long)height);
+		add_assoc_long(info, "quality", CALC_QUALITY(qp));
+		add_assoc_long(info, "degraded", (long)degraded);
+		if (PWP_STATS(metrics) & PWP_METRIC_PSNR) {
+			add_assoc_double(info, "psnr", PWP_STATS(psnr));
+		}
+		if (PWP_STATS(metrics) & PWP_METRIC_SSIM) {
+			add_assoc_double(info, "ssim", PWP_STATS(ssim));
+		}
+		if (lq_out && placeholder_uri) {
+			uri = php_base64_encode(lq_out, lq_size_bytes, &uri_len);
+			uri_len = spprintf(&uri_str, 0, "%s%s", DATA_URI_PREFIX, (char *)uri);
+			efree(uri);
+			add_assoc_stringl(info, "placeholder", uri_str, uri_len, 0);
+		} else if (lq_out) {
+			add_assoc_stringl(info, "placeholder", (char *)lq_out, lq_size_bytes, 1);
+		}
 	}
-	free(out);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_OUTPUT, lq_out);
+
+	RETVAL_STRINGL((char *)out, out_size_bytes, 1);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_OUTPUT, out);
+	pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+	pwp_stats_end(1);
 }
 
 /* }}} */
-/* {{{ _pwp_stream_open() */
+/* {{{ webp_recompress() */
 
-static php_stream *
-_pwp_stream_open(const char *filename, const char *mode,
-                 int options, char **opened_path TSRMLS_DC)
+/**
+ * string webp_recompress(string data
+ *     [, int quality = WEBP_DEFAULT_QUALITY [, bool force = false]])
+ * Re-encode WebP data at another quality. The decoded YUV planes are
+ * encoded as they are, without going through RGB or a GD image.
+ * Unless force is true, data is returned as it is when the requested
+ * quality is not lower than the quality data was encoded with.
+ */
+static PHP_FUNCTION(webp_recompress)
 {
-	php_stream *stream;
-	char *path = NULL;
+	const char *data = NULL;
+	int data_size = 0;
+	long quality = default_quality;
+	zend_bool force = 0;
 
-	stream = php_stream_open_wrapper((char *)filename, (char *)mode,
-			ENFORCE_SAFE_MODE | REPORT_ERRORS | options, &path);
+	int width, height, uv_width, uv_height, qp, source_qp;
+	size_t y_nmemb, uv_nmemb;
+	uint8 *yuv_buf, *y_ptr, *u_ptr, *v_ptr;
+	WebPEncodeConfig config;
+	unsigned char *out = NULL;
+	int out_size_bytes = 0;
+	WebPResult result;
 
-	if (stream == NULL) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING,
-				"Argument 1 should be a valid filename");
-		return NULL;
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"s|lb", &data, &data_size, &quality, &force)
+	) {
+		return;
 	}
+	qp = pwp_quality_to_qp(quality);
 
-	if (opened_path != NULL) {
-		*opened_path = path;
-	} else {
-		efree(path);
+	pwp_stats_begin(PHP_WEBP_OP_ENCODE);
+	PWP_STATS(bytes_in) = (long)data_size;
+
+	if (WebPGetInfo((const uint8 *)data, data_size,
+			&width, &height) == webp_failure
+		|| WebPGetQuantizer((const uint8 *)data, data_size,
+			&source_qp) == webp_failure
+	) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
 	}
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
 
-	return stream;
+	/* a finer quantizer cannot bring back what is already lost */
+	if (!force && qp <= source_qp) {
+		PWP_STATS(bytes_out) = (long)data_size;
+		pwp_stats_end(1);
+		RETURN_STRINGL((char *)data, data_size, 1);
+	}
+
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height,
+				DECODER_FRAMES + ENCODER_FRAMES))
+	) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	uv_width = (width + 1) >> 1;
+	uv_height = (height + 1) >> 1;
+	y_nmemb = (size_t)(width * height);
+	uv_nmemb = (size_t)(uv_width * uv_height);
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	if (yuv_buf == NULL) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	y_ptr = yuv_buf;
+	u_ptr = y_ptr + y_nmemb;
+	v_ptr = u_ptr + uv_nmemb;
+
+	result = WebPDecodeInto((const uint8 *)data, data_size,
+			y_ptr, u_ptr, v_ptr, width, uv_width, width, height);
+	if (result == webp_failure) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	pwp_encode_config(&config, qp);
+	pwp_encode_deadline(&config, width, height, WEBPG(encode_deadline_ms));
+	result = WebPEncodeEx(y_ptr, u_ptr, v_ptr,
+			width, height, width,
+			uv_width, uv_height, uv_width,
+			&config, &out, &out_size_bytes, NULL);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	if (result == webp_failure) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(bytes_out) = (long)out_size_bytes;
+
+	RETVAL_STRINGL((char *)out, out_size_bytes, 1);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_OUTPUT, out);
+	pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+	pwp_stats_end(1);
 }
 
 /* }}} */
-#ifdef GD_API_IS_HIDDEN
-/* {{{ _pwp_gdImageCreateTrueColor() */
+/* {{{ webp_encode_sizes() */
 
-static gdImagePtr
-_pwp_gdImageCreateTrueColor(int sx, int sy)
+/**
+ * array webp_encode_sizes(resource image, array widths [, array options])
+ * Encode the image at each of the given widths, keeping the aspect ratio.
+ * Returns an array of WebP data indexed by width, largest first.
+ * The image is converted to YUV once and scaled down in YUV, each size
+ * from the smallest one at least twice as wide, then all the sizes are
+ * encoded in parallel. Widths larger than the image are skipped.
+ * options:
+ *   "quality" => int, default WEBP_DEFAULT_QUALITY
+ */
+static PHP_FUNCTION(webp_encode_sizes)
 {
-	TSRMLS_FETCH();
-	gdImagePtr im = NULL;
-	zval *zim = NULL, *args;
+	zval *image = NULL, *zwidths = NULL, *options = NULL, **entry;
+	gdImagePtr im;
+	long quality = default_quality;
+	HashPosition pos;
 
-	MAKE_STD_ZVAL(args);
-	array_init(args);
-	add_next_index_long(args, (long)sx);
-	add_next_index_long(args, (long)sy);
+	int i, j, n, num_jobs, width, height, w, threads;
+	long *widths;
+	size_t y_nmemb, uv_nmemb, levels_size, footprint;
+	double pixels;
+	uint8 *yuv_buf, *levels_buf, *ptr;
+	WebPEncodeJob *jobs, *src;
+	WebPEncodeConfig config;
+	WebPResult result;
+	long bytes_out = 0;
 
-	zend_fcall_info_call(&WEBPG(ict_fci), &WEBPG(ict_fcc), &zim, args TSRMLS_CC);
-	if (zim) {
-		if (Z_TYPE_P(zim) == IS_RESOURCE) {
-			zend_rsrc_list_entry *le;
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"ra|a!", &image, &zwidths, &options)
+	) {
+		return;
+	}
+	ZEND_FETCH_RESOURCE(im, gdImagePtr, &image, -1, "Image", le_gd);
 
-			ZEND_FETCH_RESOURCE_NO_RETURN(im, gdImagePtr, &zim, -1, "Image", le_gd);
-			if (SUCCESS == zend_hash_index_find(&EG(regular_list),
-					(ulong)Z_LVAL_P(zim), (void **)&le)
-			) {
-				le->ptr = NULL;
-				le->type = le_fake;
+	pwp_option_long(options, "quality", &quality);
+
+	width = gdImageSX(im);
+	height = gdImageSY(im);
+
+	/* collect the distinct widths, largest first */
+	n = zend_hash_num_elements(Z_ARRVAL_P(zwidths));
+	widths = (long *)safe_emalloc(n + 1, sizeof(long), 0);
+	num_jobs = 0;
+	zend_hash_internal_pointer_reset_ex(Z_ARRVAL_P(zwidths), &pos);
+	while (SUCCESS == zend_hash_get_current_data_ex(Z_ARRVAL_P(zwidths),
+			(void **)&entry, &pos)
+	) {
+		zval tmp = **entry;
+		zval_copy_ctor(&tmp);
+		convert_to_long(&tmp);
+		if (Z_LVAL(tmp) <= 0L) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Widths must be positive integers");
+			efree(widths);
+			RETURN_FALSE;
+		}
+		for (i = 0; i < num_jobs; i++) {
+			if (widths[i] == Z_LVAL(tmp)) {
+				break;
 			}
 		}
-		zval_ptr_dtor(&zim);
+		if (i == num_jobs && Z_LVAL(tmp) <= (long)width) {
+			for (; i > 0 && widths[i - 1] < Z_LVAL(tmp); i--) {
+				widths[i] = widths[i - 1];
+			}
+			widths[i] = Z_LVAL(tmp);
+			num_jobs++;
+		}
+		zend_hash_move_forward_ex(Z_ARRVAL_P(zwidths), &pos);
 	}
-	zval_ptr_dtor(&args);
 
-	return im;
+	array_init(return_value);
+	if (num_jobs == 0) {
+		efree(widths);
+		return;
+	}
+
+	pwp_stats_begin(PHP_WEBP_OP_ENCODE);
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
+
+	/* plan the sizes; every encoder runs at the same time */
+	jobs = (WebPEncodeJob *)safe_emalloc(num_jobs, sizeof(WebPEncodeJob), 0);
+	memset(jobs, 0, num_jobs * sizeof(WebPEncodeJob));
+	levels_size = 0;
+	footprint = CODEC_FOOTPRINT(width, height, 1);
+	for (i = 0; i < num_jobs; i++) {
+		w = (int)widths[i];
+		jobs[i].y_width = w;
+		jobs[i].y_height = (int)(((double)height * w + width / 2) / width);
+		if (jobs[i].y_height < 1) {
+			jobs[i].y_height = 1;
+		}
+		jobs[i].y_stride = w;
+		jobs[i].uv_width = jobs[i].uv_stride = (w + 1) >> 1;
+		jobs[i].uv_height = (jobs[i].y_height + 1) >> 1;
+		if (w != width) {
+			levels_size += (size_t)jobs[i].y_width * jobs[i].y_height
+					+ 2 * (size_t)jobs[i].uv_width * jobs[i].uv_height;
+		}
+		footprint += CODEC_FOOTPRINT(w, jobs[i].y_height, ENCODER_FRAMES);
+	}
+	efree(widths);
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(footprint)
+	) {
+		efree(jobs);
+		zval_dtor(return_value);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	y_nmemb = (size_t)(width * height);
+	uv_nmemb = (size_t)(((width + 1) >> 1) * ((height + 1) >> 1));
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	levels_buf = NULL;
+	if (yuv_buf != NULL && levels_size > 0) {
+		levels_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_RECON, levels_size);
+	}
+	if (yuv_buf == NULL || (levels_size > 0 && levels_buf == NULL)
+		|| FAILURE == pwp_image_to_yuv(im, yuv_buf,
+				yuv_buf + y_nmemb, yuv_buf + y_nmemb + uv_nmemb)
+	) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		pwp_scratch_put(PHP_WEBP_SCRATCH_RECON, levels_buf);
+		efree(jobs);
+		zval_dtor(return_value);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	/* build the pyramid */
+	ptr = levels_buf;
+	result = webp_success;
+	for (i = 0; i < num_jobs && result == webp_success; i++) {
+		src = NULL;
+		for (j = i - 1; j >= 0 && src == NULL; j--) {
+			if (jobs[j].y_width >= 2 * jobs[i].y_width) {
+				src = &jobs[j];
+			}
+		}
+		if (jobs[i].y_width == width) {
+			jobs[i].Y = yuv_buf;
+			jobs[i].U = yuv_buf + y_nmemb;
+			jobs[i].V = yuv_buf + y_nmemb + uv_nmemb;
+			continue;
+		}
+		jobs[i].Y = ptr;
+		jobs[i].U = ptr + (size_t)jobs[i].y_width * jobs[i].y_height;
+		jobs[i].V = jobs[i].U + (size_t)jobs[i].uv_width * jobs[i].uv_height;
+		ptr = (uint8 *)jobs[i].V + (size_t)jobs[i].uv_width * jobs[i].uv_height;
+		if (src) {
+			result = YUV420Scale(src->Y, src->U, src->V, src->y_width, src->y_height,
+					(uint8 *)jobs[i].Y, (uint8 *)jobs[i].U, (uint8 *)jobs[i].V,
+					jobs[i].y_width, jobs[i].y_height);
+		} else {
+			result = YUV420Scale(yuv_buf, yuv_buf + y_nmemb, yuv_buf + y_nmemb + uv_nmemb,
+					width, height,
+					(uint8 *)jobs[i].Y, (uint8 *)jobs[i].U, (uint8 *)jobs[i].V,
+					jobs[i].y_width, jobs[i].y_height);
+		}
+	}
+	if (result == webp_failure) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		pwp_scratch_put(PHP_WEBP_SCRATCH_RECON, levels_buf);
+		efree(jobs);
+		zval_dtor(return_value);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to scale the image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+
+	/* the encoders run outside of the engine, so they allocate with malloc().
+	 * The deadline covers all of them: budget the effort for their total
+	 * pixel count, as a frame of the full width */
+	WebPEncodeConfigInit(&config, pwp_quality_to_qp(quality));
+	PWP_STATS(qp) = config.QP;
+	pixels = 0.0;
+	for (i = 0; i < num_jobs; i++) {
+		pixels += (double)jobs[i].y_width * (double)jobs[i].y_height;
+	}
+	pwp_encode_deadline(&config, width, (int)((pixels + width - 1) / width),
+			WEBPG(encode_deadline_ms));
+	threads = (int)WEBPG(conversion_threads);
+	if (threads > num_jobs) {
+		threads = num_jobs;
+	}
+	WebPEncodeJobs(jobs, num_jobs, &config, threads);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_RECON, levels_buf);
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].result == webp_success) {
+			add_index_stringl(return_value, (ulong)jobs[i].y_width,
+					(char *)jobs[i].out, jobs[i].out_size_bytes, 1);
+			bytes_out += jobs[i].out_size_bytes;
+			config.release(config.opaque, jobs[i].out);
+		} else {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Failed to encode WebP image (%dx%d)",
+					jobs[i].y_width, jobs[i].y_height);
+		}
+	}
+	efree(jobs);
+	PWP_STATS(bytes_out) = bytes_out;
+	pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+	pwp_stats_end(1);
+}
+
+/* }}} */
+#ifdef HAVE_WEBP_JPEG
+/* {{{ webp_from_jpeg() */
+
+/**
+ * string webp_from_jpeg(string filename [, int quality = WEBP_DEFAULT_QUALITY])
+ * Convert a JPEG file to WebP data. The JPEG is decoded to YUV planes
+ * and encoded without going through RGB.
+ */
+static PHP_FUNCTION(webp_from_jpeg)
+{
+	const char *filename = NULL;
+	int filename_len = 0;
+	long quality = default_quality;
+	php_stream *stream;
+	char *data = NULL;
+	size_t data_size;
+
+	int width, height, uv_width, uv_height;
+	size_t y_nmemb, uv_nmemb;
+	uint8 *yuv_buf, *y_ptr, *u_ptr, *v_ptr;
+	WebPEncodeConfig config;
+	WebPResult result;
+	unsigned char *out = NULL;
+	int out_size_bytes = 0;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"s|l", &filename, &filename_len, &quality)
+	) {
+		return;
+	}
+
+	pwp_stats_begin(PHP_WEBP_OP_ENCODE);
+
+	stream = pwp_file_open(filename, "rb", NULL);
+	if (!stream) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	data_size = php_stream_copy_to_mem(stream, &data, PHP_STREAM_COPY_ALL, 0);
+	php_stream_close(stream);
+	if (!data_size) {
+		if (data) {
+			efree(data);
+		}
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(bytes_in) = (long)data_size;
+	pwp_stats_lap(PHP_WEBP_STAGE_IO);
+
+	if (JPEGGetInfo((const uint8 *)data, (int)data_size,
+			&width, &height) == webp_failure
+	) {
+		efree(data);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode JPEG image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, ENCODER_FRAMES))
+	) {
+		efree(data);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
+
+	uv_width = (width + 1) >> 1;
+	uv_height = (height + 1) >> 1;
+	y_nmemb = (size_t)(width * height);
+	uv_nmemb = (size_t)(uv_width * uv_height);
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	if (yuv_buf == NULL) {
+		efree(data);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	y_ptr = yuv_buf;
+	u_ptr = y_ptr + y_nmemb;
+	v_ptr = u_ptr + uv_nmemb;
+
+	result = JPEGDecodeYUV420((const uint8 *)data, (int)data_size,
+			y_ptr, u_ptr, v_ptr, width, height);
+	efree(data);
+	if (result == webp_failure) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode JPEG image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+
+	pwp_encode_config(&config, pwp_quality_to_qp(quality));
+	pwp_encode_deadline(&config, width, height, WEBPG(encode_deadline_ms));
+	result = WebPEncodeEx(y_ptr, u_ptr, v_ptr,
+			width, height, width,
+			uv_width, uv_height, uv_width,
+			&config, &out, &out_size_bytes, NULL);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	if (result == webp_failure) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(bytes_out) = (long)out_size_bytes;
+
+	RETVAL_STRINGL((char *)out, out_size_bytes, 1);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_OUTPUT, out);
+	pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+	pwp_stats_end(1);
+}
+
+/* }}} */
+/* {{{ webp_to_jpeg() */
+
+/**
+ * string webp_to_jpeg(string data [, int quality = 75])
+ * Convert WebP data to JPEG data. The decoded YUV planes are written
+ * as they are, without going through RGB.
+ */
+static PHP_FUNCTION(webp_to_jpeg)
+{
+	const char *data = NULL;
+	int data_size = 0;
+	long quality = DEFAULT_JPEG_QUALITY;
+	smart_str jpeg = { NULL, 0, 0 };
+
+	int width, height, uv_width, uv_height;
+	size_t y_nmemb, uv_nmemb;
+	uint8 *yuv_buf, *y_ptr, *u_ptr, *v_ptr;
+	WebPResult result;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"s|l", &data, &data_size, &quality)
+	) {
+		return;
+	}
+	if (quality < 0L) {
+		quality = 0L;
+	} else if (quality > 100L) {
+		quality = 100L;
+	}
+
+	pwp_stats_begin(PHP_WEBP_OP_DECODE);
+	PWP_STATS(bytes_in) = (long)data_size;
+	pwp_stats_quantizer(data, (size_t)data_size);
+
+	if (WebPGetInfo((const uint8 *)data, data_size,
+			&width, &height) == webp_failure
+	) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, DECODER_FRAMES))
+	) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
+
+	uv_width = (width + 1) >> 1;
+	uv_height = (height + 1) >> 1;
+	y_nmemb = (size_t)(width * height);
+	uv_nmemb = (size_t)(uv_width * uv_height);
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	if (yuv_buf == NULL) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	y_ptr = yuv_buf;
+	u_ptr = y_ptr + y_nmemb;
+	v_ptr = u_ptr + uv_nmemb;
+
+	result = WebPDecodeInto((const uint8 *)data, data_size,
+			y_ptr, u_ptr, v_ptr, width, uv_width, width, height);
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+	if (result == webp_success) {
+		result = JPEGEncodeYUV420(y_ptr, u_ptr, v_ptr, width, height,
+				(int)quality, pwp_smart_str_writer, &jpeg);
+		pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+		if (result == webp_failure) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode JPEG image");
+		}
+	} else {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+	}
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+
+	if (result == webp_failure) {
+		smart_str_free(&jpeg);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(bytes_out) = (long)jpeg.len;
+	PWP_STATS(alloc_bytes) += (long)jpeg.a;
+
+	smart_str_0(&jpeg);
+	RETVAL_STRINGL(jpeg.c, jpeg.len, 0);
+	pwp_stats_end(1);
+}
+
+/* }}} */
+#endif
+#ifdef HAVE_WEBP_PNG
+/* {{{ webp_from_png() */
+
+/**
+ * string webp_from_png(string filename [, int quality = WEBP_DEFAULT_QUALITY])
+ * Convert a PNG file to WebP data. The rows are read from the file two
+ * at a time and converted straight into the YUV planes, so neither the
+ * file nor an RGB frame is held in memory, except for the samples of an
+ * interlaced image. The alpha channel is dropped.
+ */
+static PHP_FUNCTION(webp_from_png)
+{
+	const char *filename = NULL;
+	int filename_len = 0;
+	long quality = default_quality;
+	php_stream *stream;
+	uint8 head[29];
+	pwp_png_source source;
+
+	int width, height, uv_width, uv_height;
+	size_t y_nmemb, uv_nmemb, samples_size;
+	uint8 *yuv_buf, *y_ptr, *u_ptr, *v_ptr;
+	WebPEncodeConfig config;
+	WebPResult result;
+	unsigned char *out = NULL;
+	int out_size_bytes = 0;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"s|l", &filename, &filename_len, &quality)
+	) {
+		return;
+	}
+
+	pwp_stats_begin(PHP_WEBP_OP_ENCODE);
+
+	stream = pwp_file_open(filename, "rb", NULL);
+	if (!stream) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	/* the signature and the IHDR chunk are enough for the dimensions,
+	 * and its last byte tells whether the image is interlaced */
+	if (php_stream_read(stream, (char *)head, sizeof(head)) != sizeof(head)
+		|| PNGGetInfo(head, (int)sizeof(head), &width, &height) == webp_failure
+	) {
+		php_stream_close(stream);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode PNG image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	/* the passes of an interlaced image are gathered into a whole frame of
+	 * up to 3 bytes a pixel before they are converted */
+	samples_size = head[28] ? (size_t)width * (size_t)height * 3 : 0;
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, ENCODER_FRAMES)
+				+ samples_size)
+	) {
+		php_stream_close(stream);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
+	pwp_stats_lap(PHP_WEBP_STAGE_IO);
+
+	uv_width = (width + 1) >> 1;
+	uv_height = (height + 1) >> 1;
+	y_nmemb = (size_t)(width * height);
+	uv_nmemb = (size_t)(uv_width * uv_height);
+	yuv_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_YUV,
+			y_nmemb + 2 * uv_nmemb);
+	if (yuv_buf == NULL) {
+		php_stream_close(stream);
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	y_ptr = yuv_buf;
+	u_ptr = y_ptr + y_nmemb;
+	v_ptr = u_ptr + uv_nmemb;
+
+	/* reading and converting are interleaved, and counted as conversion */
+	source.stream = stream;
+	source.head = head;
+	source.head_size = sizeof(head);
+	source.head_pos = 0;
+	source.bytes_in = 0;
+#ifdef ZTS
+	source.tsrm_ls = tsrm_ls;
+#endif
+	result = PNGDecodeYUV420Stream(pwp_png_reader, &source,
+			y_ptr, u_ptr, v_ptr, width, height);
+	php_stream_close(stream);
+	PWP_STATS(bytes_in) = (long)source.bytes_in;
+	if (result == webp_failure) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode PNG image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+
+	pwp_encode_config(&config, pwp_quality_to_qp(quality));
+	pwp_encode_deadline(&config, width, height, WEBPG(encode_deadline_ms));
+	result = WebPEncodeEx(y_ptr, u_ptr, v_ptr,
+			width, height, width,
+			uv_width, uv_height, uv_width,
+			&config, &out, &out_size_bytes, NULL);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_YUV, yuv_buf);
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	if (result == webp_failure) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode WebP image");
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+	PWP_STATS(bytes_out) = (long)out_size_bytes;
+
+	RETVAL_STRINGL((char *)out, out_size_bytes, 1);
+	pwp_scratch_put(PHP_WEBP_SCRATCH_OUTPUT, out);
+	pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+	pwp_stats_end(1);
+}
+
+/* }}} */
+#endif
+/* {{{ webp_last_stats() */
+
+/**
+ * array webp_last_stats(void)
+ * Get the statistics of the last encode or decode call.
+ */
+static PHP_FUNCTION(webp_last_stats)
+{
+	const php_webp_stats *stats = &WEBPG(last_stats);
+	zval *times;
+	double total = 0.0;
+	int i;
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	if (!WEBPG(stats_enabled) || stats->op == PHP_WEBP_OP_NONE) {
+		RETURN_FALSE;
+	}
+
+	MAKE_STD_ZVAL(times);
+	array_init(times);
+	for (i = 0; i < PHP_WEBP_NUM_STAGES; i++) {
+		add_assoc_double(times, (char *)pwp_stage_names[i], stats->time[i]);
+		total += stats->time[i];
+	}
+	add_assoc_double(times, "total", total);
+
+	array_init(return_value);
+	add_assoc_string(return_value, "operation", (char *)pwp_op_names[stats->op], 1);
+	add_assoc_long(return_value, "width", (long)stats->width);
+	add_assoc_long(return_value, "height", (long)stats->height);
+	add_assoc_long(return_value, "bytes_in", stats->bytes_in);
+	add_assoc_long(return_value, "bytes_out", stats->bytes_out);
+	add_assoc_long(return_value, "allocated_bytes", stats->alloc_bytes);
+	add_assoc_long(return_value, "degraded", (long)stats->degraded);
+	if (stats->qp >= 0) {
+		add_assoc_long(return_value, "qp", (long)stats->qp);
+	}
+	if (stats->metrics & PWP_METRIC_PSNR) {
+		add_assoc_double(return_value, "psnr", stats->psnr);
+	}
+	if (stats->metrics & PWP_METRIC_SSIM) {
+		add_assoc_double(return_value, "ssim", stats->ssim);
+	}
+	add_assoc_zval(return_value, "time", times);
+}
+
+/* }}} */
+#ifdef HAVE_WEBP_STATUS
+/* {{{ webp_get_status() */
+
+/**
+ * array webp_get_status(void)
+ * Get the statistics of every encode and decode call since the server
+ * started, across all of its worker processes. Calls are counted while
+ * webp.stats is on. The time is in seconds, the "latency" histogram is
+ * keyed by its upper bounds in milliseconds.
+ */
+static PHP_FUNCTION(webp_get_status)
+{
+	zval *op;
+	int i;
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	if (!pwp_status) {
+		RETURN_FALSE;
+	}
+
+	array_init(return_value);
+	add_assoc_long(return_value, "start_time", pwp_status->start_time);
+	for (i = 0; i < PHP_WEBP_NUM_OPS; i++) {
+		MAKE_STD_ZVAL(op);
+		pwp_status_op(op, &pwp_status->ops[i]);
+		add_assoc_zval(return_value, (char *)pwp_op_names[i], op);
+	}
+}
+
+/* }}} */
+#endif
+/* {{{ webp_get_metadata() */
+
+/**
+ * array webp_get_metadata(string filename)
+ * Get the metadata chunks (ICMT, ICOP, IART and INAM) of a WebP file.
+ * Only the chunk headers and the metadata are read.
+ */
+static PHP_FUNCTION(webp_get_metadata)
+{
+	const char *filename = NULL;
+	int filename_len = 0;
+	php_stream *stream;
+	int result;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"s", &filename, &filename_len)
+	) {
+		return;
+	}
+
+	stream = pwp_file_open(filename, "rb", NULL);
+	if (!stream) {
+		RETURN_FALSE;
+	}
+	result = pwp_metadata_read(stream, return_value);
+	php_stream_close(stream);
+	if (result == FAILURE) {
+		RETURN_FALSE;
+	}
+}
+
+/* }}} */
+/* {{{ webp_set_metadata() */
+
+/**
+ * bool webp_set_metadata(string filename, array metadata
+ *     [, string destination = NULL])
+ * Set or, with a null value, remove metadata chunks of a WebP file.
+ * Chunks not named in metadata are kept. With a destination, the image
+ * data is streamed from filename to it; without, or when destination is
+ * filename itself, the metadata at the end of filename is rewritten in
+ * place and the image data is not touched.
+ */
+static PHP_FUNCTION(webp_set_metadata)
+{
+	const char *filename = NULL, *destination = NULL;
+	int filename_len = 0, destination_len = 0;
+	zval *zmetadata = NULL, **entry;
+	HashTable *metadata;
+	HashPosition pos;
+	char *key;
+	uint key_len;
+	ulong num_key;
+
+	php_stream *src = NULL, *dst;
+	pwp_chunk chunks[MAX_CHUNKS];
+	const pwp_chunk *kept[METADATA_TAGS];
+	zval values[METADATA_TAGS];
+	int is_set[METADATA_TAGS], is_deleted[METADATA_TAGS];
+	char *kept_data[METADATA_TAGS];
+	char header[RIFF_HEADER_SIZE];
+	int i, t, num_chunks = 0;
+	size_t riff_size, body_end = RIFF_HEADER_SIZE, end, written;
+	int success = 1, modified = 0;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"sa|s!", &filename, &filename_len, &zmetadata,
+			&destination, &destination_len)
+	) {
+		return;
+	}
+
+	for (t = 0; t < METADATA_TAGS; t++) {
+		kept[t] = NULL;
+		kept_data[t] = NULL;
+		is_set[t] = is_deleted[t] = 0;
+	}
+
+	/* validate the new metadata */
+	metadata = Z_ARRVAL_P(zmetadata);
+	zend_hash_internal_pointer_reset_ex(metadata, &pos);
+	while (SUCCESS == zend_hash_get_current_data_ex(metadata, (void **)&entry, &pos)) {
+		t = -1;
+		if (HASH_KEY_IS_STRING == zend_hash_get_current_key_ex(metadata,
+				&key, &key_len, &num_key, 0, &pos)
+		) {
+			for (i = 0; i < METADATA_TAGS; i++) {
+				if (key_len == 5 && !memcmp(key, pwp_metadata_tags[i], 4)) {
+					t = i;
+				}
+			}
+		}
+		if (t < 0) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Metadata keys must be one of ICMT, ICOP, IART or INAM");
+			success = 0;
+			break;
+		}
+		if (is_set[t]) {
+			zval_dtor(&values[t]);
+			is_set[t] = 0;
+		}
+		if (Z_TYPE_PP(entry) == IS_NULL) {
+			is_deleted[t] = 1;
+		} else {
+			values[t] = **entry;
+			zval_copy_ctor(&values[t]);
+			convert_to_string(&values[t]);
+			is_set[t] = 1;
+			if (memchr(Z_STRVAL(values[t]), '\0', Z_STRLEN(values[t])) != NULL
+				|| Z_STRLEN(values[t]) >= MAX_METADATA_SIZE
+			) {
+				php_error_docref(NULL TSRMLS_CC, E_WARNING,
+						"Metadata must be a string shorter than %d bytes"
+						" without null bytes", MAX_METADATA_SIZE);
+				success = 0;
+				break;
+			}
+		}
+		zend_hash_move_forward_ex(metadata, &pos);
+	}
+
+	/* opening filename itself as the destination would truncate it before
+	 * it is read: rewrite it in place instead */
+	if (success && destination && pwp_same_file(filename, destination)) {
+		destination = NULL;
+	}
+
+	if (success) {
+		src = pwp_file_open(filename, destination ? "rb" : "r+b", NULL);
+		success = (src != NULL
+				&& SUCCESS == pwp_riff_scan(src, chunks, &num_chunks));
+	}
+
+	/* plan the output: the other chunks as they are, then the metadata */
+	riff_size = 4;
+	for (i = 0; success && i < num_chunks; i++) {
+		t = chunks[i].tag;
+		if (t < 0) {
+			riff_size += CHUNK_SPAN(&chunks[i]);
+			body_end = chunks[i].offset + CHUNK_SPAN(&chunks[i]);
+		} else if (!is_set[t] && !is_deleted[t]) {
+			kept[t] = &chunks[i];
+		}
+	}
+	for (t = 0; success && t < METADATA_TAGS; t++) {
+		if (is_set[t]) {
+			riff_size += CHUNK_HEADER_SIZE + ((Z_STRLEN(values[t]) + 2) & ~1);
+		} else if (kept[t]) {
+			riff_size += CHUNK_SPAN(kept[t]);
+		}
+	}
+
+	if (success && destination) {
+		/* stream the image data to the destination */
+		dst = pwp_file_open(destination, "wb", NULL);
+		if (dst == NULL) {
+			success = 0;
+		} else {
+			memcpy(header, "RIFF", 4);
+			pwp_put_le32(header + 4, riff_size);
+			memcpy(header + 8, "WEBP", 4);
+			success = (php_stream_write(dst, header, RIFF_HEADER_SIZE) == RIFF_HEADER_SIZE);
+			for (i = 0; success && i < num_chunks; i++) {
+				if (chunks[i].tag < 0) {
+					success = (SUCCESS == pwp_riff_copy(src, dst, &chunks[i]));
+				}
+			}
+			for (t = 0; success && t < METADATA_TAGS; t++) {
+				if (is_set[t]) {
+					success = (0 < pwp_riff_write(dst, pwp_metadata_tags[t],
+							Z_STRVAL(values[t]), Z_STRLEN(values[t]) + 1));
+				} else if (kept[t]) {
+					success = (SUCCESS == pwp_riff_copy(src, dst, kept[t]));
+				}
+			}
+			php_stream_close(dst);
+			if (!success) {
+				/* do not leave a truncated image behind */
+				VCWD_UNLINK(destination);
+			}
+		}
+	} else if (success) {
+		/* rewrite everything after the image data in place */
+		for (i = 0; success && i < num_chunks; i++) {
+			if (chunks[i].tag >= 0 && chunks[i].offset < body_end) {
+				php_error_docref(NULL TSRMLS_CC, E_WARNING,
+						"Metadata in front of the image data cannot be"
+						" rewritten in place, give a destination");
+				success = 0;
+			}
+		}
+		for (t = 0; success && t < METADATA_TAGS; t++) {
+			if (kept[t]) {
+				kept_data[t] = pwp_riff_read(src, kept[t]);
+				success = (kept_data[t] != NULL);
+			}
+		}
+		end = body_end;
+		success = success && (0 == php_stream_seek(src, (long)body_end, SEEK_SET));
+		for (t = 0; success && t < METADATA_TAGS; t++) {
+			modified = 1;
+			written = 0;
+			if (is_set[t]) {
+				written = pwp_riff_write(src, pwp_metadata_tags[t],
+						Z_STRVAL(values[t]), Z_STRLEN(values[t]) + 1);
+				success = (written > 0);
+			} else if (kept_data[t]) {
+				written = pwp_riff_write(src, pwp_metadata_tags[t],
+						kept_data[t], kept[t]->size);
+				success = (written > 0);
+			}
+			end += written;
+		}
+		/* the RIFF size goes last, once the chunks are all in place */
+		if (success) {
+			modified = 1;
+			success = (0 == php_stream_truncate_set_size(src, end));
+		}
+		if (success) {
+			pwp_put_le32(header, riff_size);
+			success = (0 == php_stream_seek(src, 4, SEEK_SET)
+					&& php_stream_write(src, header, 4) == 4);
+		}
+		if (!success && modified) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Failed to rewrite the metadata of %s, the file is corrupted",
+					filename);
+		} else if (!success) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Failed to rewrite the metadata of %s", filename);
+		}
+	}
+
+	if (src) {
+		php_stream_close(src);
+	}
+	for (t = 0; t < METADATA_TAGS; t++) {
+		if (is_set[t]) {
+			zval_dtor(&values[t]);
+		}
+		if (kept_data[t]) {
+			efree(kept_data[t]);
+		}
+	}
+
+	RETURN_BOOL(success);
+}
+
+/* }}} */
+/* {{{ WebPImage::__construct() */
+
+/**
+ * WebPImage::__construct(string data)
+ * Wrap WebP data. Only the frame header is read here, the image is
+ * decoded when its pixels are first needed. Throws an Exception if
+ * data is not WebP.
+ */
+static PHP_METHOD(WebPImage, __construct)
+{
+	const char *data = NULL;
+	int data_size = 0;
+	php_webp_image *intern;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"s", &data, &data_size)
+	) {
+		return;
+	}
+
+	intern = (php_webp_image *)zend_object_store_get_object(getThis() TSRMLS_CC);
+	if (FAILURE == pwp_image_attach(intern, estrndup(data, data_size), data_size)) {
+		zend_throw_exception(zend_exception_get_default(TSRMLS_C),
+				"Failed to decode WebP image", 0 TSRMLS_CC);
+	}
+}
+
+/* }}} */
+/* {{{ WebPImage::fromFile() */
+
+/**
+ * WebPImage WebPImage::fromFile(string filename)
+ * Create a WebPImage from file or URL.
+ */
+static PHP_METHOD(WebPImage, fromFile)
+{
+	const char *filename = NULL;
+	int filename_len = 0;
+	php_stream *stream;
+	char *data = NULL;
+	size_t data_size;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"s", &filename, &filename_len)
+	) {
+		return;
+	}
+
+	stream = pwp_file_open(filename, "rb", NULL);
+	if (!stream) {
+		RETURN_FALSE;
+	}
+	data_size = php_stream_copy_to_mem(stream, &data, PHP_STREAM_COPY_ALL, 0);
+	php_stream_close(stream);
+	if (data == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		RETURN_FALSE;
+	}
+
+	object_init_ex(return_value, pwp_image_ce);
+	if (FAILURE == pwp_image_attach(
+			(php_webp_image *)zend_object_store_get_object(return_value TSRMLS_CC),
+			data, (int)data_size)
+	) {
+		zval_dtor(return_value);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		RETURN_FALSE;
+	}
+}
+
+/* }}} */
+/* {{{ WebPImage::getWidth() */
+
+/**
+ * int WebPImage::getWidth(void)
+ * Get the width of the image.
+ */
+static PHP_METHOD(WebPImage, getWidth)
+{
+	php_webp_image *intern;
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	intern = pwp_image_fetch(getThis());
+	if (!intern) {
+		RETURN_FALSE;
+	}
+	RETURN_LONG((long)intern->width);
+}
+
+/* }}} */
+/* {{{ WebPImage::getHeight() */
+
+/**
+ * int WebPImage::getHeight(void)
+ * Get the height of the image.
+ */
+static PHP_METHOD(WebPImage, getHeight)
+{
+	php_webp_image *intern;
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	intern = pwp_image_fetch(getThis());
+	if (!intern) {
+		RETURN_FALSE;
+	}
+	RETURN_LONG((long)intern->height);
+}
+
+/* }}} */
+/* {{{ WebPImage::getQuality() */
+
+/**
+ * int WebPImage::getQuality(void)
+ * Get the quality the image was encoded with, as read from the
+ * quantizer in the frame header.
+ */
+static PHP_METHOD(WebPImage, getQuality)
+{
+	php_webp_image *intern;
+	int qp;
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	intern = pwp_image_fetch(getThis());
+	if (!intern) {
+		RETURN_FALSE;
+	}
+	if (WebPGetQuantizer((const uint8 *)intern->data, intern->data_size,
+			&qp) == webp_failure
+	) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		RETURN_FALSE;
+	}
+	RETURN_LONG(CALC_QUALITY(qp));
+}
+
+/* }}} */
+/* {{{ WebPImage::getData() */
+
+/**
+ * string WebPImage::getData(void)
+ * Get the WebP data, as it was given.
+ */
+static PHP_METHOD(WebPImage, getData)
+{
+	php_webp_image *intern;
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	intern = pwp_image_fetch(getThis());
+	if (!intern) {
+		RETURN_FALSE;
+	}
+	RETURN_STRINGL(intern->data, intern->data_size, 1);
+}
+
+/* }}} */
+/* {{{ WebPImage::getMetadata() */
+
+/**
+ * array WebPImage::getMetadata(void)
+ * Get the metadata chunks, like webp_get_metadata() does.
+ */
+static PHP_METHOD(WebPImage, getMetadata)
+{
+	php_webp_image *intern;
+	php_stream *stream;
+	int result;
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	intern = pwp_image_fetch(getThis());
+	if (!intern) {
+		RETURN_FALSE;
+	}
+	stream = php_stream_memory_open(TEMP_STREAM_READONLY,
+			intern->data, (size_t)intern->data_size);
+	if (!stream) {
+		RETURN_FALSE;
+	}
+	result = pwp_metadata_read(stream, return_value);
+	php_stream_close(stream);
+	if (result == FAILURE) {
+		RETURN_FALSE;
+	}
+}
+
+/* }}} */
+/* {{{ WebPImage::toGd() */
+
+/**
+ * resource WebPImage::toGd([array options])
+ * Create a new GD image, with the options of imagecreatefromwebp().
+ * The decoded planes are kept with the object, later calls only convert
+ * them again.
+ */
+static PHP_METHOD(WebPImage, toGd)
+{
+	zval *options = NULL;
+	php_webp_image *intern;
+	gdImagePtr im;
+	int width, height, uv_width, uv_height, colors, method;
+	uint8 *y_ptr, *u_ptr, *v_ptr;
+
+	if (FAILURE == zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+			"|a!", &options)
+	) {
+		return;
+	}
+	if (FAILURE == pwp_palette_options(options, &colors, &method)) {
+		RETURN_FALSE;
+	}
+
+	intern = pwp_image_fetch(getThis());
+	if (!intern) {
+		RETURN_FALSE;
+	}
+	width = intern->width;
+	height = intern->height;
+
+	pwp_stats_begin(PHP_WEBP_OP_DECODE);
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
+	PWP_STATS(bytes_in) = (long)intern->data_size;
+	pwp_stats_quantizer(intern->data, (size_t)intern->data_size);
+
+	if (FAILURE == pwp_image_decode(intern)
+		|| FAILURE == pwp_memory_check((size_t)width * (size_t)height
+				* (colors ? 1 : sizeof(int)))
+	) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	uv_width = (width + 1) >> 1;
+	uv_height = (height + 1) >> 1;
+	y_ptr = (uint8 *)intern->yuv;
+	u_ptr = y_ptr + (size_t)width * height;
+	v_ptr = u_ptr + (size_t)uv_width * uv_height;
+
+	im = pwp_yuv_to_image(y_ptr, u_ptr, v_ptr, width, height, colors, method);
+	if (!im) {
+		pwp_stats_end(0);
+		RETURN_FALSE;
+	}
+
+	ZEND_REGISTER_RESOURCE(return_value, im, le_gd);
+	PWP_STATS(bytes_out) = (long)(width * height * (colors ? 1 : sizeof(int)));
+	pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+	pwp_stats_end(1);
+}
+
+/* }}} */
+/* {{{ _pwp_stream_open() */
+
+static php_stream *
+_pwp_stream_open(const char *filename, const char *mode,
+                 int options, char **opened_path TSRMLS_DC)
+{
+	php_stream *stream;
+	char *path = NULL;
+
+	stream = php_stream_open_wrapper((char *)filename, (char *)mode,
+			ENFORCE_SAFE_MODE | REPORT_ERRORS | options, &path);
+
+	if (stream == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"Argument 1 should be a valid filename");
+		return NULL;
+	}
+
+	if (opened_path != NULL) {
+		*opened_path = path;
+	} else {
+		efree(path);
+	}
+
+	return stream;
+}
+
+/* }}} */
+/* {{{ pwp_stats_now() */
+
+/*
+ * Returns a monotonic timestamp in seconds.
+ */
+static double
+pwp_stats_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+#endif
+}
+
+/* }}} */
+/* {{{ _pwp_stats_begin() */
+
+/*
+ * Starts collecting the statistics of an encode or decode call.
+ */
+static void
+_pwp_stats_begin(int op TSRMLS_DC)
+{
+	php_webp_stats *stats = &WEBPG(last_stats);
+
+	memset(stats, 0, sizeof(php_webp_stats));
+	stats->op = op;
+	stats->qp = -1;
+	if (WEBPG(stats_enabled)) {
+		stats->mark = pwp_stats_now();
+	}
+}
+
+/* }}} */
+/* {{{ _pwp_stats_lap() */
+
+/*
+ * Adds the time elapsed since the previous lap to the given stage.
+ */
+static void
+_pwp_stats_lap(int stage TSRMLS_DC)
+{
+	php_webp_stats *stats = &WEBPG(last_stats);
+	double now;
+
+	if (WEBPG(stats_enabled)) {
+		now = pwp_stats_now();
+		stats->time[stage] += now - stats->mark;
+		stats->mark = now;
+	}
+}
+
+/* }}} */
+/* {{{ _pwp_stats_end() */
+
+/*
+ * Adds the statistics of the finished call to the worker totals.
+ */
+static void
+_pwp_stats_end(int success TSRMLS_DC)
+{
+	const php_webp_stats *stats = &WEBPG(last_stats);
+	php_webp_totals *totals;
+	int i;
+
+	if (!WEBPG(stats_enabled) || stats->op == PHP_WEBP_OP_NONE) {
+		return;
+	}
+
+	totals = &WEBPG(totals)[stats->op];
+	totals->count++;
+	if (!success) {
+		totals->failures++;
+	}
+	totals->bytes_in += (double)stats->bytes_in;
+	totals->bytes_out += (double)stats->bytes_out;
+	for (i = 0; i < PHP_WEBP_NUM_STAGES; i++) {
+		totals->time[i] += stats->time[i];
+	}
+#ifdef HAVE_WEBP_STATUS
+	if (pwp_status) {
+		pwp_status_add(stats, success);
+	}
+#endif
+}
+
+/* }}} */
+/* {{{ _pwp_stats_quantizer() */
+
+/*
+ * Records the QP a decoded image was encoded with.
+ */
+static void
+_pwp_stats_quantizer(const char *data, size_t data_size TSRMLS_DC)
+{
+	int qp;
+
+	if (WEBPG(stats_enabled) && WebPGetQuantizer((const uint8 *)data,
+			(int)data_size, &qp) == webp_success
+	) {
+		PWP_STATS(qp) = qp;
+	}
+}
+
+/* }}} */
+#ifdef HAVE_WEBP_STATUS
+/* {{{ pwp_status_add() */
+
+/*
+ * Adds the statistics of a finished call to the status segment.
+ */
+static void
+pwp_status_add(const php_webp_stats *stats, int success)
+{
+	php_webp_status_op *op = &pwp_status->ops[stats->op];
+	double total = 0.0;
+	long ms;
+	int i;
+
+	for (i = 0; i < PHP_WEBP_NUM_STAGES; i++) {
+		total += stats->time[i];
+	}
+
+	PWP_ATOMIC_ADD(op->count, 1);
+	if (!success) {
+		PWP_ATOMIC_ADD(op->failures, 1);
+	}
+	PWP_ATOMIC_ADD(op->bytes_in, stats->bytes_in);
+	PWP_ATOMIC_ADD(op->bytes_out, stats->bytes_out);
+	PWP_ATOMIC_ADD(op->time_us, total * 1e6);
+	if (stats->qp >= 0 && stats->qp < PHP_WEBP_STATUS_QPS) {
+		PWP_ATOMIC_ADD(op->qp[stats->qp], 1);
+	}
+
+	ms = (long)(total * 1e3);
+	i = 0;
+	while (i < PHP_WEBP_STATUS_LATENCIES - 1 && ms >= (1L << i)) {
+		i++;
+	}
+	PWP_ATOMIC_ADD(op->latency[i], 1);
+}
+
+/* }}} */
+/* {{{ pwp_status_op() */
+
+/*
+ * Converts the counters of an operation in the status segment to an array.
+ * Each counter is read atomically, but not all of them at once.
+ */
+static void
+pwp_status_op(zval *zv, php_webp_status_op *op)
+{
+	zval *qp, *latency;
+	int i;
+
+	MAKE_STD_ZVAL(qp);
+	array_init(qp);
+	for (i = 0; i < PHP_WEBP_STATUS_QPS; i++) {
+		add_index_long(qp, i, PWP_ATOMIC_LOAD(op->qp[i]));
+	}
+
+	MAKE_STD_ZVAL(latency);
+	array_init(latency);
+	for (i = 0; i < PHP_WEBP_STATUS_LATENCIES - 1; i++) {
+		add_index_long(latency, 1L << i, PWP_ATOMIC_LOAD(op->latency[i]));
+	}
+	add_assoc_long(latency, "inf", PWP_ATOMIC_LOAD(op->latency[i]));
+
+	array_init(zv);
+	add_assoc_long(zv, "count", PWP_ATOMIC_LOAD(op->count));
+	add_assoc_long(zv, "failures", PWP_ATOMIC_LOAD(op->failures));
+	add_assoc_long(zv, "bytes_in", PWP_ATOMIC_LOAD(op->bytes_in));
+	add_assoc_long(zv, "bytes_out", PWP_ATOMIC_LOAD(op->bytes_out));
+	add_assoc_double(zv, "time", (double)PWP_ATOMIC_LOAD(op->time_us) * 1e-6);
+	add_assoc_zval(zv, "qp", qp);
+	add_assoc_zval(zv, "latency", latency);
+}
+
+/* }}} */
+#endif
+/* {{{ _pwp_scratch_get() */
+
+/*
+ * Returns a buffer of at least size bytes for the given scratch slot.
+ * The contents are undefined. The buffer of a slot is kept across calls and
+ * requests and grows to the largest size asked for; when the slot is in use
+ * or growing it would exceed webp.scratch_limit, a temporary buffer is
+ * returned instead. Either way it must be given back with pwp_scratch_put().
+ * Returns NULL with a warning if the allocation would exceed memory_limit.
+ */
+static void *
+_pwp_scratch_get(int slot, size_t size TSRMLS_DC)
+{
+	php_webp_scratch *scratch = &WEBPG(scratch)[slot];
+	long limit = WEBPG(scratch_limit);
+
+	scratch->used = 1;
+	if (!scratch->busy) {
+		if (scratch->size >= size) {
+			scratch->busy = 1;
+			return scratch->ptr;
+		}
+		if (limit > 0 && WEBPG(scratch_size) - scratch->size + size <= (size_t)limit) {
+			if (FAILURE == pwp_memory_check(size - scratch->size)) {
+				return NULL;
+			}
+			/* the old contents are not needed, so don't realloc */
+			pwp_scratch_free(scratch, &WEBPG(scratch_size));
+			scratch->ptr = pemalloc(size, 1);
+			scratch->size = size;
+			scratch->busy = 1;
+			WEBPG(scratch_size) += size;
+			PWP_STATS(alloc_bytes) += (long)size;
+			return scratch->ptr;
+		}
+	}
+
+	if (FAILURE == pwp_memory_check(size)) {
+		return NULL;
+	}
+	PWP_STATS(alloc_bytes) += (long)size;
+	return emalloc(size);
+}
+
+/* }}} */
+/* {{{ _pwp_scratch_put() */
+
+/*
+ * Gives back a buffer obtained from pwp_scratch_get().
+ */
+static void
+_pwp_scratch_put(int slot, void *ptr TSRMLS_DC)
+{
+	php_webp_scratch *scratch = &WEBPG(scratch)[slot];
+
+	if (ptr == NULL) {
+		return;
+	}
+	if (ptr == scratch->ptr) {
+		scratch->busy = 0;
+	} else {
+		efree(ptr);
+	}
+}
+
+/* }}} */
+/* {{{ _pwp_scratch_trim() */
+
+/*
+ * Releases the scratch buffers that have not been used for
+ * webp.scratch_idle_requests requests, and as many as needed to get
+ * back under webp.scratch_limit. Called at the end of every request.
+ */
+static void
+_pwp_scratch_trim(TSRMLS_D)
+{
+	long idle_requests = WEBPG(scratch_idle_requests);
+	long limit = WEBPG(scratch_limit);
+	int i;
+
+	for (i = 0; i < PHP_WEBP_NUM_SCRATCH; i++) {
+		php_webp_scratch *scratch = &WEBPG(scratch)[i];
+
+		/* a bailout may have left the buffer marked as in use */
+		scratch->busy = 0;
+		if (scratch->used) {
+			scratch->used = 0;
+			scratch->idle = 0;
+		} else {
+			scratch->idle++;
+		}
+		if ((idle_requests > 0 && scratch->idle >= idle_requests)
+			|| WEBPG(scratch_size) > (size_t)(limit > 0 ? limit : 0)
+		) {
+			pwp_scratch_free(scratch, &WEBPG(scratch_size));
+		}
+	}
+}
+
+/* }}} */
+/* {{{ pwp_scratch_free() */
+
+/*
+ * Frees the buffer of a scratch slot and subtracts its size from total.
+ */
+static void
+pwp_scratch_free(php_webp_scratch *scratch, size_t *total)
+{
+	if (scratch->ptr) {
+		pefree(scratch->ptr, 1);
+		*total -= scratch->size;
+		scratch->ptr = NULL;
+		scratch->size = 0;
+	}
+}
+
+/* }}} */
+/* {{{ pwp_output_alloc() */
+
+/*
+ * Allocator given to the encoder for its output buffer.
+ * opaque is the thread-safe resource manager handle on ZTS builds.
+ */
+static void *
+pwp_output_alloc(void *opaque, size_t size)
+{
+#ifdef ZTS
+	void ***tsrm_ls = (void ***)opaque;
+#endif
+
+	return pwp_scratch_get(PHP_WEBP_SCRATCH_OUTPUT, size);
+}
+
+/* }}} */
+/* {{{ pwp_output_release() */
+
+static void
+pwp_output_release(void *opaque, void *ptr)
+{
+#ifdef ZTS
+	void ***tsrm_ls = (void ***)opaque;
+#endif
+
+	pwp_scratch_put(PHP_WEBP_SCRATCH_OUTPUT, ptr);
+}
+
+/* }}} */
+/* {{{ _pwp_writer_init() */
+
+static void
+_pwp_writer_init(pwp_writer *writer, php_stream *stream,
+                 php_stream_bucket_brigade *brigade TSRMLS_DC)
+{
+	writer->stream = stream;
+	writer->brigade = brigade;
+	writer->failed = 0;
+#ifdef ZTS
+	writer->tsrm_ls = tsrm_ls;
+#endif
+}
+
+/* }}} */
+/* {{{ pwp_stream_writer() */
+
+/*
+ * Encoder writer: writes the output to a stream, or appends it to the
+ * output brigade of a filter, one bucket per chunk.
+ */
+static int
+pwp_stream_writer(void *opaque, const uint8 *data, size_t size)
+{
+	pwp_writer *writer = (pwp_writer *)opaque;
+	php_stream_bucket *bucket;
+	char *buf;
+	int persistent;
+#ifdef ZTS
+	void ***tsrm_ls = writer->tsrm_ls;
+#endif
+
+	if (writer->brigade) {
+		persistent = php_stream_is_persistent(writer->stream);
+		buf = (char *)pemalloc(size, persistent);
+		memcpy(buf, data, size);
+		bucket = php_stream_bucket_new(writer->stream, buf, size, 1, persistent TSRMLS_CC);
+		if (bucket == NULL) {
+			pefree(buf, persistent);
+			writer->failed = 1;
+			return 0;
+		}
+		php_stream_bucket_append(writer->brigade, bucket TSRMLS_CC);
+	} else if (php_stream_write(writer->stream, (const char *)data, size) != size) {
+		writer->failed = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* }}} */
+/* {{{ pwp_quality_to_qp() */
+
+/*
+ * Maps a quality of 0 to 100 to the quantization parameter of the encoder.
+ */
+static int
+pwp_quality_to_qp(long quality)
+{
+	if (quality == default_quality) {
+		return DEFAULT_QP;
+	} else if (quality <= 0L) {
+		return MAX_QP;
+	} else if (quality >= 100L) {
+		return MIN_QP;
+	} else {
+		return CALC_QP(quality);
+	}
+}
+
+/* }}} */
+/* {{{ _pwp_encode_config() */
+
+/*
+ * Sets up an encoder configuration whose output buffer comes from
+ * the scratch arena.
+ */
+static void
+_pwp_encode_config(WebPEncodeConfig *config, int qp TSRMLS_DC)
+{
+	WebPEncodeConfigInit(config, qp);
+	config->alloc = pwp_output_alloc;
+	/* a placeholder encoded after the image keeps the QP of the image */
+	if (PWP_STATS(qp) < 0) {
+		PWP_STATS(qp) = qp;
+	}
+	config->release = pwp_output_release;
+#ifdef ZTS
+	config->opaque = (void *)tsrm_ls;
+#endif
+}
+
+/* }}} */
+/* {{{ _pwp_encode_deadline() */
+
+/*
+ * Lowers the encoding effort to fit the time budget and records by how
+ * many steps it was lowered. A budget of 0 or less means no limit.
+ */
+static int
+_pwp_encode_deadline(WebPEncodeConfig *config, int width, int height,
+                     long deadline_ms TSRMLS_DC)
+{
+	int degraded = WebPEncodeConfigSetDeadline(config, width, height, deadline_ms);
+
+	if (degraded > PWP_STATS(degraded)) {
+		PWP_STATS(degraded) = degraded;
+	}
+
+	return degraded;
+}
+
+/* }}} */
+/* {{{ _pwp_check_size() */
+
+/*
+ * Checks the dimensions of an image against the format limit and
+ * webp.max_pixels. Emits a warning and returns FAILURE if they exceed.
+ */
+static int
+_pwp_check_size(int width, int height TSRMLS_DC)
+{
+	long max_pixels = WEBPG(max_pixels);
+
+	if (width > MAX_IMAGE_SIDE_LENGTH || height > MAX_IMAGE_SIDE_LENGTH
+		|| (max_pixels > 0 && (double)width * (double)height > (double)max_pixels)
+	) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"The image size is too large (%dx%d)", width, height);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_memory_check() */
+
+/*
+ * Checks that size more bytes fit under memory_limit. The persistent
+ * scratch buffers are counted as used, since they belong to this worker
+ * as much as the request memory does. Emits a warning and returns
+ * FAILURE if they don't fit.
+ */
+static int
+_pwp_memory_check(size_t size TSRMLS_DC)
+{
+	long limit = PG(memory_limit);
+	double usage;
+
+	if (limit <= 0) {
+		return SUCCESS;
+	}
+
+	usage = (double)zend_memory_usage(0 TSRMLS_CC) + (double)WEBPG(scratch_size);
+	if (usage + (double)size > (double)limit) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"Allowed memory size of %ld bytes would be exceeded"
+				" (tried to allocate %lu bytes)", limit, (unsigned long)size);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/* }}} */
+#ifdef HAVE_WEBP_JPEG
+/* {{{ pwp_smart_str_writer() */
+
+/*
+ * Writer appending the output of webpio to a smart_str.
+ */
+static int
+pwp_smart_str_writer(void *opaque, const uint8 *data, size_t size)
+{
+	smart_str_appendl((smart_str *)opaque, (const char *)data, size);
+	return 1;
+}
+
+/* }}} */
+#endif
+#ifdef HAVE_WEBP_PNG
+/* {{{ pwp_png_reader() */
+
+/*
+ * Reader feeding libpng from a stream, handing back the bytes read
+ * ahead for PNGGetInfo first.
+ */
+static size_t
+pwp_png_reader(void *opaque, uint8 *data, size_t size)
+{
+	pwp_png_source *source = (pwp_png_source *)opaque;
+	size_t count;
+#ifdef ZTS
+	void ***tsrm_ls = source->tsrm_ls;
+#endif
+
+	if (source->head_pos < source->head_size) {
+		count = source->head_size - source->head_pos;
+		if (count > size) {
+			count = size;
+		}
+		memcpy(data, source->head + source->head_pos, count);
+		source->head_pos += count;
+	} else {
+		count = php_stream_read(source->stream, (char *)data, size);
+	}
+	source->bytes_in += count;
+
+	return count;
+}
+
+/* }}} */
+#endif
+/* {{{ _pwp_measure() */
+
+/*
+ * Decodes the output into the scratch arena and compares it with the
+ * planes it was encoded from. The results go to the statistics.
+ */
+static int
+_pwp_measure(const uint8 *y_ptr, const uint8 *u_ptr, const uint8 *v_ptr,
+             int width, int height, const unsigned char *out, int out_size_bytes,
+             int metrics TSRMLS_DC)
+{
+	int uv_width = (width + 1) >> 1;
+	size_t y_nmemb = (size_t)(width * height);
+	size_t uv_nmemb = (size_t)(uv_width * ((height + 1) >> 1));
+	uint8 *recon_buf;
+
+	/* decode the output into the arena rather than a malloc'd frame */
+	recon_buf = (uint8 *)pwp_scratch_get(PHP_WEBP_SCRATCH_RECON,
+			y_nmemb + 2 * uv_nmemb);
+	if (recon_buf == NULL || WebPDecodeInto(out, out_size_bytes,
+			recon_buf, recon_buf + y_nmemb, recon_buf + y_nmemb + uv_nmemb,
+			width, uv_width, width, height) == webp_failure
+	) {
+		pwp_scratch_put(PHP_WEBP_SCRATCH_RECON, recon_buf);
+		return FAILURE;
+	}
+
+	if (metrics & PWP_METRIC_PSNR) {
+		PWP_STATS(psnr) = GetPSNRYuv(y_ptr, u_ptr, v_ptr,
+				recon_buf, recon_buf + y_nmemb, recon_buf + y_nmemb + uv_nmemb,
+				width, height);
+	}
+	if (metrics & PWP_METRIC_SSIM) {
+		PWP_STATS(ssim) = GetSSIMYuv(y_ptr, u_ptr, v_ptr,
+				recon_buf, recon_buf + y_nmemb, recon_buf + y_nmemb + uv_nmemb,
+				width, height, metrics & PWP_METRIC_SSIM_CHROMA);
+	}
+	PWP_STATS(metrics) = metrics;
+	pwp_scratch_put(PHP_WEBP_SCRATCH_RECON, recon_buf);
+	pwp_stats_lap(PHP_WEBP_STAGE_PSNR);
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_option_long() */
+
+/*
+ * Reads an integer (or boolean) option. value is left alone when options
+ * is NULL or does not have the key.
+ */
+static int
+_pwp_option_long(zval *options, const char *name, long *value TSRMLS_DC)
+{
+	zval **entry, tmp;
+
+	if (options == NULL || FAILURE == zend_hash_find(Z_ARRVAL_P(options),
+			(char *)name, strlen(name) + 1, (void **)&entry)
+	) {
+		return FAILURE;
+	}
+	tmp = **entry;
+	zval_copy_ctor(&tmp);
+	convert_to_long(&tmp);
+	*value = Z_LVAL(tmp);
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_option_double() */
+
+/*
+ * Reads a float option, the same way as _pwp_option_long().
+ */
+static int
+_pwp_option_double(zval *options, const char *name, double *value TSRMLS_DC)
+{
+	zval **entry, tmp;
+
+	if (options == NULL || FAILURE == zend_hash_find(Z_ARRVAL_P(options),
+			(char *)name, strlen(name) + 1, (void **)&entry)
+	) {
+		return FAILURE;
+	}
+	tmp = **entry;
+	zval_copy_ctor(&tmp);
+	convert_to_double(&tmp);
+	*value = Z_DVAL(tmp);
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_image_to_yuv() */
+
+/*
+ * Converts a GD image to Y, U, V planes with unpadded rows.
+ */
+static int
+_pwp_image_to_yuv(gdImagePtr im, uint8 *y_ptr, uint8 *u_ptr, uint8 *v_ptr TSRMLS_DC)
+{
+	int x, y, width, height, words_per_line;
+	size_t y_nmemb;
+	uint32 *pix_buf, *pix_ptr;
+
+	width = gdImageSX(im);
+	height = gdImageSY(im);
+	y_nmemb = (size_t)(width * height);
+	words_per_line = width;
+	if (gdImageTrueColor(im)) {
+		uint32 chroma_bits = 0;
+		pix_buf = (uint32 *)pwp_scratch_get(PHP_WEBP_SCRATCH_PIXELS,
+				y_nmemb * sizeof(uint32));
+		if (pix_buf == NULL) {
+			return FAILURE;
+		}
+		pix_ptr = pix_buf;
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				*pix_ptr = (uint32)gdImageTrueColorPixel(im, x, y) << 8;
+				/* non-zero if r != g or g != b */
+				chroma_bits |= *pix_ptr ^ (*pix_ptr >> 8);
+				pix_ptr++;
+			}
+		}
+		PWP_STATS(bytes_in) = (long)(y_nmemb * sizeof(int));
+		pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+		if ((chroma_bits & 0x00ffff00U) == 0) {
+			GrayRGBAToYUV420(pix_buf, words_per_line, width, height,
+					y_ptr, u_ptr, v_ptr, pwp_conversion_threads(width, height));
+		} else {
+			RGBAToYUV420Threaded(pix_buf, words_per_line, width, height,
+					y_ptr, u_ptr, v_ptr, pwp_conversion_threads(width, height));
+		}
+		pwp_scratch_put(PHP_WEBP_SCRATCH_PIXELS, pix_buf);
+	} else {
+		/* convert straight from the palette indices */
+		uint32 palette[gdMaxColors];
+		int c;
+		for (c = 0; c < gdMaxColors; c++) {
+			palette[c] = (((uint32)im->red[c]) << 24)
+					| (((uint32)im->green[c]) << 16)
+					| (((uint32)im->blue[c]) << 8);
+		}
+		PWP_STATS(bytes_in) = (long)y_nmemb;
+		pwp_stats_lap(PHP_WEBP_STAGE_PACK);
+		PaletteToYUV420((const uint8 * const *)im->pixels, palette,
+				width, height, y_ptr, u_ptr, v_ptr,
+				pwp_conversion_threads(width, height));
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_riff_scan() */
+
+/*
+ * Reads the chunk headers of a WebP file, seeking over the chunk data.
+ * The RIFF header and the VP8 chunk that must come first are checked by
+ * SkipRiffHeader(), like the decoder does.
+ */
+static int
+_pwp_riff_scan(php_stream *stream, pwp_chunk *chunks, int *num_chunks TSRMLS_DC)
+{
+	unsigned char header[WEBP_HEADER_SIZE];
+	const uint8 *data = header;
+	int data_size = WEBP_HEADER_SIZE;
+	uint32 vp8_size;
+	size_t riff_end, pos, size;
+	int i, t, n = 0;
+
+	if (php_stream_read(stream, (char *)header, WEBP_HEADER_SIZE) != WEBP_HEADER_SIZE) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Not a WebP file");
+		return FAILURE;
+	}
+	vp8_size = (uint32)SkipRiffHeader(&data, &data_size);
+	if (vp8_size == 0 || vp8_size == 0xffffffffU) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Not a WebP file");
+		return FAILURE;
+	}
+
+	riff_end = CHUNK_HEADER_SIZE + (size_t)pwp_get_le32(header + 4);
+	pos = RIFF_HEADER_SIZE;
+	while (pos + CHUNK_HEADER_SIZE <= riff_end) {
+		if (n == MAX_CHUNKS) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Too many chunks");
+			return FAILURE;
+		}
+		if (0 != php_stream_seek(stream, (long)pos, SEEK_SET)
+			|| php_stream_read(stream, (char *)header, CHUNK_HEADER_SIZE) != CHUNK_HEADER_SIZE
+		) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Truncated WebP file");
+			return FAILURE;
+		}
+		size = (size_t)pwp_get_le32(header + 4);
+		if (size > riff_end - pos - CHUNK_HEADER_SIZE) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Inconsistent chunk size");
+			return FAILURE;
+		}
+		memcpy(chunks[n].id, header, 4);
+		chunks[n].offset = pos;
+		chunks[n].size = size;
+		chunks[n].tag = -1;
+		for (t = 0; t < METADATA_TAGS; t++) {
+			if (!memcmp(header, pwp_metadata_tags[t], 4)) {
+				chunks[n].tag = t;
+			}
+		}
+		pos += CHUNK_SPAN(&chunks[n]);
+		n++;
+	}
+
+	if (n == 0 || memcmp(chunks[0].id, "VP8 ", 4)) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"The first chunk is not VP8 image data");
+		return FAILURE;
+	}
+	for (i = 0; i < n; i++) {
+		if (chunks[i].tag >= 0 && chunks[i].size > MAX_METADATA_SIZE) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Metadata chunk is too large");
+			return FAILURE;
+		}
+	}
+
+	*num_chunks = n;
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_riff_read() */
+
+/*
+ * Reads the data of a chunk into an emalloc'ed buffer.
+ */
+static char *
+_pwp_riff_read(php_stream *stream, const pwp_chunk *chunk TSRMLS_DC)
+{
+	char *data = (char *)emalloc(chunk->size + 1);
+
+	if (0 != php_stream_seek(stream, (long)(chunk->offset + CHUNK_HEADER_SIZE), SEEK_SET)
+		|| php_stream_read(stream, data, chunk->size) != chunk->size
+	) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Truncated WebP file");
+		efree(data);
+		return NULL;
+	}
+	data[chunk->size] = '\0';
+
+	return data;
+}
+
+/* }}} */
+/* {{{ _pwp_riff_copy() */
+
+/*
+ * Copies a whole chunk, header and padding included, between streams.
+ */
+static int
+_pwp_riff_copy(php_stream *src, php_stream *dst, const pwp_chunk *chunk TSRMLS_DC)
+{
+	const size_t span = CHUNK_SPAN(chunk);
+
+	if (0 != php_stream_seek(src, (long)chunk->offset, SEEK_SET)
+		|| php_stream_copy_to_stream(src, dst, span) != span
+	) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to copy the %.4s chunk",
+				chunk->id);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ pwp_riff_write() */
+
+/*
+ * Writes a chunk with the given data, padded to an even size.
+ * Returns the number of bytes written, or 0 on failure.
+ */
+static size_t
+pwp_riff_write(php_stream *stream, const char *id, const char *data, size_t size)
+{
+	char header[CHUNK_HEADER_SIZE];
+	const size_t pad = size & 1;
+
+	memcpy(header, id, 4);
+	pwp_put_le32(header + 4, size);
+	if (php_stream_write(stream, header, CHUNK_HEADER_SIZE) != CHUNK_HEADER_SIZE
+		|| php_stream_write(stream, data, size) != size
+		|| (pad && php_stream_write(stream, "", 1) != 1)
+	) {
+		return 0;
+	}
+
+	return CHUNK_HEADER_SIZE + size + pad;
+}
+
+/* }}} */
+/* {{{ _pwp_same_file() */
+
+/*
+ * Tells whether two paths name the same existing file, through their
+ * resolved paths or, for hard links, their inode numbers.
+ */
+static int
+_pwp_same_file(const char *path1, const char *path2 TSRMLS_DC)
+{
+	char real1[MAXPATHLEN], real2[MAXPATHLEN];
+	php_stream_statbuf ssb1, ssb2;
+
+	if (VCWD_REALPATH(path1, real1) && VCWD_REALPATH(path2, real2)
+		&& !strcmp(real1, real2)
+	) {
+		return 1;
+	}
+	/* st_ino is always 0 on Windows */
+	if (0 == php_stream_stat_path(path1, &ssb1)
+		&& 0 == php_stream_stat_path(path2, &ssb2)
+		&& ssb1.sb.st_ino != 0
+		&& ssb1.sb.st_ino == ssb2.sb.st_ino
+		&& ssb1.sb.st_dev == ssb2.sb.st_dev
+	) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/* }}} */
+/* {{{ _pwp_metadata_read() */
+
+/*
+ * Reads the metadata chunks of a WebP stream into a new array.
+ */
+static int
+_pwp_metadata_read(php_stream *stream, zval *metadata TSRMLS_DC)
+{
+	pwp_chunk chunks[MAX_CHUNKS];
+	int i, num_chunks = 0;
+	char *data;
+	size_t size;
+
+	if (FAILURE == pwp_riff_scan(stream, chunks, &num_chunks)) {
+		return FAILURE;
+	}
+
+	array_init(metadata);
+	for (i = 0; i < num_chunks; i++) {
+		if (chunks[i].tag < 0) {
+			continue;
+		}
+		data = pwp_riff_read(stream, &chunks[i]);
+		if (data == NULL) {
+			zval_dtor(metadata);
+			return FAILURE;
+		}
+		/* strip the terminating null */
+		size = chunks[i].size;
+		if (size > 0 && data[size - 1] == '\0') {
+			size--;
+		}
+		add_assoc_stringl(metadata,
+				(char *)pwp_metadata_tags[chunks[i].tag], data, size, 0);
+	}
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ pwp_encode_filter_create() */
+
+/*
+ * Creates a webp.encode filter. The parameters are an array of
+ * "width" and "height" of the image, "quality" (default
+ * WEBP_DEFAULT_QUALITY) and "format", "rgba" (the default) or "rgb",
+ * the layout of the pixels written through the filter, row by row.
+ * The alpha channel is ignored, like imagewebp() does.
+ */
+static php_stream_filter *
+pwp_encode_filter_create(const char *filtername, zval *filterparams,
+                         int persistent TSRMLS_DC)
+{
+	pwp_encode_filter *data;
+	long width = 0L, height = 0L, quality = default_quality;
+	int channels = 4, uv_width;
+	size_t yuv_size, row_bytes;
+	zval **entry;
+
+	if (filterparams == NULL || Z_TYPE_P(filterparams) != IS_ARRAY) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"The %s filter needs an array of parameters", filtername);
+		return NULL;
+	}
+	pwp_option_long(filterparams, "width", &width);
+	pwp_option_long(filterparams, "height", &height);
+	pwp_option_long(filterparams, "quality", &quality);
+	if (SUCCESS == zend_hash_find(Z_ARRVAL_P(filterparams),
+			"format", sizeof("format"), (void **)&entry)
+	) {
+		if (Z_TYPE_PP(entry) == IS_STRING && !strcasecmp(Z_STRVAL_PP(entry), "rgb")) {
+			channels = 3;
+		} else if (Z_TYPE_PP(entry) != IS_STRING || strcasecmp(Z_STRVAL_PP(entry), "rgba")) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"The format must be \"rgba\" or \"rgb\"");
+			return NULL;
+		}
+	}
+	if (width <= 0L || height <= 0L) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"The width and the height must be positive");
+		return NULL;
+	}
+	if (FAILURE == pwp_check_size((int)width, (int)height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, ENCODER_FRAMES))
+	) {
+		return NULL;
+	}
+
+	/* the planes, padded for the RGBA words that follow them */
+	uv_width = ((int)width + 1) >> 1;
+	yuv_size = (size_t)(width * height) + 2 * (size_t)uv_width * (size_t)((height + 1) >> 1);
+	yuv_size = (yuv_size + 3) & ~(size_t)3;
+	row_bytes = (size_t)width * channels;
+
+	data = (pwp_encode_filter *)pecalloc(1, sizeof(pwp_encode_filter), persistent);
+	data->width = (int)width;
+	data->height = (int)height;
+	data->channels = channels;
+	data->qp = pwp_quality_to_qp(quality);
+	data->persistent = persistent;
+	data->yuv = (uint8 *)pemalloc(yuv_size + 2 * row_bytes
+			+ 2 * (size_t)width * sizeof(uint32), persistent);
+	data->pixels = (uint32 *)(data->yuv + yuv_size);
+	data->raw = (uint8 *)(data->pixels + 2 * width);
+
+	return php_stream_filter_alloc(&pwp_encode_filter_ops, data, persistent);
+}
+
+/* }}} */
+/* {{{ pwp_encode_filter_func() */
+
+static php_stream_filter_status_t
+pwp_encode_filter_func(php_stream *stream, php_stream_filter *thisfilter,
+                       php_stream_bucket_brigade *buckets_in,
+                       php_stream_bucket_brigade *buckets_out,
+                       size_t *bytes_consumed, int flags TSRMLS_DC)
+{
+	pwp_encode_filter *data = (pwp_encode_filter *)thisfilter->abstract;
+	php_stream_bucket *bucket;
+	size_t consumed = 0;
+
+	while (buckets_in->head) {
+		bucket = buckets_in->head;
+		php_stream_bucket_unlink(bucket TSRMLS_CC);
+		pwp_encode_filter_feed(data, bucket->buf, bucket->buflen);
+		consumed += bucket->buflen;
+		php_stream_bucket_delref(bucket TSRMLS_CC);
+	}
+	if (bytes_consumed) {
+		*bytes_consumed = consumed;
+	}
+
+	if ((flags & PSFS_FLAG_FLUSH_CLOSE) && !data->done) {
+		data->done = 1;
+		if (FAILURE == pwp_encode_filter_flush(stream, data, buckets_out)) {
+			return PSFS_ERR_FATAL;
+		}
+		return PSFS_PASS_ON;
+	}
+
+	return PSFS_FEED_ME;
+}
+
+/* }}} */
+/* {{{ pwp_encode_filter_dtor() */
+
+static void
+pwp_encode_filter_dtor(php_stream_filter *thisfilter TSRMLS_DC)
+{
+	pwp_encode_filter *data = (pwp_encode_filter *)thisfilter->abstract;
+
+	if (data) {
+		pefree(data->yuv, data->persistent);
+		pefree(data, data->persistent);
+	}
+}
+
+/* }}} */
+/* {{{ pwp_encode_filter_feed() */
+
+/*
+ * Collects the pixels written through the filter, and converts them to
+ * YUV each time a pair of rows is complete.
+ */
+static void
+pwp_encode_filter_feed(pwp_encode_filter *data, const char *buf, size_t len)
+{
+	const int width = data->width;
+	const int uv_width = (width + 1) >> 1;
+	const size_t row_bytes = (size_t)width * data->channels;
+	uint8 *y_ptr = data->yuv;
+	uint8 *u_ptr = y_ptr + (size_t)width * data->height;
+	uint8 *v_ptr = u_ptr + (size_t)uv_width * ((data->height + 1) >> 1);
+	const uint8 *src;
+	size_t want, take, i, n;
+	int rows;
+
+	while (len > 0) {
+		rows = data->height - data->rows;
+		if (rows <= 0) {
+			data->extra += len;
+			return;
+		}
+		if (rows > 2) {
+			rows = 2;
+		}
+		want = rows * row_bytes - data->fill;
+		take = (len < want) ? len : want;
+		memcpy(data->raw + data->fill, buf, take);
+		data->fill += take;
+		buf += take;
+		len -= take;
+		if (take < want) {
+			return;
+		}
+
+		src = data->raw;
+		n = (size_t)rows * width;
+		if (data->channels == 4) {
+			for (i = 0; i < n; i++, src += 4) {
+				data->pixels[i] = ((uint32)src[0] << 24) | ((uint32)src[1] << 16)
+						| ((uint32)src[2] << 8) | (uint32)src[3];
+			}
+		} else {
+			for (i = 0; i < n; i++, src += 3) {
+				data->pixels[i] = ((uint32)src[0] << 24) | ((uint32)src[1] << 16)
+						| ((uint32)src[2] << 8);
+			}
+		}
+		RGBAToYUV420(data->pixels, width, width, rows,
+				y_ptr + (size_t)data->rows * width,
+				u_ptr + (size_t)(data->rows >> 1) * uv_width,
+				v_ptr + (size_t)(data->rows >> 1) * uv_width);
+		data->rows += rows;
+		data->fill = 0;
+	}
+}
+
+/* }}} */
+/* {{{ _pwp_encode_filter_flush() */
+
+/*
+ * Encodes the image once the stream closes, straight into buckets of
+ * the output brigade.
+ */
+static int
+_pwp_encode_filter_flush(php_stream *stream, pwp_encode_filter *data,
+                         php_stream_bucket_brigade *buckets_out TSRMLS_DC)
+{
+	const int width = data->width, height = data->height;
+	const int uv_width = (width + 1) >> 1, uv_height = (height + 1) >> 1;
+	uint8 *y_ptr, *u_ptr, *v_ptr;
+	WebPEncodeConfig config;
+	WebPResult result;
+	pwp_writer writer;
+	unsigned char *out = NULL;
+	int out_size_bytes = 0;
+
+	if (data->rows < height) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"Incomplete image: %d of %d rows were written", data->rows, height);
+		return FAILURE;
+	}
+	if (data->extra) {
+		php_error_docref(NULL TSRMLS_CC, E_NOTICE,
+				"Ignored %lu bytes past the end of the image", (unsigned long)data->extra);
+	}
+
+	pwp_stats_begin(PHP_WEBP_OP_ENCODE);
+	PWP_STATS(width) = width;
+	PWP_STATS(height) = height;
+
+	y_ptr = data->yuv;
+	u_ptr = y_ptr + (size_t)width * height;
+	v_ptr = u_ptr + (size_t)uv_width * uv_height;
+
+	pwp_encode_config(&config, data->qp);
+	pwp_encode_deadline(&config, width, height, WEBPG(encode_deadline_ms));
+	pwp_writer_init(&writer, stream, buckets_out);
+	config.writer = pwp_stream_writer;
+	config.writer_opaque = &writer;
+	result = WebPEncodeEx(y_ptr, u_ptr, v_ptr,
+			width, height, width,
+			uv_width, uv_height, uv_width,
+			&config, &out, &out_size_bytes, NULL);
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+
+	if (result == webp_failure) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode WebP image");
+		pwp_stats_end(0);
+		return FAILURE;
+	}
+	PWP_STATS(bytes_out) = (long)out_size_bytes;
+	pwp_stats_end(1);
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_palette_options() */
+
+/*
+ * Reads the "palette" and "dither" options of imagecreatefromwebp().
+ * colors is 0 for a truecolor image.
+ */
+static int
+_pwp_palette_options(zval *options, int *colors, int *method TSRMLS_DC)
+{
+	long palette = 0L, dither = 0L;
+
+	pwp_option_long(options, "palette", &palette);
+	pwp_option_long(options, "dither", &dither);
+	if (palette != 0L && (palette < 2L || palette > 256L)) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"The palette must have 2 to 256 colors");
+		return FAILURE;
+	}
+	*colors = (int)palette;
+	*method = dither ? WEBP_QUANTIZE_ORDERED : WEBP_QUANTIZE_MEDIAN_CUT;
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_yuv_to_image() */
+
+/*
+ * Converts decoded planes into a new truecolor image or, with colors,
+ * a palette image that never goes through a truecolor one.
+ */
+static gdImagePtr
+_pwp_yuv_to_image(uint8 *y_ptr, uint8 *u_ptr, uint8 *v_ptr,
+                  int width, int height, int colors, int method TSRMLS_DC)
+{
+	gdImagePtr im;
+	uint32 *pix_buf;
+	const uint32 *pix_ptr;
+	uint32 palette[256];
+	int x, y, c, num_colors;
+
+	if (colors) {
+		im = gdImageCreate(width, height);
+		if (!im) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to create image");
+			return NULL;
+		}
+		if (YUV420Quantize(y_ptr, u_ptr, v_ptr, width, height, colors, method,
+				im->pixels, palette, &num_colors,
+				pwp_conversion_threads(width, height)) == webp_failure
+		) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to quantize image");
+			gdImageDestroy(im);
+			return NULL;
+		}
+		for (c = 0; c < num_colors; c++) {
+			im->red[c] = (int)(palette[c] >> 24);
+			im->green[c] = (int)((palette[c] >> 16) & 0xff);
+			im->blue[c] = (int)((palette[c] >> 8) & 0xff);
+			im->open[c] = 0;
+		}
+		im->colorsTotal = num_colors;
+		pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+		return im;
+	}
+
+	/* every pixel is written by the conversion, no need to clear */
+	pix_buf = (uint32 *)pwp_scratch_get(PHP_WEBP_SCRATCH_PIXELS,
+			(size_t)width * (size_t)height * sizeof(uint32));
+	if (pix_buf == NULL) {
+		return NULL;
+	}
+
+	YUV420toRGBAThreaded(y_ptr, u_ptr, v_ptr, width, width, height,
+			pix_buf, pwp_conversion_threads(width, height));
+	pwp_stats_lap(PHP_WEBP_STAGE_CONVERT);
+
+	im = gdImageCreateTrueColor(width, height);
+	if (!im) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to create image");
+		pwp_scratch_put(PHP_WEBP_SCRATCH_PIXELS, pix_buf);
+		return NULL;
+	}
+
+	pix_ptr = pix_buf;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			im->tpixels[y][x] = (int)(*pix_ptr >> 8);
+			pix_ptr++;
+		}
+	}
+	pwp_scratch_put(PHP_WEBP_SCRATCH_PIXELS, pix_buf);
+
+	return im;
+}
+
+/* }}} */
+/* {{{ pwp_image_new() */
+
+static zend_object_value
+pwp_image_new(zend_class_entry *ce TSRMLS_DC)
+{
+	php_webp_image *intern;
+	zend_object_value retval;
+#if PHP_VERSION_ID < 50400
+	zval *tmp;
+#endif
+
+	intern = (php_webp_image *)ecalloc(1, sizeof(php_webp_image));
+	zend_object_std_init(&intern->std, ce TSRMLS_CC);
+#if PHP_VERSION_ID < 50400
+	zend_hash_copy(intern->std.properties, &ce->default_properties,
+			(copy_ctor_func_t)zval_add_ref, (void *)&tmp, sizeof(zval *));
+#else
+	object_properties_init(&intern->std, ce);
+#endif
+
+	retval.handle = zend_objects_store_put(intern,
+			(zend_objects_store_dtor_t)zend_objects_destroy_object,
+			(zend_objects_free_object_storage_t)pwp_image_free,
+			NULL TSRMLS_CC);
+	retval.handlers = &pwp_image_handlers;
+
+	return retval;
+}
+
+/* }}} */
+/* {{{ pwp_image_free() */
+
+static void
+pwp_image_free(void *object TSRMLS_DC)
+{
+	php_webp_image *intern = (php_webp_image *)object;
+
+	if (intern->data) {
+		efree(intern->data);
+	}
+	if (intern->yuv) {
+		efree(intern->yuv);
+	}
+	zend_object_std_dtor(&intern->std TSRMLS_CC);
+	efree(intern);
+}
+
+/* }}} */
+/* {{{ pwp_image_attach() */
+
+/*
+ * Hands data, an emalloc'ed WebP image, over to intern in place of what
+ * it held. Only the frame header is parsed. data is freed on failure.
+ */
+static int
+pwp_image_attach(php_webp_image *intern, char *data, int data_size)
+{
+	int width, height;
+
+	if (WebPGetInfo((const uint8 *)data, data_size,
+			&width, &height) == webp_failure
+	) {
+		efree(data);
+		return FAILURE;
+	}
+
+	if (intern->data) {
+		efree(intern->data);
+	}
+	if (intern->yuv) {
+		efree(intern->yuv);
+		intern->yuv = NULL;
+	}
+	intern->data = data;
+	intern->data_size = data_size;
+	intern->width = width;
+	intern->height = height;
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_image_fetch() */
+
+/*
+ * Returns the WebPImage behind object, or NULL if it holds no image
+ * because the constructor was not called or failed.
+ */
+static php_webp_image *
+_pwp_image_fetch(zval *object TSRMLS_DC)
+{
+	php_webp_image *intern;
+
+	intern = (php_webp_image *)zend_object_store_get_object(object TSRMLS_CC);
+	if (intern->data == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"The WebPImage object holds no image");
+		return NULL;
+	}
+
+	return intern;
+}
+
+/* }}} */
+/* {{{ _pwp_image_decode() */
+
+/*
+ * Decodes the planes of intern unless it already has them. They are
+ * kept until the object is freed.
+ */
+static int
+_pwp_image_decode(php_webp_image *intern TSRMLS_DC)
+{
+	const int width = intern->width, height = intern->height;
+	const int uv_width = (width + 1) >> 1, uv_height = (height + 1) >> 1;
+	const size_t y_nmemb = (size_t)width * height;
+	const size_t uv_nmemb = (size_t)uv_width * uv_height;
+	uint8 *yuv;
+
+	if (intern->yuv) {
+		return SUCCESS;
+	}
+	if (FAILURE == pwp_check_size(width, height)
+		|| FAILURE == pwp_memory_check(CODEC_FOOTPRINT(width, height, DECODER_FRAMES)
+				+ y_nmemb + 2 * uv_nmemb)
+	) {
+		return FAILURE;
+	}
+
+	yuv = (uint8 *)emalloc(y_nmemb + 2 * uv_nmemb);
+	if (WebPDecodeInto((const uint8 *)intern->data, intern->data_size,
+			yuv, yuv + y_nmemb, yuv + y_nmemb + uv_nmemb,
+			width, uv_width, width, height) == webp_failure
+	) {
+		efree(yuv);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode WebP image");
+		return FAILURE;
+	}
+	pwp_stats_lap(PHP_WEBP_STAGE_CODEC);
+	PWP_STATS(alloc_bytes) += (long)(y_nmemb + 2 * uv_nmemb);
+
+	intern->yuv = (unsigned char *)yuv;
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_conversion_threads() */
+
+/*
+ * Returns the number of threads to use for the colour conversion of
+ * a width x height frame. Frames smaller than webp.conversion_threshold
+ * pixels are always converted on the calling thread.
+ */
+static int
+_pwp_conversion_threads(int width, int height TSRMLS_DC)
+{
+	long threads = WEBPG(conversion_threads);
+	long threshold = WEBPG(conversion_threshold);
+
+	if (threads <= 1 || (double)width * (double)height < (double)threshold) {
+		return 1;
+	}
+	if (threads > WEBP_MAX_THREADS) {
+		threads = WEBP_MAX_THREADS;
+	}
+
+	return (int)threads;
+}
+
+/* }}} */
+#ifdef GD_API_IS_HIDDEN
+/* {{{ _pwp_gd_function_init() */
+
+/*
+ * Looks up a GD function, whose C API is not exported.
+ */
+static int
+_pwp_gd_function_init(const char *name, zval **name_ptr,
+                      zend_fcall_info *fci, zend_fcall_info_cache *fcc TSRMLS_DC)
+{
+	zval *zname;
+	int result;
+
+	MAKE_STD_ZVAL(zname);
+	ZVAL_STRING(zname, (char *)name, 1);
+
+#if ZEND_EXTENSION_API_NO >= 220090626
+	result = zend_fcall_info_init(zname, 0, fci, fcc, NULL, NULL TSRMLS_CC);
+#else
+	result = zend_fcall_info_init(zname, fci, fcc TSRMLS_CC);
+#endif
+
+	if (FAILURE == result) {
+		zval_ptr_dtor(&zname);
+		return FAILURE;
+	}
+	*name_ptr = zname;
+
+	return SUCCESS;
+}
+
+/* }}} */
+/* {{{ _pwp_gd_create() */
+
+/*
+ * Calls imagecreatetruecolor() or imagecreate() and takes the image out
+ * of the resource list, so that it is not freed with the result.
+ */
+static gdImagePtr
+_pwp_gd_create(zend_fcall_info *fci, zend_fcall_info_cache *fcc,
+               int sx, int sy TSRMLS_DC)
+{
+	gdImagePtr im = NULL;
+	zval *zim = NULL, *args;
+
+	MAKE_STD_ZVAL(args);
+	array_init(args);
+	add_next_index_long(args, (long)sx);
+	add_next_index_long(args, (long)sy);
+
+	zend_fcall_info_call(fci, fcc, &zim, args TSRMLS_CC);
+	if (zim) {
+		if (Z_TYPE_P(zim) == IS_RESOURCE) {
+			zend_rsrc_list_entry *le;
+
+			ZEND_FETCH_RESOURCE_NO_RETURN(im, gdImagePtr, &zim, -1, "Image", le_gd);
+			if (SUCCESS == zend_hash_index_find(&EG(regular_list),
+					(ulong)Z_LVAL_P(zim), (void **)&le)
+			) {
+				le->ptr = NULL;
+				le->type = le_fake;
+			}
+		}
+		zval_ptr_dtor(&zim);
+	}
+	zval_ptr_dtor(&args);
+
+	return im;
+}
+
+/* }}} */
+/* {{{ _pwp_gdImageCreateTrueColor() */
+
+static gdImagePtr
+_pwp_gdImageCreateTrueColor(int sx, int sy)
+{
+	TSRMLS_FETCH();
+
+	return _pwp_gd_create(&WEBPG(ict_fci), &WEBPG(ict_fcc), sx, sy TSRMLS_CC);
+}
+
+/* }}} */
+/* {{{ _pwp_gdImageCreate() */
+
+static gdImagePtr
+_pwp_gdImageCreate(int sx, int sy)
+{
+	TSRMLS_FETCH();
+
+	return _pwp_gd_create(&WEBPG(ic_fci), &WEBPG(ic_fcc), sx, sy TSRMLS_CC);
+}
+
+/* }}} */
+/* {{{ _pwp_gdImageDestroy() */
+
+/*
+ * Frees an image that never made it to a resource, through the resource
+ * destructor of GD.
+ */
+static void
+_pwp_gdImageDestroy(gdImagePtr im)
+{
+	TSRMLS_FETCH();
+
+	zend_list_delete(ZEND_REGISTER_RESOURCE(NULL, im, le_gd));
 }
 
 /* }}} */